@@ -1,17 +1,52 @@
+#include <array>
+#include <bitset>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cinttypes>
+#include <charconv>
 #include <cstddef>
 #include <cstdint>
+#include <csignal>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <condition_variable>
+#include <cwchar>
+#include <deque>
 #include <ctime>
 #include <iomanip>
 #include <iostream>
 #include <iterator>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <random>
 #include <memory>
 #include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
 #include <unistd.h>
+#include <dirent.h>
 #include <filesystem>
+#include <fstream>
+#include <functional>
 #include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <malloc.h>
+#include <poll.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <pwd.h>
 #include <grp.h>
@@ -19,6 +54,35 @@
 #include <vector>
 #include "ls.h"
 #include "cxxopts.hpp"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifdef LS_COUNT_ALLOCATIONS
+/* テストとベンチマークのビルドでは全てのoperator newを数える */
+namespace {
+std::atomic<uint64_t> g_allocation_count{0};
+std::atomic<uint64_t> g_allocated_bytes{0};
+} /* unnamed namespace */
+
+void *operator new(std::size_t size) {
+    g_allocation_count.fetch_add(1, std::memory_order_relaxed);
+    g_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    void *p = std::malloc(size == 0 ? 1 : size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+    std::free(p);
+}
+#endif
 
 namespace {
 struct TerminalSize {
@@ -26,221 +90,5780 @@ struct TerminalSize {
     unsigned short col;
 };
 
-struct DisplayFlags {
-    bool ignore_hidden_file;
-    DisplayFlags() : ignore_hidden_file(true) {};
+class PatternSet;
+class Predicate;
+
+class DirectorySource;
+
+/* -h、--si、--block-sizeで決まるサイズの表し方 */
+struct SizeFormat {
+    /* 基数baseで1桁か整数に丸め、K、M、Gなどを付けて表す */
+    bool human_readable = false;
+    uint64_t base = 1024;
+    /* この単位で割って切り上げる。0ならサイズは1バイト、ブロック数は1024バイト単位 */
+    uint64_t unit = 0;
+    /* --block-size=Mのように単位だけを指定されたときに数値の後ろに付ける文字列 */
+    std::string suffix;
+};
+
+/* --summarize-byで集計する単位 */
+enum class SummaryKey : uint8_t {
+    Owner,
+    Group,
+    Extension,
+    Type,
+};
+
+/* 一覧の並び順。名前以外は同じ値の中を名前順に並べる */
+enum class SortKey : uint8_t {
+    Name,
+    Size,       /* -S: 大きい順 */
+    Time,       /* -t: 更新日時の新しい順 */
+    Extension,  /* -X: 拡張子の辞書順 */
+    Version,    /* -v: 名前中の数字を数値として比べる */
+};
+
+struct DisplayFlags {
+    bool ignore_hidden_file;
+    std::shared_ptr<const PatternSet> ignore_patterns;
+    bool respect_gitignore;
+    std::shared_ptr<const Predicate> where;
+    /* 一覧の読み出し元。nullptrならカーネルから読む */
+    std::shared_ptr<const DirectorySource> source;
+    SizeFormat size_format;
+    /* -s: 各エントリの割り当て済みブロック数を名前の前に表示する */
+    bool show_blocks;
+    SortKey sort_key;
+    /* -r: 並び順を逆にする */
+    bool reverse;
+    /* --head、--tail: 並べた結果の先頭 (limit_from_endなら末尾) のlimit件だけを一覧する */
+    size_t limit;
+    bool limit_from_end;
+    /* --timeout: 列挙とstatを待つ期限。time_point::max()なら待ち続ける */
+    std::chrono::steady_clock::time_point deadline;
+    DisplayFlags()
+        : ignore_hidden_file(true), respect_gitignore(false), show_blocks(false), sort_key(SortKey::Name),
+          reverse(false), limit(SIZE_MAX), limit_from_end(false),
+          deadline(std::chrono::steady_clock::time_point::max()) {};
+};
+
+/* --statsで表示する計測値。無効なときはg_statsがnullptrで、計測箇所のコストは分岐1つだけになる */
+class Stats {
+public:
+    enum class Phase : uint8_t {
+        Enumerate,
+        Sort,
+        Filter,
+        Stat,
+        Nss,
+        Layout,
+        Output,
+        Count,
+    };
+
+    enum class Syscall : uint8_t {
+        OpenDirectory,
+        Lstat,
+        NssLookup,
+        Ioctl,
+        Write,
+        Count,
+    };
+
+    enum class Counter : uint8_t {
+        EntriesRead,
+        EntriesListed,
+        BytesWritten,
+        Count,
+    };
+
+    void AddPhaseTime(Phase phase, int64_t wall_ns, int64_t cpu_ns) {
+        m_wall_ns[static_cast<size_t>(phase)].fetch_add(wall_ns, std::memory_order_relaxed);
+        m_cpu_ns[static_cast<size_t>(phase)].fetch_add(cpu_ns, std::memory_order_relaxed);
+    }
+
+    void AddSyscall(Syscall syscall) {
+        m_syscalls[static_cast<size_t>(syscall)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void Add(Counter counter, uint64_t value) {
+        m_counters[static_cast<size_t>(counter)].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    static const char *PhaseName(Phase phase) {
+        static const char *names[] = {"enumerate", "sort", "filter", "stat", "nss", "layout", "output"};
+        return names[static_cast<size_t>(phase)];
+    }
+
+    uint64_t Get(Syscall syscall) const {
+        return m_syscalls[static_cast<size_t>(syscall)].load();
+    }
+
+    uint64_t Get(Counter counter) const {
+        return m_counters[static_cast<size_t>(counter)].load();
+    }
+
+    void Print(std::ostream& os) const {
+        static const char *syscalls[] = {"opendir", "lstat", "nss lookup", "ioctl", "write"};
+        char line[128];
+        std::snprintf(line, sizeof(line), "%-12s %12s %12s\n", "phase", "wall (ms)", "cpu (ms)");
+        os << line;
+        for (size_t i = 0; i < static_cast<size_t>(Phase::Count); i++) {
+            std::snprintf(line, sizeof(line), "%-12s %12.3f %12.3f\n", PhaseName(static_cast<Phase>(i)),
+                          m_wall_ns[i].load() / 1e6, m_cpu_ns[i].load() / 1e6);
+            os << line;
+        }
+        os << "entries: " << Get(Counter::EntriesRead) << " read, "
+           << Get(Counter::EntriesListed) << " listed\n";
+        os << "syscalls:";
+        for (size_t i = 0; i < static_cast<size_t>(Syscall::Count); i++) {
+            os << (i == 0 ? " " : ", ") << syscalls[i] << ' ' << Get(static_cast<Syscall>(i));
+        }
+        os << '\n';
+        os << "bytes written: " << Get(Counter::BytesWritten) << '\n';
+#ifdef LS_COUNT_ALLOCATIONS
+        os << "allocations: " << g_allocation_count.load() << " (" << g_allocated_bytes.load() << " bytes)\n";
+#endif
+        struct mallinfo2 heap = mallinfo2();
+        os << "heap in use: " << heap.uordblks + heap.hblkhd << " bytes\n";
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        os << "user: " << usage.ru_utime.tv_sec * 1000 + usage.ru_utime.tv_usec / 1000 << " ms, "
+           << "sys: " << usage.ru_stime.tv_sec * 1000 + usage.ru_stime.tv_usec / 1000 << " ms\n";
+        os << "peak RSS: " << usage.ru_maxrss << " KiB\n";
+    }
+private:
+    std::atomic<int64_t> m_wall_ns[static_cast<size_t>(Phase::Count)] = {};
+    std::atomic<int64_t> m_cpu_ns[static_cast<size_t>(Phase::Count)] = {};
+    std::atomic<uint64_t> m_syscalls[static_cast<size_t>(Syscall::Count)] = {};
+    std::atomic<uint64_t> m_counters[static_cast<size_t>(Counter::Count)] = {};
+};
+
+Stats *g_stats = nullptr;
+
+inline void CountSyscall(Stats::Syscall syscall) {
+    if (g_stats != nullptr) {
+        g_stats->AddSyscall(syscall);
+    }
+}
+
+inline void CountStats(Stats::Counter counter, uint64_t value) {
+    if (g_stats != nullptr) {
+        g_stats->Add(counter, value);
+    }
+}
+
+class OutputBuffer;
+
+/* --traceで書き出すスパン。時刻はCLOCK_MONOTONICのナノ秒 */
+struct TraceEvent {
+    int64_t begin_ns;
+    int64_t end_ns;
+    Stats::Phase phase;
+};
+
+/* スレッドごとのリングバッファ。書き込むのは持ち主のスレッドだけなので、記録にロックは要らない。
+   満杯になると古いイベントから上書きする */
+class TraceBuffer {
+public:
+    static constexpr size_t kCapacity = 1 << 14;
+
+    explicit TraceBuffer(pid_t tid)
+        : m_tid(tid), m_head(0), m_events(new TraceEvent[kCapacity]), m_next(nullptr) {}
+
+    void Push(const TraceEvent& event) {
+        uint64_t head = m_head.load(std::memory_order_relaxed);
+        m_events[head % kCapacity] = event;
+        m_head.store(head + 1, std::memory_order_release);
+    }
+
+    pid_t Tid() const { return m_tid; }
+    uint64_t Head() const { return m_head.load(std::memory_order_acquire); }
+    const TraceEvent& At(uint64_t index) const { return m_events[index % kCapacity]; }
+private:
+    friend class Tracer;
+    pid_t m_tid;
+    std::atomic<uint64_t> m_head;
+    std::unique_ptr<TraceEvent[]> m_events;
+    TraceBuffer *m_next;
+};
+
+/* 各スレッドのバッファを束ね、終了時にChromeのtrace event形式でまとめて書き出す */
+class Tracer {
+public:
+    Tracer() : m_id(s_next_id.fetch_add(1) + 1), m_buffers(nullptr) {}
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+    ~Tracer() {
+        for (TraceBuffer *buffer = m_buffers.load(); buffer != nullptr;) {
+            TraceBuffer *next = buffer->m_next;
+            delete buffer;
+            buffer = next;
+        }
+    }
+
+    void Record(Stats::Phase phase, int64_t begin_ns, int64_t end_ns) {
+        LocalBuffer()->Push(TraceEvent{begin_ns, end_ns, phase});
+    }
+
+    /* 記録中のスレッドが残っていない状態で呼ぶこと */
+    void Write(OutputBuffer& out) const;
+private:
+    TraceBuffer *LocalBuffer() {
+        thread_local TraceBuffer *buffer = nullptr;
+        thread_local uint64_t owner = 0;
+        if (owner != m_id) {
+            buffer = new TraceBuffer(gettid());
+            buffer->m_next = m_buffers.load(std::memory_order_relaxed);
+            while (!m_buffers.compare_exchange_weak(buffer->m_next, buffer, std::memory_order_release,
+                                                    std::memory_order_relaxed)) {
+            }
+            owner = m_id;
+        }
+        return buffer;
+    }
+
+    static std::atomic<uint64_t> s_next_id;
+    uint64_t m_id;
+    std::atomic<TraceBuffer*> m_buffers;
+};
+
+std::atomic<uint64_t> Tracer::s_next_id{0};
+
+Tracer *g_tracer = nullptr;
+
+/* --perf-countersで使うハードウェアカウンタ。perf_event_openでこのスレッドのユーザ空間だけを数える。
+   開けないイベントは報告でn/aとし、1つも開けなければAvailable()がfalseになる。
+   他のスレッドで読んでも開いたスレッドの値しか得られないので、PhaseTimerは開いたスレッドでだけ使う */
+class PerfCounters {
+public:
+    enum Event : uint8_t {
+        Cycles,
+        Instructions,
+        CacheMisses,
+        BranchMisses,
+        Count,
+    };
+    using Values = std::array<uint64_t, Event::Count>;
+
+    PerfCounters() : m_owner(std::this_thread::get_id()), m_leader(-1), m_opened(0), m_totals{}, m_entries(0) {
+        static const uint64_t configs[] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+        };
+        for (size_t i = 0; i < Event::Count; i++) {
+            struct perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.disabled = m_leader < 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            int fd = syscall(SYS_perf_event_open, &attr, 0, -1, m_leader, PERF_FLAG_FD_CLOEXEC);
+            m_slots[i] = fd < 0 ? -1 : m_opened++;
+            m_fds[i] = fd;
+            if (fd < 0 && m_error.empty()) {
+                m_error = std::strerror(errno);
+            }
+            if (fd >= 0 && m_leader < 0) {
+                m_leader = fd;
+            }
+        }
+        if (m_leader >= 0) {
+            ioctl(m_leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(m_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+    }
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+    ~PerfCounters() {
+        for (int fd : m_fds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    bool Available() const { return m_leader >= 0; }
+    /* カウンタを開いたスレッドかどうか */
+    bool OnOwnerThread() const { return std::this_thread::get_id() == m_owner; }
+    /* 最初に失敗したイベントの理由 */
+    const std::string& Error() const { return m_error; }
+
+    /* 現在の値を読む。多重化で止まっていた時間の分は比例で補う */
+    void Read(Values& values) const {
+        struct {
+            uint64_t nr;
+            uint64_t time_enabled;
+            uint64_t time_running;
+            uint64_t values[Event::Count];
+        } data;
+        values.fill(0);
+        if (read(m_leader, &data, sizeof(data)) < 0 || data.time_running == 0) {
+            return;
+        }
+        double scale = static_cast<double>(data.time_enabled) / data.time_running;
+        for (size_t i = 0; i < Event::Count; i++) {
+            if (m_slots[i] >= 0) {
+                values[i] = static_cast<uint64_t>(data.values[m_slots[i]] * scale);
+            }
+        }
+    }
+
+    void Add(Stats::Phase phase, const Values& begin, const Values& end) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (size_t i = 0; i < Event::Count; i++) {
+            m_totals[static_cast<size_t>(phase)][i] += end[i] - begin[i];
+        }
+    }
+
+    void AddEntries(uint64_t entries) { m_entries += entries; }
+
+    void Print(std::ostream& os) const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        char line[128];
+        std::snprintf(line, sizeof(line), "%-12s %14s %14s %6s %15s %15s\n",
+                      "phase", "cycles", "instructions", "IPC", "cache-miss/ent", "branch-miss/ent");
+        os << line;
+        for (size_t phase = 0; phase < static_cast<size_t>(Stats::Phase::Count); phase++) {
+            const Values& totals = m_totals[phase];
+            char columns[Event::Count][24];
+            for (size_t i = 0; i < Event::Count; i++) {
+                if (m_slots[i] < 0) {
+                    std::snprintf(columns[i], sizeof(columns[i]), "n/a");
+                } else if (i == CacheMisses || i == BranchMisses) {
+                    std::snprintf(columns[i], sizeof(columns[i]), "%.2f",
+                                  static_cast<double>(totals[i]) / std::max<uint64_t>(m_entries, 1));
+                } else {
+                    std::snprintf(columns[i], sizeof(columns[i]), "%" PRIu64, totals[i]);
+                }
+            }
+            char ipc[16] = "n/a";
+            if (m_slots[Cycles] >= 0 && m_slots[Instructions] >= 0 && totals[Cycles] > 0) {
+                std::snprintf(ipc, sizeof(ipc), "%.2f", static_cast<double>(totals[Instructions]) / totals[Cycles]);
+            }
+            std::snprintf(line, sizeof(line), "%-12s %14s %14s %6s %15s %15s\n",
+                          Stats::PhaseName(static_cast<Stats::Phase>(phase)),
+                          columns[Cycles], columns[Instructions], ipc, columns[CacheMisses], columns[BranchMisses]);
+            os << line;
+        }
+        os << "entries: " << m_entries << '\n';
+    }
+private:
+    std::thread::id m_owner;
+    int m_fds[Event::Count];
+    int m_slots[Event::Count];
+    int m_leader;
+    int m_opened;
+    std::string m_error;
+    mutable std::mutex m_mutex;
+    std::array<Values, static_cast<size_t>(Stats::Phase::Count)> m_totals;
+    std::atomic<uint64_t> m_entries;
+};
+
+PerfCounters *g_perf = nullptr;
+
+/* スコープの間を1つのフェーズとして計測する。入れ子になった場合、内側の時間やカウンタは外側に含めない。
+   --traceが有効ならスコープ全体を1つのスパンとして記録する */
+class PhaseTimer {
+public:
+    explicit PhaseTimer(Stats::Phase phase)
+        : m_phase(phase), m_stats(g_stats), m_tracer(g_tracer),
+          m_perf(g_perf != nullptr && g_perf->OnOwnerThread() ? g_perf : nullptr), m_parent(nullptr) {
+        if (m_stats == nullptr && m_tracer == nullptr && m_perf == nullptr) {
+            return;
+        }
+        Sample now;
+        Take(now);
+        m_begin = now.wall;
+        m_start = now;
+        if (m_stats != nullptr || m_perf != nullptr) {
+            m_parent = s_current;
+            if (m_parent != nullptr) {
+                m_parent->Charge(now);
+            }
+            s_current = this;
+        }
+    }
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+    ~PhaseTimer() {
+        if (m_stats == nullptr && m_tracer == nullptr && m_perf == nullptr) {
+            return;
+        }
+        Sample now;
+        Take(now);
+        if (m_tracer != nullptr) {
+            m_tracer->Record(m_phase, m_begin, now.wall);
+        }
+        if (m_stats != nullptr || m_perf != nullptr) {
+            Charge(now);
+            s_current = m_parent;
+            if (m_parent != nullptr) {
+                m_parent->m_start = now;
+            }
+        }
+    }
+private:
+    struct Sample {
+        int64_t wall;
+        int64_t cpu;
+        PerfCounters::Values counters;
+    };
+
+    void Take(Sample& sample) const {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        sample.wall = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        sample.cpu = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        if (m_perf != nullptr) {
+            m_perf->Read(sample.counters);
+        }
+    }
+
+    void Charge(const Sample& now) {
+        if (m_stats != nullptr) {
+            m_stats->AddPhaseTime(m_phase, now.wall - m_start.wall, now.cpu - m_start.cpu);
+        }
+        if (m_perf != nullptr) {
+            m_perf->Add(m_phase, m_start.counters, now.counters);
+        }
+        m_start = now;
+    }
+
+    static thread_local PhaseTimer *s_current;
+    Stats::Phase m_phase;
+    Stats *m_stats;
+    Tracer *m_tracer;
+    PerfCounters *m_perf;
+    PhaseTimer *m_parent;
+    int64_t m_begin;
+    Sample m_start;
+};
+
+thread_local PhaseTimer *PhaseTimer::s_current = nullptr;
+
+TerminalSize LoadTerminalSize() {
+    struct winsize ws;
+    CountSyscall(Stats::Syscall::Ioctl);
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1) {
+        throw std::system_error(errno, std::generic_category(), "Cannot get terminal size information");
+    }
+    TerminalSize ret;
+    ret.row = ws.ws_row;
+    ret.col = ws.ws_col;
+    return std::move(ret);
+}
+
+/* 出力をまとめて書き込むためのバッファ。溜まった分はkCapacityごとに1回のwriteで書き出す */
+class OutputBuffer {
+public:
+    static constexpr size_t kCapacity = 64 * 1024;
+
+    explicit OutputBuffer(int fd = STDOUT_FILENO)
+        : m_fd(fd), m_buf(new char[kCapacity]), m_len(0) {}
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+    ~OutputBuffer() {
+        try {
+            Flush();
+        } catch (const std::system_error&) {
+        }
+    }
+
+    /* n (<= kCapacity) バイト分の書き込み先を返す。書いた分はCommitで確定する */
+    char *Reserve(size_t n) {
+        if (kCapacity - m_len < n) {
+            Flush();
+        }
+        return m_buf.get() + m_len;
+    }
+
+    void Commit(size_t n) { m_len += n; }
+
+    void Append(char c) {
+        *Reserve(1) = c;
+        m_len++;
+    }
+
+    void Append(const char *s, size_t n) {
+        while (n > 0) {
+            if (m_len == kCapacity) {
+                Flush();
+            }
+            size_t chunk = std::min(n, kCapacity - m_len);
+            std::memcpy(m_buf.get() + m_len, s, chunk);
+            m_len += chunk;
+            s += chunk;
+            n -= chunk;
+        }
+    }
+
+    void AppendUnsigned(uint64_t value) {
+        char *p = Reserve(20);
+        m_len += std::to_chars(p, p + 20, value).ptr - p;
+    }
+
+    void AppendSigned(int64_t value) {
+        char *p = Reserve(20);
+        m_len += std::to_chars(p, p + 20, value).ptr - p;
+    }
+
+    void Flush() {
+        if (m_len == 0) {
+            return;
+        }
+        PhaseTimer timer(Stats::Phase::Output);
+        CountStats(Stats::Counter::BytesWritten, m_len);
+        if (m_fd == STDOUT_FILENO) {
+            // stdioに残っている出力より後ろに書く
+            std::fflush(stdout);
+        }
+        const char *p = m_buf.get();
+        size_t rest = m_len;
+        while (rest > 0) {
+            CountSyscall(Stats::Syscall::Write);
+            ssize_t written = write(m_fd, p, rest);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                m_len = 0;
+                throw std::system_error(errno, std::generic_category(), "Cannot write output");
+            }
+            p += written;
+            rest -= written;
+        }
+        m_len = 0;
+    }
+private:
+    int m_fd;
+    std::unique_ptr<char []> m_buf;
+    size_t m_len;
+};
+
+/* ナノ秒をtrace eventのタイムスタンプ (マイクロ秒、小数点以下3桁) として書く */
+void AppendMicroseconds(OutputBuffer& out, int64_t ns) {
+    out.AppendUnsigned(ns / 1000);
+    char frac[4] = {'.', static_cast<char>('0' + ns / 100 % 10), static_cast<char>('0' + ns / 10 % 10),
+                    static_cast<char>('0' + ns % 10)};
+    out.Append(frac, sizeof(frac));
+}
+
+void Tracer::Write(OutputBuffer& out) const {
+    auto append_literal = [&](const auto& literal) { out.Append(literal, sizeof(literal) - 1); };
+    std::string pid = std::to_string(getpid());
+    uint64_t dropped = 0;
+    bool first = true;
+    append_literal("{\"traceEvents\":[");
+    for (const TraceBuffer *buffer = m_buffers.load(std::memory_order_acquire); buffer != nullptr;
+         buffer = buffer->m_next) {
+        uint64_t head = buffer->Head();
+        uint64_t tail = head > TraceBuffer::kCapacity ? head - TraceBuffer::kCapacity : 0;
+        dropped += tail;
+        for (uint64_t i = tail; i < head; i++) {
+            const TraceEvent& event = buffer->At(i);
+            if (!first) {
+                append_literal(",\n");
+            }
+            first = false;
+            const char *name = Stats::PhaseName(event.phase);
+            append_literal("{\"name\":\"");
+            out.Append(name, std::strlen(name));
+            append_literal("\",\"cat\":\"ls\",\"ph\":\"X\",\"ts\":");
+            AppendMicroseconds(out, event.begin_ns);
+            append_literal(",\"dur\":");
+            AppendMicroseconds(out, event.end_ns - event.begin_ns);
+            append_literal(",\"pid\":");
+            out.Append(pid.data(), pid.size());
+            append_literal(",\"tid\":");
+            out.AppendUnsigned(buffer->Tid());
+            out.Append('}');
+        }
+    }
+    // リングバッファから溢れて失われたイベントの数
+    append_literal("],\"otherData\":{\"dropped_events\":");
+    out.AppendUnsigned(dropped);
+    append_literal("}}\n");
+}
+
+struct stat LoadStatus(const fs::path& target) {
+    struct stat status;
+    CountSyscall(Stats::Syscall::Lstat);
+    if (lstat(target.c_str(), &status) < 0) {
+        throw std::system_error(errno, std::generic_category(), "Cannot execute stat");
+    }
+    return status;
+}
+
+/* UTF-8の1文字分のバイト数を返す */
+size_t Utf8CharLength(std::string_view s, size_t pos) {
+    size_t len = 1;
+    while (pos + len < s.size() && (static_cast<unsigned char>(s[pos + len]) & 0xc0) == 0x80) {
+        len++;
+    }
+    return len;
+}
+
+/* ファイル名をグロブパターン (*, ?, [...]) と照合する */
+class GlobMatcher {
+public:
+    enum class Kind : uint8_t {
+        Literal,
+        AnyChar,
+        AnyString,
+        Class,
+    };
+
+    struct Token {
+        Kind kind;
+        char literal;
+        uint16_t char_class;
+    };
+
+    explicit GlobMatcher(std::string_view pattern) {
+        for (size_t i = 0; i < pattern.size(); i++) {
+            char c = pattern[i];
+            if (c == '*') {
+                if (m_tokens.empty() || m_tokens.back().kind != Kind::AnyString) {
+                    m_tokens.push_back({Kind::AnyString, 0, 0});
+                }
+            } else if (c == '?') {
+                m_tokens.push_back({Kind::AnyChar, 0, 0});
+            } else if (c == '[') {
+                i = ParseClass(pattern, i);
+            } else {
+                if (c == '\\' && i + 1 < pattern.size()) {
+                    c = pattern[++i];
+                }
+                m_tokens.push_back({Kind::Literal, c, 0});
+            }
+        }
+    }
+
+    bool Matches(std::string_view name) const {
+        size_t t = 0;
+        size_t n = 0;
+        size_t star_token = m_tokens.size();
+        size_t star_name = 0;
+        while (n < name.size()) {
+            if (t < m_tokens.size()) {
+                const Token& token = m_tokens[t];
+                if (token.kind == Kind::AnyString) {
+                    star_token = t++;
+                    star_name = n;
+                    continue;
+                }
+                size_t len = MatchOne(token, name, n);
+                if (len > 0) {
+                    n += len;
+                    t++;
+                    continue;
+                }
+            }
+            // 直前の*に1文字多く食わせてやり直す
+            if (star_token == m_tokens.size()) {
+                return false;
+            }
+            t = star_token + 1;
+            star_name += Utf8CharLength(name, star_name);
+            n = star_name;
+        }
+        while (t < m_tokens.size() && m_tokens[t].kind == Kind::AnyString) {
+            t++;
+        }
+        return t == m_tokens.size();
+    }
+
+    const std::vector<Token>& Tokens() const { return m_tokens; }
+
+    const std::bitset<256>& CharClass(const Token& token) const { return m_classes[token.char_class]; }
+private:
+    size_t ParseClass(std::string_view pattern, size_t open) {
+        size_t i = open + 1;
+        bool negate = i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^');
+        if (negate) {
+            i++;
+        }
+        std::bitset<256> char_class;
+        for (bool first = true; i < pattern.size() && (first || pattern[i] != ']'); i++, first = false) {
+            unsigned char low = pattern[i];
+            unsigned char high = low;
+            if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+                high = pattern[i + 2];
+                i += 2;
+            }
+            for (unsigned c = low; c <= high; c++) {
+                char_class.set(c);
+            }
+        }
+        if (i >= pattern.size()) {
+            throw cxxopts::OptionParseException("Unterminated '[' in pattern '" + std::string(pattern) + "'");
+        }
+        if (negate) {
+            char_class.flip();
+        }
+        m_tokens.push_back({Kind::Class, 0, static_cast<uint16_t>(m_classes.size())});
+        m_classes.push_back(char_class);
+        return i;
+    }
+
+    /* トークン1つを照合し、一致したバイト数 (不一致なら0) を返す */
+    size_t MatchOne(const Token& token, std::string_view name, size_t pos) const {
+        switch (token.kind) {
+        case Kind::Literal:
+            return name[pos] == token.literal ? 1 : 0;
+        case Kind::AnyChar:
+            return Utf8CharLength(name, pos);
+        case Kind::Class:
+            return m_classes[token.char_class].test(static_cast<unsigned char>(name[pos])) ? 1 : 0;
+        default:
+            return 0;
+        }
+    }
+
+    std::vector<Token> m_tokens;
+    std::vector<std::bitset<256>> m_classes;
+};
+
+/* 複数のグロブパターンをまとめて照合する。完全一致・接頭辞 (abc*)・拡張子 (*.ext) だけの
+   パターンは表を引き、それ以外は全パターンを1つのDFAにまとめて名前を1回なめるだけで判定する */
+class PatternSet {
+public:
+    /* ruleは一致したときに返す値。複数一致した場合は最大のものを返す */
+    void Add(std::string_view pattern, int rule) {
+        GlobMatcher glob(pattern);
+        const auto& tokens = glob.Tokens();
+        size_t literals = 0;
+        while (literals < tokens.size() && tokens[literals].kind == GlobMatcher::Kind::Literal) {
+            literals++;
+        }
+        std::string literal;
+        for (size_t i = 0; i < literals; i++) {
+            literal += tokens[i].literal;
+        }
+        if (literals == tokens.size()) {
+            m_exact.emplace_back(literal, rule);
+        } else if (literals > 0 && literals + 1 == tokens.size()
+                   && tokens.back().kind == GlobMatcher::Kind::AnyString) {
+            m_prefixes.emplace_back(literal, rule);
+        } else if (IsExtensionPattern(glob)) {
+            std::string extension;
+            for (size_t i = 1; i < tokens.size(); i++) {
+                extension += tokens[i].literal;
+            }
+            m_extensions.emplace_back(extension, rule);
+        } else {
+            m_globs.push_back(std::move(glob));
+            m_glob_rules.push_back(rule);
+        }
+        m_max_rule = std::max(m_max_rule, rule);
+    }
+
+    bool Empty() const {
+        return m_exact.empty() && m_prefixes.empty() && m_extensions.empty() && m_globs.empty();
+    }
+
+    /* Addし終えたら照合の前に1回呼ぶ */
+    void Compile() {
+        SortTable(m_exact);
+        SortTable(m_prefixes);
+        SortTable(m_extensions);
+        m_prefix_lengths.clear();
+        for (const auto& prefix : m_prefixes) {
+            m_prefix_lengths.push_back(prefix.first.size());
+        }
+        std::sort(m_prefix_lengths.begin(), m_prefix_lengths.end());
+        m_prefix_lengths.erase(std::unique(m_prefix_lengths.begin(), m_prefix_lengths.end()),
+                               m_prefix_lengths.end());
+        BuildDfa();
+    }
+
+    /* 一致したパターンのruleのうち最大のものを返す。どれにも一致しなければ-1 */
+    int Match(std::string_view name) const {
+        int ret = Lookup(m_exact, name);
+        if (ret == m_max_rule) {
+            return ret;
+        }
+        for (size_t len : m_prefix_lengths) {
+            if (len > name.size()) {
+                break;
+            }
+            ret = std::max(ret, Lookup(m_prefixes, name.substr(0, len)));
+        }
+        if (!m_extensions.empty()) {
+            size_t dot = name.find_last_of('.');
+            if (dot != std::string_view::npos) {
+                ret = std::max(ret, Lookup(m_extensions, name.substr(dot)));
+            }
+        }
+        if (ret == m_max_rule) {
+            return ret;
+        }
+        if (!m_dfa_accept.empty()) {
+            uint32_t state = kDfaStart;
+            for (unsigned char c : name) {
+                state = m_dfa_transitions[state * m_number_of_byte_classes + m_byte_class[c]];
+                if (state == kDfaDead) {
+                    break;
+                }
+            }
+            ret = std::max(ret, m_dfa_accept[state]);
+        } else {
+            // DFAが大きくなりすぎた場合は1つずつ照合する
+            for (size_t i = 0; i < m_globs.size(); i++) {
+                if (m_glob_rules[i] > ret && m_globs[i].Matches(name)) {
+                    ret = m_glob_rules[i];
+                }
+            }
+        }
+        return ret;
+    }
+private:
+    using Table = std::vector<std::pair<std::string, int>>;
+
+    /* NFAの状態。tokenまで照合済みで、continuationは?がUTF-8の先頭バイトを読んだ直後であることを表す */
+    struct NfaState {
+        uint32_t glob;
+        uint32_t token;
+        bool continuation;
+        bool operator<(const NfaState& other) const {
+            return std::tie(glob, token, continuation) < std::tie(other.glob, other.token, other.continuation);
+        }
+        bool operator==(const NfaState& other) const {
+            return glob == other.glob && token == other.token && continuation == other.continuation;
+        }
+    };
+
+    static constexpr uint32_t kDfaDead = 0;
+    static constexpr uint32_t kDfaStart = 1;
+    static constexpr size_t kMaxDfaStates = 4096;
+
+    static bool IsExtensionPattern(const GlobMatcher& glob) {
+        const auto& tokens = glob.Tokens();
+        if (tokens.size() < 2 || tokens[0].kind != GlobMatcher::Kind::AnyString
+            || tokens[1].kind != GlobMatcher::Kind::Literal || tokens[1].literal != '.') {
+            return false;
+        }
+        for (size_t i = 2; i < tokens.size(); i++) {
+            if (tokens[i].kind != GlobMatcher::Kind::Literal || tokens[i].literal == '.') {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static void SortTable(Table& table) {
+        // 同じ文字列はruleの大きいものだけを残す
+        std::sort(table.begin(), table.end(), [](const auto& a, const auto& b) {
+            return a.first != b.first ? a.first < b.first : a.second > b.second;
+        });
+        table.erase(std::unique(table.begin(), table.end(), [](const auto& a, const auto& b) {
+            return a.first == b.first;
+        }), table.end());
+    }
+
+    static int Lookup(const Table& table, std::string_view key) {
+        auto it = std::lower_bound(table.begin(), table.end(), key, [](const auto& entry, std::string_view key) {
+            return std::string_view(entry.first) < key;
+        });
+        return it != table.end() && it->first == key ? it->second : -1;
+    }
+
+    static bool IsContinuationByte(unsigned char c) {
+        return (c & 0xc0) == 0x80;
+    }
+
+    void AddClosure(NfaState state, std::vector<NfaState>& states) const {
+        if (std::find(states.begin(), states.end(), state) != states.end()) {
+            return;
+        }
+        states.push_back(state);
+        const auto& tokens = m_globs[state.glob].Tokens();
+        if (state.token < tokens.size()
+            && (state.continuation || tokens[state.token].kind == GlobMatcher::Kind::AnyString)) {
+            AddClosure({state.glob, state.token + 1, false}, states);
+        }
+    }
+
+    void Step(NfaState state, unsigned char c, std::vector<NfaState>& next) const {
+        const auto& glob = m_globs[state.glob];
+        const auto& tokens = glob.Tokens();
+        if (state.token == tokens.size()) {
+            return;
+        }
+        if (state.continuation) {
+            if (IsContinuationByte(c)) {
+                AddClosure(state, next);
+            }
+            return;
+        }
+        const auto& token = tokens[state.token];
+        switch (token.kind) {
+        case GlobMatcher::Kind::Literal:
+            if (static_cast<unsigned char>(token.literal) == c) {
+                AddClosure({state.glob, state.token + 1, false}, next);
+            }
+            break;
+        case GlobMatcher::Kind::Class:
+            if (glob.CharClass(token).test(c)) {
+                AddClosure({state.glob, state.token + 1, false}, next);
+            }
+            break;
+        case GlobMatcher::Kind::AnyChar:
+            if (!IsContinuationByte(c)) {
+                AddClosure({state.glob, state.token, true}, next);
+            }
+            break;
+        case GlobMatcher::Kind::AnyString:
+            AddClosure(state, next);
+            break;
+        }
+    }
+
+    /* 遷移が同じになるバイトを1つのクラスにまとめる */
+    void BuildByteClasses() {
+        std::vector<std::bitset<256>> sets;
+        std::bitset<256> continuation;
+        for (unsigned c = 0x80; c < 0xc0; c++) {
+            continuation.set(c);
+        }
+        sets.push_back(continuation);
+        for (const auto& glob : m_globs) {
+            for (const auto& token : glob.Tokens()) {
+                if (token.kind == GlobMatcher::Kind::Literal) {
+                    std::bitset<256> literal;
+                    literal.set(static_cast<unsigned char>(token.literal));
+                    sets.push_back(literal);
+                } else if (token.kind == GlobMatcher::Kind::Class) {
+                    sets.push_back(glob.CharClass(token));
+                }
+            }
+        }
+        std::map<std::vector<bool>, uint8_t> classes;
+        m_representatives.clear();
+        for (unsigned c = 0; c < 256; c++) {
+            std::vector<bool> signature;
+            signature.reserve(sets.size());
+            for (const auto& set : sets) {
+                signature.push_back(set.test(c));
+            }
+            auto inserted = classes.emplace(signature, classes.size());
+            if (inserted.second) {
+                m_representatives.push_back(c);
+            }
+            m_byte_class[c] = inserted.first->second;
+        }
+        m_number_of_byte_classes = m_representatives.size();
+    }
+
+    /* 部分集合構成法でDFAを作る。状態数が上限を超えたらDFAを使わない */
+    void BuildDfa() {
+        m_dfa_transitions.clear();
+        m_dfa_accept.clear();
+        if (m_globs.empty()) {
+            return;
+        }
+        BuildByteClasses();
+        std::map<std::vector<NfaState>, uint32_t> ids;
+        std::vector<std::vector<NfaState>> states(2);
+        std::vector<NfaState> start;
+        for (uint32_t i = 0; i < m_globs.size(); i++) {
+            AddClosure({i, 0, false}, start);
+        }
+        std::sort(start.begin(), start.end());
+        ids[{}] = kDfaDead;
+        ids[start] = kDfaStart;
+        states[kDfaStart] = start;
+        std::vector<NfaState> next;
+        for (uint32_t id = 0; id < states.size(); id++) {
+            int accept = -1;
+            for (const auto& state : states[id]) {
+                if (state.token == m_globs[state.glob].Tokens().size()) {
+                    accept = std::max(accept, m_glob_rules[state.glob]);
+                }
+            }
+            m_dfa_accept.push_back(accept);
+            for (size_t byte_class = 0; byte_class < m_number_of_byte_classes; byte_class++) {
+                next.clear();
+                for (const auto& state : states[id]) {
+                    Step(state, m_representatives[byte_class], next);
+                }
+                std::sort(next.begin(), next.end());
+                auto inserted = ids.emplace(next, states.size());
+                if (inserted.second) {
+                    if (states.size() == kMaxDfaStates) {
+                        m_dfa_transitions.clear();
+                        m_dfa_accept.clear();
+                        return;
+                    }
+                    states.push_back(next);
+                }
+                m_dfa_transitions.push_back(inserted.first->second);
+            }
+        }
+    }
+
+    Table m_exact;
+    Table m_prefixes;
+    Table m_extensions;
+    std::vector<size_t> m_prefix_lengths;
+    std::vector<GlobMatcher> m_globs;
+    std::vector<int> m_glob_rules;
+    int m_max_rule = -1;
+    uint8_t m_byte_class[256] = {};
+    std::vector<unsigned char> m_representatives;
+    size_t m_number_of_byte_classes = 0;
+    std::vector<uint32_t> m_dfa_transitions;
+    std::vector<int> m_dfa_accept;
+};
+
+/* --respect-gitignoreで使う、あるディレクトリの直下のエントリに効く.gitignoreの規則 */
+class GitignoreRules {
+public:
+    /* directoryからリポジトリのルートまでの.gitignoreと.git/info/excludeを読む */
+    explicit GitignoreRules(const fs::path& directory) {
+        std::vector<fs::path> directories;
+        fs::path current = fs::absolute(directory).lexically_normal();
+        if (!current.has_filename()) {
+            current = current.parent_path();
+        }
+        bool in_repository = false;
+        for (fs::path dir = current; ; dir = dir.parent_path()) {
+            directories.push_back(dir);
+            std::error_code ec;
+            if (fs::exists(dir / ".git", ec)) {
+                in_repository = true;
+                break;
+            }
+            if (dir == dir.root_path()) {
+                break;
+            }
+        }
+        if (!in_repository) {
+            // リポジトリの外では対象ディレクトリの.gitignoreだけを見る
+            directories.resize(1);
+        } else {
+            LoadFile(directories.back() / ".git" / "info" / "exclude", current.lexically_relative(directories.back()));
+        }
+        for (auto it = directories.rbegin(); it != directories.rend(); ++it) {
+            LoadFile(*it / ".gitignore", current.lexically_relative(*it));
+        }
+        m_names.Compile();
+        m_names_for_directories.Compile();
+    }
+
+    bool IsIgnored(std::string_view filename, bool is_directory) const {
+        int rule = (is_directory ? m_names_for_directories : m_names).Match(filename);
+        for (const auto& anchored : m_anchored) {
+            if (anchored.rule > rule && (is_directory || !anchored.directory_only)
+                && MatchPath(anchored.components, 0, anchored.prefix, filename, 0)) {
+                rule = anchored.rule;
+            }
+        }
+        return rule >= 0 && !m_negated[rule];
+    }
+private:
+    /* '/'を含むパターン。.gitignoreの場所からの相対パスで照合する。
+       **の要素はnullptr (std::nullopt) で表す */
+    struct Anchored {
+        std::vector<std::optional<GlobMatcher>> components;
+        std::vector<std::string> prefix;
+        bool directory_only;
+        int rule;
+    };
+
+    void LoadFile(const fs::path& path, const fs::path& relative_directory) {
+        std::ifstream file(path);
+        std::vector<std::string> prefix;
+        for (const auto& component : relative_directory) {
+            if (component != ".") {
+                prefix.push_back(component.string());
+            }
+        }
+        std::string line;
+        while (std::getline(file, line)) {
+            while (!line.empty() && (line.back() == ' ' || line.back() == '\r')) {
+                line.pop_back();
+            }
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            bool negated = line[0] == '!';
+            std::string_view pattern(line);
+            if (negated) {
+                pattern.remove_prefix(1);
+            } else if (pattern[0] == '\\') {
+                pattern.remove_prefix(1);
+            }
+            bool directory_only = !pattern.empty() && pattern.back() == '/';
+            if (directory_only) {
+                pattern.remove_suffix(1);
+            }
+            // **/aは名前だけのパターンと同じ。**/a/bは先頭の**の要素を残し、どの深さでも照合する
+            if (pattern.substr(0, 3) == "**/" && pattern.find('/', 3) == std::string_view::npos) {
+                pattern.remove_prefix(3);
+            }
+            if (pattern.empty()) {
+                continue;
+            }
+            int rule = m_negated.size();
+            try {
+                AddRule(pattern, prefix, directory_only, rule);
+            } catch (const cxxopts::OptionParseException&) {
+                // gitと同じく、壊れたパターンの行は何にも一致しないものとして読み飛ばす
+                continue;
+            }
+            m_negated.push_back(negated);
+        }
+    }
+
+    /* 失敗したときは何も追加しない */
+    void AddRule(std::string_view pattern, const std::vector<std::string>& prefix, bool directory_only, int rule) {
+        if (pattern.find('/') == std::string_view::npos) {
+            m_names_for_directories.Add(pattern, rule);
+            if (!directory_only) {
+                m_names.Add(pattern, rule);
+            }
+            return;
+        }
+        if (pattern[0] == '/') {
+            pattern.remove_prefix(1);
+        }
+        Anchored anchored{{}, prefix, directory_only, rule};
+        size_t pos = 0;
+        while (pos <= pattern.size()) {
+            size_t slash = std::min(pattern.find('/', pos), pattern.size());
+            std::string_view component = pattern.substr(pos, slash - pos);
+            if (component == "**") {
+                anchored.components.emplace_back(std::nullopt);
+            } else {
+                anchored.components.emplace_back(GlobMatcher(component));
+            }
+            pos = slash + 1;
+        }
+        m_anchored.push_back(std::move(anchored));
+    }
+
+    /* パターンの要素をprefix (ディレクトリ部分) + filenameと照合する */
+    static bool MatchPath(const std::vector<std::optional<GlobMatcher>>& components, size_t i,
+                          const std::vector<std::string>& prefix, std::string_view filename, size_t j) {
+        size_t length = prefix.size() + 1;
+        if (i == components.size()) {
+            return j == length;
+        }
+        if (!components[i].has_value()) {
+            for (size_t k = j; k <= length; k++) {
+                if (MatchPath(components, i + 1, prefix, filename, k)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        if (j == length) {
+            return false;
+        }
+        std::string_view component = j < prefix.size() ? std::string_view(prefix[j]) : filename;
+        return components[i]->Matches(component) && MatchPath(components, i + 1, prefix, filename, j + 1);
+    }
+
+    PatternSet m_names;
+    PatternSet m_names_for_directories;
+    std::vector<Anchored> m_anchored;
+    std::vector<bool> m_negated;
+};
+
+/* --whereで指定された条件式。後置記法の命令列にコンパイルして保持する */
+class Predicate {
+public:
+    explicit Predicate(std::string_view expression) : m_rest(expression) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        m_now = now.tv_sec * 1000000000LL + now.tv_nsec;
+        ParseOr();
+        SkipSpaces();
+        if (!m_rest.empty()) {
+            Fail("unexpected '" + std::string(m_rest) + "'");
+        }
+        for (const auto& condition : m_conditions) {
+            if (condition.field != Field::Name && condition.field != Field::Type) {
+                m_needs_status = true;
+            }
+        }
+    }
+
+    /* ファイル名とファイルタイプ以外を参照する条件があるか */
+    bool NeedsStatus() const { return m_needs_status; }
+
+    /* statせずに分かる情報だけで評価する。statしないと決まらない場合はnullopt */
+    std::optional<bool> MatchesWithoutStatus(std::string_view filename, fs::file_type type) const {
+        std::vector<std::optional<bool>> stack;
+        stack.reserve(m_program.size());
+        for (const auto& instruction : m_program) {
+            switch (instruction.code) {
+            case Code::Condition: {
+                const Condition& condition = m_conditions[instruction.condition];
+                if (condition.field == Field::Name) {
+                    stack.push_back(Compare(condition.op, m_globs[condition.value].Matches(filename)));
+                } else if (condition.field == Field::Type && type != fs::file_type::none
+                           && type != fs::file_type::unknown) {
+                    stack.push_back(Compare(condition.op, FiletypeBits(type) == condition.value));
+                } else {
+                    stack.push_back(std::nullopt);
+                }
+                break;
+            }
+            case Code::Not:
+                if (stack.back().has_value()) {
+                    stack.back() = !*stack.back();
+                }
+                break;
+            case Code::And:
+            case Code::Or: {
+                // 3値論理: 片方だけで決まる場合は未確定でも結果を出す
+                bool dominant = instruction.code == Code::Or;
+                std::optional<bool> rhs = stack.back();
+                stack.pop_back();
+                std::optional<bool>& lhs = stack.back();
+                if (lhs == dominant || rhs == dominant) {
+                    lhs = dominant;
+                } else if (!lhs.has_value() || !rhs.has_value()) {
+                    lhs = std::nullopt;
+                }
+                break;
+            }
+            }
+        }
+        return stack.back();
+    }
+
+    /* n件分のstat結果をまとめて評価し、matched[i]に結果 (0/1) を書く */
+    void MatchesBatch(const std::string_view *filenames, const struct stat *statuses,
+                      size_t n, uint8_t *matched) const {
+        std::vector<std::vector<uint8_t>> stack;
+        for (const auto& instruction : m_program) {
+            switch (instruction.code) {
+            case Code::Condition:
+                stack.emplace_back(n);
+                EvaluateCondition(m_conditions[instruction.condition], filenames, statuses, n,
+                                  stack.back().data());
+                break;
+            case Code::Not:
+                for (auto& value : stack.back()) {
+                    value ^= 1;
+                }
+                break;
+            case Code::And:
+            case Code::Or: {
+                auto rhs = std::move(stack.back());
+                stack.pop_back();
+                auto& lhs = stack.back();
+                if (instruction.code == Code::And) {
+                    for (size_t i = 0; i < n; i++) {
+                        lhs[i] &= rhs[i];
+                    }
+                } else {
+                    for (size_t i = 0; i < n; i++) {
+                        lhs[i] |= rhs[i];
+                    }
+                }
+                break;
+            }
+            }
+        }
+        std::copy(stack.back().begin(), stack.back().end(), matched);
+    }
+private:
+    enum class Field : uint8_t {
+        Name,
+        Type,
+        Size,
+        Mtime,
+        Uid,
+        Gid,
+        Nlink,
+        Inode,
+        Mode,
+    };
+
+    enum class Op : uint8_t {
+        Eq,
+        Ne,
+        Lt,
+        Le,
+        Gt,
+        Ge,
+    };
+
+    struct Condition {
+        Field field;
+        Op op;
+        int64_t value; /* Nameの場合はm_globsの添字 */
+    };
+
+    enum class Code : uint8_t {
+        Condition,
+        And,
+        Or,
+        Not,
+    };
+
+    struct Instruction {
+        Code code;
+        uint16_t condition;
+    };
+
+    static std::optional<bool> Compare(Op op, bool equal) {
+        return op == Op::Eq ? equal : !equal;
+    }
+
+    template <class T>
+    static bool Compare(Op op, T lhs, T rhs) {
+        switch (op) {
+        case Op::Eq: return lhs == rhs;
+        case Op::Ne: return lhs != rhs;
+        case Op::Lt: return lhs < rhs;
+        case Op::Le: return lhs <= rhs;
+        case Op::Gt: return lhs > rhs;
+        default:     return lhs >= rhs;
+        }
+    }
+
+    /* 列ごとにまとめて比較する。フィールドと演算子の分岐はループの外に出す */
+    template <class Load>
+    static void CompareColumn(Op op, int64_t value, const struct stat *statuses, size_t n,
+                              uint8_t *result, Load load) {
+        switch (op) {
+        case Op::Eq: for (size_t i = 0; i < n; i++) result[i] = load(statuses[i]) == value; break;
+        case Op::Ne: for (size_t i = 0; i < n; i++) result[i] = load(statuses[i]) != value; break;
+        case Op::Lt: for (size_t i = 0; i < n; i++) result[i] = load(statuses[i]) < value;  break;
+        case Op::Le: for (size_t i = 0; i < n; i++) result[i] = load(statuses[i]) <= value; break;
+        case Op::Gt: for (size_t i = 0; i < n; i++) result[i] = load(statuses[i]) > value;  break;
+        case Op::Ge: for (size_t i = 0; i < n; i++) result[i] = load(statuses[i]) >= value; break;
+        }
+    }
+
+    void EvaluateCondition(const Condition& condition, const std::string_view *filenames,
+                           const struct stat *statuses, size_t n, uint8_t *result) const {
+        int64_t value = condition.value;
+        switch (condition.field) {
+        case Field::Name:
+            for (size_t i = 0; i < n; i++) {
+                result[i] = *Compare(condition.op, m_globs[value].Matches(filenames[i]));
+            }
+            break;
+        case Field::Type:
+            CompareColumn(condition.op, value, statuses, n, result,
+                          [](const struct stat& s) { return int64_t(s.st_mode & S_IFMT); });
+            break;
+        case Field::Size:
+            CompareColumn(condition.op, value, statuses, n, result,
+                          [](const struct stat& s) { return int64_t(s.st_size); });
+            break;
+        case Field::Mtime:
+            CompareColumn(condition.op, value, statuses, n, result, [](const struct stat& s) {
+                return s.st_mtim.tv_sec * 1000000000LL + s.st_mtim.tv_nsec;
+            });
+            break;
+        case Field::Uid:
+            CompareColumn(condition.op, value, statuses, n, result,
+                          [](const struct stat& s) { return int64_t(s.st_uid); });
+            break;
+        case Field::Gid:
+            CompareColumn(condition.op, value, statuses, n, result,
+                          [](const struct stat& s) { return int64_t(s.st_gid); });
+            break;
+        case Field::Nlink:
+            CompareColumn(condition.op, value, statuses, n, result,
+                          [](const struct stat& s) { return int64_t(s.st_nlink); });
+            break;
+        case Field::Inode:
+            CompareColumn(condition.op, value, statuses, n, result,
+                          [](const struct stat& s) { return int64_t(s.st_ino); });
+            break;
+        case Field::Mode:
+            CompareColumn(condition.op, value, statuses, n, result,
+                          [](const struct stat& s) { return int64_t(s.st_mode & 07777); });
+            break;
+        }
+    }
+
+    static int64_t FiletypeBits(fs::file_type type) {
+        switch (type) {
+        case fs::file_type::regular:   return S_IFREG;
+        case fs::file_type::directory: return S_IFDIR;
+        case fs::file_type::symlink:   return S_IFLNK;
+        case fs::file_type::block:     return S_IFBLK;
+        case fs::file_type::character: return S_IFCHR;
+        case fs::file_type::fifo:      return S_IFIFO;
+        case fs::file_type::socket:    return S_IFSOCK;
+        default:                       return 0;
+        }
+    }
+
+    [[noreturn]] void Fail(const std::string& message) const {
+        throw cxxopts::OptionParseException("Invalid --where expression: " + message);
+    }
+
+    void SkipSpaces() {
+        while (!m_rest.empty() && std::isspace(static_cast<unsigned char>(m_rest[0]))) {
+            m_rest.remove_prefix(1);
+        }
+    }
+
+    bool Consume(std::string_view token) {
+        SkipSpaces();
+        if (m_rest.substr(0, token.size()) != token) {
+            return false;
+        }
+        m_rest.remove_prefix(token.size());
+        return true;
+    }
+
+    void Emit(Code code, uint16_t condition = 0) {
+        m_program.push_back({code, condition});
+    }
+
+    void ParseOr() {
+        ParseAnd();
+        while (Consume("||")) {
+            ParseAnd();
+            Emit(Code::Or);
+        }
+    }
+
+    void ParseAnd() {
+        ParseUnary();
+        while (Consume("&&")) {
+            ParseUnary();
+            Emit(Code::And);
+        }
+    }
+
+    void ParseUnary() {
+        if (Consume("!")) {
+            ParseUnary();
+            Emit(Code::Not);
+        } else if (Consume("(")) {
+            ParseOr();
+            if (!Consume(")")) {
+                Fail("missing ')'");
+            }
+        } else {
+            ParseCondition();
+        }
+    }
+
+    void ParseCondition() {
+        static const std::pair<const char *, Field> fields[] = {
+            {"name", Field::Name}, {"type", Field::Type}, {"size", Field::Size},
+            {"mtime", Field::Mtime}, {"uid", Field::Uid}, {"gid", Field::Gid},
+            {"nlink", Field::Nlink}, {"inode", Field::Inode}, {"mode", Field::Mode},
+        };
+        static const std::pair<const char *, Op> ops[] = {
+            {"==", Op::Eq}, {"!=", Op::Ne}, {"<=", Op::Le}, {">=", Op::Ge}, {"<", Op::Lt}, {">", Op::Gt},
+        };
+        SkipSpaces();
+        size_t len = 0;
+        while (len < m_rest.size() && (std::isalpha(static_cast<unsigned char>(m_rest[len])))) {
+            len++;
+        }
+        std::string_view name = m_rest.substr(0, len);
+        m_rest.remove_prefix(len);
+        auto field = std::find_if(std::begin(fields), std::end(fields),
+                                  [&](const auto& f) { return name == f.first; });
+        if (field == std::end(fields)) {
+            Fail(name.empty() ? "missing field name" : "unknown field '" + std::string(name) + "'");
+        }
+        auto op = std::find_if(std::begin(ops), std::end(ops),
+                               [&](const auto& o) { return Consume(o.first); });
+        if (op == std::end(ops)) {
+            Fail("missing comparison operator after '" + std::string(name) + "'");
+        }
+        Condition condition{field->second, op->second, 0};
+        if ((condition.field == Field::Name || condition.field == Field::Type)
+            && condition.op != Op::Eq && condition.op != Op::Ne) {
+            Fail("'" + std::string(name) + "' only supports == and !=");
+        }
+        condition.value = ParseValue(condition.field, ReadValue());
+        if (m_conditions.size() > UINT16_MAX) {
+            Fail("too many conditions");
+        }
+        Emit(Code::Condition, m_conditions.size());
+        m_conditions.push_back(condition);
+    }
+
+    /* 値はクォートするか、空白か')'までを1語として読む */
+    std::string ReadValue() {
+        SkipSpaces();
+        std::string value;
+        if (!m_rest.empty() && (m_rest[0] == '\'' || m_rest[0] == '"')) {
+            size_t close = m_rest.find(m_rest[0], 1);
+            if (close == std::string_view::npos) {
+                Fail("unterminated quote");
+            }
+            value = m_rest.substr(1, close - 1);
+            m_rest.remove_prefix(close + 1);
+            return value;
+        }
+        size_t len = 0;
+        while (len < m_rest.size() && !std::isspace(static_cast<unsigned char>(m_rest[len]))
+               && m_rest[len] != ')') {
+            len++;
+        }
+        value = m_rest.substr(0, len);
+        m_rest.remove_prefix(len);
+        if (value.empty()) {
+            Fail("missing value");
+        }
+        return value;
+    }
+
+    int64_t ParseValue(Field field, const std::string& value) {
+        switch (field) {
+        case Field::Name:
+            m_globs.emplace_back(value);
+            return m_globs.size() - 1;
+        case Field::Type: {
+            static const char letters[] = "fdlbcps";
+            static const int64_t bits[] = {S_IFREG, S_IFDIR, S_IFLNK, S_IFBLK, S_IFCHR, S_IFIFO, S_IFSOCK};
+            const char *letter = value.size() == 1 ? std::strchr(letters, value[0]) : nullptr;
+            if (letter == nullptr || *letter == '\0') {
+                Fail("unknown type '" + value + "' (expected one of f, d, l, b, c, p, s)");
+            }
+            return bits[letter - letters];
+        }
+        case Field::Mode:
+            return ParseNumber(value, 8);
+        case Field::Size: {
+            static const int64_t scales[] = {1LL << 10, 1LL << 20, 1LL << 30, 1LL << 40, 1LL << 50};
+            return ParseScaledNumber(value, "kmgtp", scales);
+        }
+        case Field::Mtime: {
+            // -7d のように符号と単位を付けると現在時刻からの相対時刻、数値のみはUNIX時刻
+            static const int64_t scales[] = {1, 60, 3600, 86400, 604800};
+            if (value[0] == '-' || value[0] == '+') {
+                int64_t seconds = ParseScaledNumber(value.substr(1), "smhdw", scales);
+                int64_t offset = Multiply(value[0] == '-' ? -seconds : seconds, 1000000000LL, value);
+                int64_t ret;
+                if (__builtin_add_overflow(m_now, offset, &ret)) {
+                    Fail("number out of range '" + value + "'");
+                }
+                return ret;
+            }
+            return Multiply(ParseNumber(value, 10), 1000000000LL, value);
+        }
+        default:
+            return ParseNumber(value, 10);
+        }
+    }
+
+    int64_t ParseNumber(const std::string& value, int base) {
+        int64_t ret = 0;
+        auto result = std::from_chars(value.data(), value.data() + value.size(), ret, base);
+        if (result.ec != std::errc() || result.ptr != value.data() + value.size()) {
+            Fail("invalid number '" + value + "'");
+        }
+        return ret;
+    }
+
+    /* 末尾に単位 (suffixesのi文字目) があればscales[i]倍する。大文字小文字は区別しない */
+    int64_t ParseScaledNumber(const std::string& value, const char *suffixes, const int64_t *scales) {
+        if (value.empty()) {
+            Fail("missing value");
+        }
+        const char *suffix = std::strchr(suffixes, std::tolower(static_cast<unsigned char>(value.back())));
+        if (suffix == nullptr) {
+            return ParseNumber(value, 10);
+        }
+        return Multiply(ParseNumber(value.substr(0, value.size() - 1), 10), scales[suffix - suffixes], value);
+    }
+
+    /* 単位を掛けた結果がint64_tに収まらなければ受け付けない */
+    int64_t Multiply(int64_t number, int64_t scale, const std::string& value) {
+        int64_t ret;
+        if (__builtin_mul_overflow(number, scale, &ret)) {
+            Fail("number out of range '" + value + "'");
+        }
+        return ret;
+    }
+
+    std::string_view m_rest;
+    int64_t m_now;
+    bool m_needs_status = false;
+    std::vector<Instruction> m_program;
+    std::vector<Condition> m_conditions;
+    std::vector<GlobMatcher> m_globs;
+};
+
+class FileDescriptor {
+public:
+    explicit FileDescriptor(int fd) : m_fd(fd) {}
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+    ~FileDescriptor() {
+        if (m_fd >= 0) {
+            close(m_fd);
+        }
+    }
+    int Get() const { return m_fd; }
+private:
+    int m_fd;
+};
+
+/* ディレクトリ中の1エントリ。typeとinoはd_type、d_inoから分かる値 (アーカイブではinoはメンバーの番号) */
+struct DirectoryEntry {
+    std::string name;
+    fs::file_type type;
+    uint64_t ino;
+
+    bool operator<(const DirectoryEntry& other) const { return name < other.name; }
+};
+
+/* エントリの列挙とメタデータの取得をまとめたもの。実際のファイルシステム以外からも一覧できるようにする */
+class DirectorySource {
+public:
+    using BatchConsumer = std::function<void(std::vector<DirectoryEntry>&)>;
+    /* EnumerateInBatchesが一度に渡すエントリの数 */
+    static constexpr size_t kBatchSize = 4096;
+
+    virtual ~DirectorySource() {}
+    /* dirのエントリを順不同でentriesに追加する。"."と".."は含めない */
+    virtual void Enumerate(const fs::path& dir, std::vector<DirectoryEntry>& entries) const = 0;
+    /* Enumerateと同じエントリを、kBatchSize件程度ずつconsumeに渡す。
+       consumeは渡されたエントリを持ち出してよい。全件を一度に持たずに済ませたいときに使う */
+    virtual void EnumerateInBatches(const fs::path& dir, const BatchConsumer& consume) const {
+        std::vector<DirectoryEntry> entries;
+        Enumerate(dir, entries);
+        consume(entries);
+    }
+    /* dirの中のn個のエントリについて、lstatと同じ結果をまとめて取得する */
+    virtual void LoadStatuses(const fs::path& dir, const DirectoryEntry *const *entries, size_t n,
+                              struct stat *statuses) const = 0;
+    /* 辿り始めるディレクトリなど、path自身についてlstatと同じ結果を取得する */
+    virtual struct stat LoadStatusOf(const fs::path& path) const {
+        return LoadStatus(path);
+    }
+    /* dirのエントリの数。ignore_hidden_fileなら.で始まる名前を数えない */
+    virtual uint64_t CountEntries(const fs::path& dir, bool ignore_hidden_file) const {
+        std::vector<DirectoryEntry> entries;
+        Enumerate(dir, entries);
+        if (!ignore_hidden_file) {
+            return entries.size();
+        }
+        return std::count_if(entries.begin(), entries.end(), [](const DirectoryEntry& entry) {
+            return entry.name[0] != '.';
+        });
+    }
+};
+
+fs::file_type FileTypeFromMode(mode_t mode) {
+    switch (mode & S_IFMT) {
+    case S_IFREG: return fs::file_type::regular;
+    case S_IFDIR: return fs::file_type::directory;
+    case S_IFLNK: return fs::file_type::symlink;
+    case S_IFBLK: return fs::file_type::block;
+    case S_IFCHR: return fs::file_type::character;
+    case S_IFIFO: return fs::file_type::fifo;
+    case S_IFSOCK: return fs::file_type::socket;
+    }
+    return fs::file_type::unknown;
+}
+
+/* カーネルから読む。statはディレクトリのfdを基準にしたfstatatで行う */
+class KernelDirectorySource : public DirectorySource {
+public:
+    void Enumerate(const fs::path& dir, std::vector<DirectoryEntry>& entries) const {
+        Read(dir, entries, nullptr);
+    }
+
+    void EnumerateInBatches(const fs::path& dir, const BatchConsumer& consume) const {
+        std::vector<DirectoryEntry> entries;
+        entries.reserve(kBatchSize);
+        Read(dir, entries, &consume);
+        consume(entries);
+    }
+
+    /* 名前を取り出さず、getdents64で読んだレコードの名前の先頭バイトだけを見て数える */
+    uint64_t CountEntries(const fs::path& dir, bool ignore_hidden_file) const {
+        CountSyscall(Stats::Syscall::OpenDirectory);
+        FileDescriptor dir_fd(open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        if (dir_fd.Get() < 0) {
+            throw fs::filesystem_error("directory iterator cannot open directory", dir,
+                                       std::error_code(errno, std::generic_category()));
+        }
+        // readdirの32KiBより大きなバッファで、getdents64の呼び出し回数を減らす
+        std::unique_ptr<char []> buf(new char[kCountBufferSize]);
+        uint64_t count = 0;
+        for (;;) {
+            ssize_t len = getdents64(dir_fd.Get(), buf.get(), kCountBufferSize);
+            if (len < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw fs::filesystem_error("directory iterator cannot advance", dir,
+                                           std::error_code(errno, std::generic_category()));
+            }
+            if (len == 0) {
+                break;
+            }
+            for (ssize_t pos = 0; pos < len;) {
+                const auto *entry = reinterpret_cast<const struct dirent64 *>(buf.get() + pos);
+                pos += entry->d_reclen;
+                const char *name = entry->d_name;
+                if (name[0] != '.') {
+                    count++;
+                } else if (!ignore_hidden_file && name[1] != '\0' && (name[1] != '.' || name[2] != '\0')) {
+                    // "."と".."は数えない
+                    count++;
+                }
+            }
+        }
+        CountStats(Stats::Counter::EntriesRead, count);
+        return count;
+    }
+
+    void LoadStatuses(const fs::path& dir, const DirectoryEntry *const *entries, size_t n,
+                      struct stat *statuses) const {
+        if (n == 0) {
+            return;
+        }
+        FileDescriptor dir_fd(open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        if (dir_fd.Get() < 0) {
+            throw std::system_error(errno, std::generic_category(), "Cannot execute stat");
+        }
+        for (size_t i = 0; i < n; i++) {
+            CountSyscall(Stats::Syscall::Lstat);
+            if (fstatat(dir_fd.Get(), entries[i]->name.c_str(), &statuses[i], AT_SYMLINK_NOFOLLOW) < 0) {
+                throw std::system_error(errno, std::generic_category(), "Cannot execute stat");
+            }
+        }
+    }
+private:
+    static constexpr size_t kCountBufferSize = 1 << 20;
+
+    /* consumeがあれば、kBatchSize件たまるたびに渡して空にする */
+    static void Read(const fs::path& dir, std::vector<DirectoryEntry>& entries, const BatchConsumer *consume) {
+        CountSyscall(Stats::Syscall::OpenDirectory);
+        std::unique_ptr<DIR, int (*)(DIR *)> stream(opendir(dir.c_str()), closedir);
+        if (stream == nullptr) {
+            throw fs::filesystem_error("directory iterator cannot open directory", dir,
+                                       std::error_code(errno, std::generic_category()));
+        }
+        errno = 0;
+        while (struct dirent *entry = readdir(stream.get())) {
+            if (std::strcmp(entry->d_name, ".") == 0 || std::strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            fs::file_type type = FileType(entry->d_type);
+            // d_typeを返さないファイルシステムではここでlstatする
+            if (type == fs::file_type::unknown) {
+                struct stat status;
+                CountSyscall(Stats::Syscall::Lstat);
+                if (fstatat(dirfd(stream.get()), entry->d_name, &status, AT_SYMLINK_NOFOLLOW) == 0) {
+                    type = FileTypeFromMode(status.st_mode);
+                }
+            }
+            entries.push_back(DirectoryEntry{entry->d_name, type, entry->d_ino});
+            if (consume != nullptr && entries.size() == kBatchSize) {
+                (*consume)(entries);
+                entries.clear();
+                errno = 0;
+            }
+        }
+        if (errno != 0) {
+            throw fs::filesystem_error("directory iterator cannot advance", dir,
+                                       std::error_code(errno, std::generic_category()));
+        }
+    }
+
+    static fs::file_type FileType(unsigned char d_type) {
+        switch (d_type) {
+        case DT_REG: return fs::file_type::regular;
+        case DT_DIR: return fs::file_type::directory;
+        case DT_LNK: return fs::file_type::symlink;
+        case DT_BLK: return fs::file_type::block;
+        case DT_CHR: return fs::file_type::character;
+        case DT_FIFO: return fs::file_type::fifo;
+        case DT_SOCK: return fs::file_type::socket;
+        }
+        return fs::file_type::unknown;
+    }
+};
+
+/* メモリ上に置いた合成のエントリを返す。カーネルを介さずにソートや整形を測ったり、
+   呼び出しごとの遅延を入れてNFSのような遅いファイルシステムを真似たりするのに使う */
+class MemoryDirectorySource : public DirectorySource {
+public:
+    MemoryDirectorySource() : m_latency_per_call(0), m_latency_per_entry(0) {}
+
+    /* dirにnameのエントリを加える。種類はstatus.st_modeから決める */
+    void Add(const fs::path& dir, std::string name, const struct stat& status) {
+        Directory& directory = m_directories[dir.native()];
+        directory.index.emplace(name, directory.entries.size());
+        directory.entries.push_back(DirectoryEntry{std::move(name), FileTypeFromMode(status.st_mode), status.st_ino});
+        directory.statuses.push_back(status);
+    }
+
+    /* Enumerate、LoadStatusesの呼び出しごとに per_call + per_entry * エントリ数 だけ待つ */
+    void SetLatency(std::chrono::nanoseconds per_call, std::chrono::nanoseconds per_entry) {
+        m_latency_per_call = per_call;
+        m_latency_per_entry = per_entry;
+    }
+
+    /* 合わせてstatuses件を超えるstatを返すLoadStatusesの呼び出しを、Resumeまで止める。
+       応答の無いNFSのstatを真似て、期限の扱いを時間の長さに頼らずに試す */
+    void HangStatusesAfter(size_t statuses) {
+        std::lock_guard<std::mutex> lock(m_hang_mutex);
+        m_hang_after = statuses;
+    }
+
+    void Resume() {
+        {
+            std::lock_guard<std::mutex> lock(m_hang_mutex);
+            m_hang_after = SIZE_MAX;
+        }
+        m_resumed.notify_all();
+    }
+
+    void Enumerate(const fs::path& dir, std::vector<DirectoryEntry>& entries) const {
+        CountSyscall(Stats::Syscall::OpenDirectory);
+        auto it = m_directories.find(dir.native());
+        if (it == m_directories.end()) {
+            throw fs::filesystem_error("directory iterator cannot open directory", dir,
+                                       std::make_error_code(std::errc::no_such_file_or_directory));
+        }
+        Wait(it->second.entries.size());
+        entries.insert(entries.end(), it->second.entries.begin(), it->second.entries.end());
+    }
+
+    void LoadStatuses(const fs::path& dir, const DirectoryEntry *const *entries, size_t n,
+                      struct stat *statuses) const {
+        auto it = m_directories.find(dir.native());
+        if (it == m_directories.end()) {
+            throw std::system_error(ENOENT, std::generic_category(), "Cannot execute stat");
+        }
+        Wait(n);
+        {
+            std::unique_lock<std::mutex> lock(m_hang_mutex);
+            m_resumed.wait(lock, [&] {
+                return m_statuses_loaded <= m_hang_after && m_hang_after - m_statuses_loaded >= n;
+            });
+            m_statuses_loaded += n;
+        }
+        const Directory& directory = it->second;
+        for (size_t i = 0; i < n; i++) {
+            CountSyscall(Stats::Syscall::Lstat);
+            auto found = directory.index.find(entries[i]->name);
+            if (found == directory.index.end()) {
+                throw std::system_error(ENOENT, std::generic_category(), "Cannot execute stat");
+            }
+            statuses[i] = directory.statuses[found->second];
+        }
+    }
+
+    /* 親ディレクトリに加えられていなければ、エントリを持つディレクトリとして空のstatを返す */
+    struct stat LoadStatusOf(const fs::path& path) const {
+        CountSyscall(Stats::Syscall::Lstat);
+        auto parent = m_directories.find(path.parent_path().native());
+        if (parent != m_directories.end()) {
+            auto found = parent->second.index.find(path.filename().native());
+            if (found != parent->second.index.end()) {
+                return parent->second.statuses[found->second];
+            }
+        }
+        if (m_directories.count(path.native()) == 0) {
+            throw std::system_error(ENOENT, std::generic_category(), "Cannot execute stat");
+        }
+        struct stat status{};
+        status.st_mode = S_IFDIR | 0755;
+        status.st_nlink = 2;
+        return status;
+    }
+private:
+    struct Directory {
+        std::vector<DirectoryEntry> entries;
+        std::vector<struct stat> statuses;
+        std::unordered_map<std::string, size_t> index;
+    };
+
+    void Wait(size_t entries) const {
+        auto latency = m_latency_per_call + m_latency_per_entry * entries;
+        if (latency.count() > 0) {
+            std::this_thread::sleep_for(latency);
+        }
+    }
+
+    std::unordered_map<std::string, Directory> m_directories;
+    std::chrono::nanoseconds m_latency_per_call;
+    std::chrono::nanoseconds m_latency_per_entry;
+    mutable std::mutex m_hang_mutex;
+    mutable std::condition_variable m_resumed;
+    size_t m_hang_after = SIZE_MAX;
+    mutable size_t m_statuses_loaded = 0;
+};
+
+/* 読み取り専用でmmapしたファイル */
+class MappedFile {
+public:
+    explicit MappedFile(const fs::path& path) : m_data(nullptr), m_size(0) {
+        FileDescriptor fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (fd.Get() < 0) {
+            throw std::system_error(errno, std::generic_category(), "Cannot open " + path.native());
+        }
+        struct stat status;
+        if (fstat(fd.Get(), &status) < 0) {
+            throw std::system_error(errno, std::generic_category(), "Cannot execute stat");
+        }
+        if (!S_ISREG(status.st_mode) || status.st_size == 0) {
+            return;
+        }
+        void *data = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd.Get(), 0);
+        if (data == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "Cannot map " + path.native());
+        }
+        m_data = static_cast<const char *>(data);
+        m_size = status.st_size;
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() {
+        if (m_data != nullptr) {
+            munmap(const_cast<char *>(m_data), m_size);
+        }
+    }
+
+    const char *Data() const { return m_data; }
+    size_t Size() const { return m_size; }
+private:
+    const char *m_data;
+    size_t m_size;
+};
+
+/* tarやzipの中身をディレクトリのように見せる。メンバーの名前はマップしたファイルを直接指し、
+   中身を展開したりメンバーごとにコピーしたりはしない */
+class ArchiveDirectorySource : public DirectorySource {
+public:
+    /* pathがtarかzipならその一覧を読んで返す。どちらでもなければnullptr */
+    static std::shared_ptr<const ArchiveDirectorySource> Open(const fs::path& path) {
+        auto archive = std::shared_ptr<ArchiveDirectorySource>(new ArchiveDirectorySource(path));
+        const char *data = archive->m_file.Data();
+        size_t size = archive->m_file.Size();
+        if (size >= 512 && std::memcmp(data + 257, "ustar", 5) == 0) {
+            archive->ParseTar();
+        } else if (size >= 22 && (std::memcmp(data, "PK\x03\x04", 4) == 0 || std::memcmp(data, "PK\x05\x06", 4) == 0)) {
+            archive->ParseZip();
+        } else {
+            return nullptr;
+        }
+        return archive;
+    }
+
+    const fs::path& Path() const { return m_path; }
+
+    void Enumerate(const fs::path& dir, std::vector<DirectoryEntry>& entries) const {
+        CheckPath(dir);
+        entries.reserve(entries.size() + m_members.size());
+        for (size_t i = 0; i < m_members.size(); i++) {
+            entries.push_back(Entry(i));
+        }
+    }
+
+    void EnumerateInBatches(const fs::path& dir, const BatchConsumer& consume) const {
+        CheckPath(dir);
+        std::vector<DirectoryEntry> entries;
+        for (size_t first = 0; first < m_members.size(); first += kBatchSize) {
+            entries.clear();
+            for (size_t i = first; i < std::min(m_members.size(), first + kBatchSize); i++) {
+                entries.push_back(Entry(i));
+            }
+            consume(entries);
+        }
+    }
+
+    void LoadStatuses(const fs::path& dir, const DirectoryEntry *const *entries, size_t n,
+                      struct stat *statuses) const {
+        CheckPath(dir);
+        for (size_t i = 0; i < n; i++) {
+            // Enumerateが返したエントリならinoからメンバーが分かる
+            uint64_t index = entries[i]->ino - 1;
+            if (index >= m_members.size() || m_members[index].name != entries[i]->name) {
+                std::call_once(m_index_once, [this] { BuildIndex(); });
+                auto it = m_index.find(entries[i]->name);
+                if (it == m_index.end()) {
+                    throw std::system_error(ENOENT, std::generic_category(), "Cannot execute stat");
+                }
+                index = it->second;
+            }
+            FillStatus(index, statuses[i]);
+        }
+    }
+private:
+    struct Member {
+        std::string_view name;
+        uint64_t size;
+        int64_t mtime_sec;
+        uint32_t mtime_nsec;
+        uint32_t mode;
+        uint32_t uid;
+        uint32_t gid;
+    };
+
+    explicit ArchiveDirectorySource(const fs::path& path) : m_path(path), m_file(path) {}
+
+    /* inoはLoadStatusesでメンバーを引くための番号 */
+    DirectoryEntry Entry(size_t index) const {
+        const Member& member = m_members[index];
+        return DirectoryEntry{std::string(member.name), FileTypeFromMode(member.mode), index + 1};
+    }
+
+    void CheckPath(const fs::path& dir) const {
+        if (dir != m_path) {
+            throw fs::filesystem_error("directory iterator cannot open directory", dir,
+                                       std::make_error_code(std::errc::not_a_directory));
+        }
+    }
+
+    [[noreturn]] void Invalid(const char *what) const {
+        throw std::system_error(std::make_error_code(std::errc::invalid_argument),
+                                std::string(what) + " in " + m_path.native());
+    }
+
+    void FillStatus(uint32_t index, struct stat& status) const {
+        const Member& member = m_members[index];
+        status = {};
+        status.st_mode = member.mode;
+        status.st_nlink = 1;
+        status.st_uid = member.uid;
+        status.st_gid = member.gid;
+        status.st_size = member.size;
+        status.st_blocks = (member.size + 511) / 512;
+        status.st_blksize = 512;
+        status.st_ino = index + 1;
+        status.st_mtim.tv_sec = member.mtime_sec;
+        status.st_mtim.tv_nsec = member.mtime_nsec;
+        status.st_atim = status.st_mtim;
+        status.st_ctim = status.st_mtim;
+    }
+
+    /* ディレクトリを表す末尾の'/'と、"tar cf t.tar -C dir ."で付く先頭の"./"や絶対パスの'/'を除き、
+       "."などの自分自身を指す名前は捨てる */
+    void AddMember(Member member) {
+        while (member.name.size() > 1 && member.name.back() == '/') {
+            member.name.remove_suffix(1);
+        }
+        for (;;) {
+            if (member.name.substr(0, 2) == "./") {
+                member.name.remove_prefix(2);
+            } else if (!member.name.empty() && member.name[0] == '/') {
+                member.name.remove_prefix(1);
+            } else {
+                break;
+            }
+        }
+        if (member.name.empty() || member.name == "." || !FitsPathLimits(member.name)) {
+            return;
+        }
+        m_members.push_back(member);
+    }
+
+    /* pax/GNUの長い名前やzipの名前はいくらでも長くなれるが、展開できない名前は一覧にも出さない */
+    static bool FitsPathLimits(std::string_view name) {
+        if (name.size() >= PATH_MAX) {
+            return false;
+        }
+        while (!name.empty()) {
+            size_t slash = name.find('/');
+            if (std::min(slash, name.size()) > NAME_MAX) {
+                return false;
+            }
+            name.remove_prefix(slash == std::string_view::npos ? name.size() : slash + 1);
+        }
+        return true;
+    }
+
+    /* 同じ名前が複数あれば後のものを使う (tarに追記された場合と同じ) */
+    void BuildIndex() const {
+        m_index.reserve(m_members.size());
+        for (uint32_t i = 0; i < m_members.size(); i++) {
+            m_index[m_members[i].name] = i;
+        }
+    }
+
+    /* 8進数の文字列、またはGNU tarの256進数 (先頭ビットが立っている) の数値 */
+    static uint64_t ParseTarNumber(const char *p, size_t n) {
+        uint64_t value = 0;
+        if (static_cast<unsigned char>(p[0]) & 0x80) {
+            value = static_cast<unsigned char>(p[0]) & 0x7f;
+            for (size_t i = 1; i < n; i++) {
+                value = value << 8 | static_cast<unsigned char>(p[i]);
+            }
+            return value;
+        }
+        size_t i = 0;
+        while (i < n && (p[i] == ' ' || p[i] == '\0')) {
+            i++;
+        }
+        for (; i < n && p[i] >= '0' && p[i] <= '7'; i++) {
+            value = value * 8 + (p[i] - '0');
+        }
+        return value;
+    }
+
+    /* チェックサム欄を空白とみなした全バイトの和。分岐の無いループにしてベクトル化させる */
+    static bool TarChecksumMatches(const char *header) {
+        auto bytes = reinterpret_cast<const unsigned char *>(header);
+        uint32_t sum = 0;
+        for (size_t i = 0; i < 512; i++) {
+            sum += bytes[i];
+        }
+        for (size_t i = 148; i < 156; i++) {
+            sum += ' ' - bytes[i];
+        }
+        return sum == ParseTarNumber(header + 148, 8);
+    }
+
+    static std::string_view CString(const char *p, size_t n) {
+        return std::string_view(p, strnlen(p, n));
+    }
+
+    /* PAX拡張ヘッダ ("長さ key=value\n" の並び) のうち使うものをmemberに反映する */
+    void ParsePax(std::string_view records, Member& member, std::string_view& name) const {
+        while (!records.empty()) {
+            size_t length = 0;
+            auto [ptr, ec] = std::from_chars(records.data(), records.data() + records.size(), length);
+            if (ec != std::errc() || length == 0 || length > records.size()) {
+                Invalid("Invalid pax header");
+            }
+            std::string_view record = records.substr(0, length);
+            records.remove_prefix(length);
+            record.remove_prefix(ptr - record.data());
+            size_t space = record.find(' ');
+            size_t equal = record.find('=');
+            if (space != 0 || equal == std::string_view::npos || record.back() != '\n') {
+                Invalid("Invalid pax header");
+            }
+            std::string_view key = record.substr(1, equal - 1);
+            std::string_view value = record.substr(equal + 1, record.size() - equal - 2);
+            auto number = [&value]() {
+                uint64_t n = 0;
+                std::from_chars(value.data(), value.data() + value.size(), n);
+                return n;
+            };
+            if (key == "path") {
+                name = value;
+            } else if (key == "size") {
+                member.size = number();
+            } else if (key == "uid") {
+                member.uid = number();
+            } else if (key == "gid") {
+                member.gid = number();
+            } else if (key == "mtime") {
+                member.mtime_sec = number();
+                size_t dot = value.find('.');
+                if (dot != std::string_view::npos) {
+                    std::string_view fraction = value.substr(dot + 1, 9);
+                    uint32_t nsec = 0;
+                    for (size_t i = 0; i < 9; i++) {
+                        nsec = nsec * 10 + (i < fraction.size() ? fraction[i] - '0' : 0);
+                    }
+                    member.mtime_nsec = nsec;
+                }
+            }
+        }
+    }
+
+    void ParseTar() {
+        const char *data = m_file.Data();
+        size_t size = m_file.Size();
+        madvise(const_cast<char *>(data), size, MADV_SEQUENTIAL);
+        // 次のメンバーに効く拡張ヘッダの内容。sizeはpaxに無ければkNoSize
+        constexpr uint64_t kNoSize = UINT64_MAX;
+        Member pending{};
+        std::string_view pending_name;
+        bool has_pending = false;
+        for (size_t offset = 0; offset + 512 <= size;) {
+            const char *header = data + offset;
+            if (header[0] == '\0') {
+                break; /* 終端のゼロブロック */
+            }
+            if (!TarChecksumMatches(header)) {
+                Invalid("Invalid tar header");
+            }
+            uint64_t member_size = ParseTarNumber(header + 124, 12);
+            char typeflag = header[156];
+            bool is_extension = typeflag == 'x' || typeflag == 'L' || typeflag == 'g' || typeflag == 'K';
+            // paxのsizeはustarの欄より優先する。8GiB以上のメンバーはpaxにしか書けない
+            if (!is_extension && has_pending && pending.size != kNoSize) {
+                member_size = pending.size;
+            }
+            size_t data_offset = offset + 512;
+            if (member_size > size - data_offset) {
+                Invalid("Truncated tar archive");
+            }
+            offset = data_offset + (member_size + 511) / 512 * 512;
+            if (typeflag == 'x' || typeflag == 'L') {
+                if (!has_pending) {
+                    pending = Member{};
+                    pending.size = kNoSize;
+                    pending_name = std::string_view();
+                    has_pending = true;
+                }
+                std::string_view body(data + data_offset, member_size);
+                if (typeflag == 'x') {
+                    ParsePax(body, pending, pending_name);
+                } else {
+                    pending_name = CString(body.data(), body.size());
+                }
+                continue;
+            }
+            if (typeflag == 'g' || typeflag == 'K') {
+                continue;
+            }
+            Member member;
+            member.size = member_size;
+            member.mtime_sec = ParseTarNumber(header + 136, 12);
+            member.mtime_nsec = 0;
+            member.uid = ParseTarNumber(header + 108, 8);
+            member.gid = ParseTarNumber(header + 116, 8);
+            std::string_view name = CString(header, 100);
+            std::string_view prefix = CString(header + 345, 155);
+            if (!prefix.empty()) {
+                // ustarのprefixとnameは連続していないので、ここだけは連結した名前を持っておく
+                m_joined_names.push_back(std::string(prefix) + "/" + std::string(name));
+                name = m_joined_names.back();
+            }
+            if (has_pending) {
+                if (!pending_name.empty()) {
+                    name = pending_name;
+                }
+                if (pending.mtime_sec != 0) {
+                    member.mtime_sec = pending.mtime_sec;
+                    member.mtime_nsec = pending.mtime_nsec;
+                }
+                if (pending.uid != 0) {
+                    member.uid = pending.uid;
+                }
+                if (pending.gid != 0) {
+                    member.gid = pending.gid;
+                }
+                has_pending = false;
+            }
+            mode_t type = S_IFREG;
+            switch (typeflag) {
+            case '2': type = S_IFLNK; break;
+            case '3': type = S_IFCHR; break;
+            case '4': type = S_IFBLK; break;
+            case '5': type = S_IFDIR; break;
+            case '6': type = S_IFIFO; break;
+            }
+            if (type != S_IFREG) {
+                member.size = typeflag == '2' ? CString(header + 157, 100).size() : 0;
+            }
+            member.mode = type | (ParseTarNumber(header + 100, 8) & 07777);
+            member.name = name;
+            AddMember(member);
+        }
+    }
+
+    static uint16_t Load16(const char *p) {
+        auto b = reinterpret_cast<const unsigned char *>(p);
+        return b[0] | b[1] << 8;
+    }
+
+    static uint32_t Load32(const char *p) {
+        return Load16(p) | static_cast<uint32_t>(Load16(p + 2)) << 16;
+    }
+
+    static uint64_t Load64(const char *p) {
+        return Load32(p) | static_cast<uint64_t>(Load32(p + 4)) << 32;
+    }
+
+    /* zipは末尾のセントラルディレクトリだけを読む。各メンバーのローカルヘッダや中身には触れない */
+    void ParseZip() {
+        const char *data = m_file.Data();
+        size_t size = m_file.Size();
+        // End of central directory はコメント (最大65535バイト) の手前にある
+        size_t eocd = std::string_view::npos;
+        size_t lowest = size > 22 + 65535 ? size - 22 - 65535 : 0;
+        for (size_t pos = size - 22; ; pos--) {
+            if (std::memcmp(data + pos, "PK\x05\x06", 4) == 0) {
+                eocd = pos;
+                break;
+            }
+            if (pos == lowest) {
+                break;
+            }
+        }
+        if (eocd == std::string_view::npos) {
+            Invalid("Missing zip central directory");
+        }
+        uint64_t count = Load16(data + eocd + 10);
+        uint64_t directory_size = Load32(data + eocd + 12);
+        uint64_t directory_offset = Load32(data + eocd + 16);
+        if ((count == 0xffff || directory_offset == 0xffffffff) && eocd >= 20
+            && std::memcmp(data + eocd - 20, "PK\x06\x07", 4) == 0) {
+            uint64_t zip64_eocd = Load64(data + eocd - 20 + 8);
+            if (size < 56 || zip64_eocd > size - 56 || std::memcmp(data + zip64_eocd, "PK\x06\x06", 4) != 0) {
+                Invalid("Invalid zip64 end of central directory");
+            }
+            count = Load64(data + zip64_eocd + 32);
+            directory_size = Load64(data + zip64_eocd + 40);
+            directory_offset = Load64(data + zip64_eocd + 48);
+        }
+        if (directory_offset > size || directory_size > size - directory_offset) {
+            Invalid("Truncated zip central directory");
+        }
+        // countは信用できないので、セントラルディレクトリに入りうる数 (1件46バイト以上) までしか確保しない
+        m_members.reserve(std::min<uint64_t>(count, directory_size / 46));
+        const char *p = data + directory_offset;
+        const char *end = p + directory_size;
+        for (uint64_t i = 0; i < count; i++) {
+            if (end - p < 46 || std::memcmp(p, "PK\x01\x02", 4) != 0) {
+                Invalid("Invalid zip central directory");
+            }
+            uint16_t name_length = Load16(p + 28);
+            uint16_t extra_length = Load16(p + 30);
+            uint16_t comment_length = Load16(p + 32);
+            size_t record_length = 46 + name_length + extra_length + comment_length;
+            if (static_cast<size_t>(end - p) < record_length) {
+                Invalid("Invalid zip central directory");
+            }
+            Member member{};
+            member.name = std::string_view(p + 46, name_length);
+            member.size = Load32(p + 24);
+            member.mtime_sec = DosTime(Load16(p + 14), Load16(p + 12));
+            bool is_directory = !member.name.empty() && member.name.back() == '/';
+            uint32_t external = Load32(p + 38);
+            // 作成したOSがUNIX (3) なら外部属性の上位16bitがst_mode
+            if (p[5] == 3 && (external >> 16) != 0) {
+                member.mode = external >> 16;
+            } else {
+                member.mode = is_directory ? S_IFDIR | 0755 : S_IFREG | 0644;
+            }
+            const char *extra = p + 46 + name_length;
+            const char *extra_end = extra + extra_length;
+            while (extra_end - extra >= 4) {
+                uint16_t id = Load16(extra);
+                uint16_t length = Load16(extra + 2);
+                const char *field = extra + 4;
+                if (extra_end - field < length) {
+                    break;
+                }
+                if (id == 0x0001 && member.size == 0xffffffff && length >= 8) {
+                    member.size = Load64(field); /* Zip64の元のサイズ */
+                } else if (id == 0x5455 && length >= 5 && (field[0] & 1)) {
+                    member.mtime_sec = static_cast<int32_t>(Load32(field + 1));
+                } else if (id == 0x7875 && length >= 3 && field[1] == 4 && length >= 11 && field[6] == 4) {
+                    member.uid = Load32(field + 2);
+                    member.gid = Load32(field + 7);
+                }
+                extra = field + length;
+            }
+            AddMember(member);
+            p += record_length;
+        }
+    }
+
+    /* MS-DOS形式の日時 (ローカル時刻) をUNIX時間にする */
+    static int64_t DosTime(uint16_t date, uint16_t time) {
+        struct tm tm{};
+        tm.tm_year = (date >> 9) + 80;
+        tm.tm_mon = ((date >> 5) & 0x0f) - 1;
+        tm.tm_mday = date & 0x1f;
+        tm.tm_hour = time >> 11;
+        tm.tm_min = (time >> 5) & 0x3f;
+        tm.tm_sec = (time & 0x1f) * 2;
+        tm.tm_isdst = -1;
+        return mktime(&tm);
+    }
+
+    fs::path m_path;
+    MappedFile m_file;
+    std::vector<Member> m_members;
+    std::deque<std::string> m_joined_names;
+    mutable std::once_flag m_index_once;
+    mutable std::unordered_map<std::string_view, uint32_t> m_index;
+};
+
+/* カーネルから読む。ディレクトリでないパスがtarかzipなら、その中身を一覧する */
+class DefaultDirectorySource : public DirectorySource {
+public:
+    void Enumerate(const fs::path& dir, std::vector<DirectoryEntry>& entries) const {
+        try {
+            m_kernel.Enumerate(dir, entries);
+        } catch (const fs::filesystem_error& e) {
+            if (e.code() != std::errc::not_a_directory) {
+                throw;
+            }
+            auto archive = OpenArchive(dir);
+            if (archive == nullptr) {
+                throw;
+            }
+            archive->Enumerate(dir, entries);
+        }
+    }
+
+    void EnumerateInBatches(const fs::path& dir, const BatchConsumer& consume) const {
+        // opendirに失敗したときはまだ何も渡していないので、アーカイブとして読み直せる
+        try {
+            m_kernel.EnumerateInBatches(dir, consume);
+        } catch (const fs::filesystem_error& e) {
+            if (e.code() != std::errc::not_a_directory) {
+                throw;
+            }
+            auto archive = OpenArchive(dir);
+            if (archive == nullptr) {
+                throw;
+            }
+            archive->EnumerateInBatches(dir, consume);
+        }
+    }
+
+    uint64_t CountEntries(const fs::path& dir, bool ignore_hidden_file) const {
+        try {
+            return m_kernel.CountEntries(dir, ignore_hidden_file);
+        } catch (const fs::filesystem_error& e) {
+            if (e.code() != std::errc::not_a_directory) {
+                throw;
+            }
+            auto archive = OpenArchive(dir);
+            if (archive == nullptr) {
+                throw;
+            }
+            return archive->CountEntries(dir, ignore_hidden_file);
+        }
+    }
+
+    void LoadStatuses(const fs::path& dir, const DirectoryEntry *const *entries, size_t n,
+                      struct stat *statuses) const {
+        std::shared_ptr<const ArchiveDirectorySource> archive;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_archive != nullptr && m_archive->Path() == dir) {
+                archive = m_archive;
+            }
+        }
+        if (archive != nullptr) {
+            archive->LoadStatuses(dir, entries, n, statuses);
+        } else {
+            m_kernel.LoadStatuses(dir, entries, n, statuses);
+        }
+    }
+private:
+    /* 最後に開いたアーカイブを1つだけ覚えておく */
+    std::shared_ptr<const ArchiveDirectorySource> OpenArchive(const fs::path& path) const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_archive == nullptr || m_archive->Path() != path) {
+            m_archive = ArchiveDirectorySource::Open(path);
+        }
+        return m_archive;
+    }
+
+    KernelDirectorySource m_kernel;
+    mutable std::mutex m_mutex;
+    mutable std::shared_ptr<const ArchiveDirectorySource> m_archive;
+};
+
+/* display_flagsで指定されたソース。指定が無ければカーネル (とアーカイブ) */
+const DirectorySource& SourceOf(const DisplayFlags& display_flags) {
+    static const DefaultDirectorySource default_source;
+    return display_flags.source != nullptr ? *display_flags.source : default_source;
+}
+
+/* 1秒あたりrate個のトークンを、最大capacity個まで貯めて配る。複数のスレッドから使える。
+   足りない分は前借りして残高を負にし、借りた分が貯まるまで呼び出したスレッドを眠らせる。
+   後から来たスレッドは前借りの後ろに並ぶので、全体の速さはrateを超えない */
+class TokenBucket {
+public:
+    TokenBucket(double rate, double capacity)
+        : m_rate(rate),
+          m_capacity(capacity),
+          m_tokens(capacity),
+          m_updated(std::chrono::steady_clock::now()) {}
+
+    double Capacity() const { return m_capacity; }
+
+    void Acquire(double tokens) {
+        std::chrono::duration<double> wait;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto now = std::chrono::steady_clock::now();
+            std::chrono::duration<double> elapsed = now - m_updated;
+            m_tokens = std::min(m_capacity, m_tokens + elapsed.count() * m_rate);
+            m_updated = now;
+            m_tokens -= tokens;
+            wait = std::chrono::duration<double>(m_tokens < 0 ? -m_tokens / m_rate : 0);
+        }
+        if (wait.count() > 0) {
+            std::this_thread::sleep_for(wait);
+        }
+    }
+private:
+    double m_rate;
+    double m_capacity;
+    std::mutex m_mutex;
+    double m_tokens;
+    std::chrono::steady_clock::time_point m_updated;
+};
+
+/* --max-iops、--max-dirs-per-sec: 別のソースへの呼び出しを、全てのスレッドで共有するトークンバケットで絞る。
+   ディレクトリの列挙は1回のI/Oと1ディレクトリ、statは1件ごとに1回のI/Oと数える。
+   多くのエントリのstatはバケットの容量ずつに分けて、まとめて出さずに均して出す */
+class RateLimitedDirectorySource : public DirectorySource {
+public:
+    /* 0を指定した方は絞らない */
+    RateLimitedDirectorySource(std::shared_ptr<const DirectorySource> source, double max_iops,
+                               double max_dirs_per_sec)
+        : m_owner(std::move(source)),
+          m_source(m_owner != nullptr ? *m_owner : SourceOf(DisplayFlags())),
+          m_iops(MakeBucket(max_iops)),
+          m_dirs(MakeBucket(max_dirs_per_sec)) {}
+
+    void Enumerate(const fs::path& dir, std::vector<DirectoryEntry>& entries) const {
+        AcquireDirectory();
+        m_source.Enumerate(dir, entries);
+    }
+
+    void EnumerateInBatches(const fs::path& dir, const BatchConsumer& consume) const {
+        AcquireDirectory();
+        m_source.EnumerateInBatches(dir, consume);
+    }
+
+    uint64_t CountEntries(const fs::path& dir, bool ignore_hidden_file) const {
+        AcquireDirectory();
+        return m_source.CountEntries(dir, ignore_hidden_file);
+    }
+
+    void LoadStatuses(const fs::path& dir, const DirectoryEntry *const *entries, size_t n,
+                      struct stat *statuses) const {
+        if (m_iops == nullptr) {
+            m_source.LoadStatuses(dir, entries, n, statuses);
+            return;
+        }
+        size_t chunk = static_cast<size_t>(m_iops->Capacity());
+        for (size_t i = 0; i < n; i += chunk) {
+            size_t count = std::min(chunk, n - i);
+            m_iops->Acquire(count);
+            m_source.LoadStatuses(dir, entries + i, count, statuses + i);
+        }
+    }
+
+    struct stat LoadStatusOf(const fs::path& path) const {
+        if (m_iops != nullptr) {
+            m_iops->Acquire(1);
+        }
+        return m_source.LoadStatusOf(path);
+    }
+private:
+    /* 容量は0.1秒分 (少なくとも1)。小さいほど均されるが、バケットのロックを取る回数が増える */
+    static std::unique_ptr<TokenBucket> MakeBucket(double rate) {
+        if (rate <= 0) {
+            return nullptr;
+        }
+        return std::make_unique<TokenBucket>(rate, std::max(1.0, std::floor(rate / 10)));
+    }
+
+    void AcquireDirectory() const {
+        if (m_dirs != nullptr) {
+            m_dirs->Acquire(1);
+        }
+        if (m_iops != nullptr) {
+            m_iops->Acquire(1);
+        }
+    }
+
+    std::shared_ptr<const DirectorySource> m_owner;
+    const DirectorySource& m_source;
+    std::unique_ptr<TokenBucket> m_iops;
+    std::unique_ptr<TokenBucket> m_dirs;
+};
+
+/* --low-priority: 呼び出したスレッドをidleのI/Oスケジューリングクラスとnice 19にする。
+   どちらも後から作るスレッドに引き継がれるので、ワーカーを作る前に呼ぶ */
+void LowerPriority() {
+    constexpr int kIoprioClassShift = 13;
+    constexpr int kIoprioClassIdle = 3;
+    constexpr int kIoprioWhoProcess = 1;
+    if (syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, kIoprioClassIdle << kIoprioClassShift) < 0) {
+        throw std::system_error(errno, std::generic_category(), "Cannot set the I/O priority");
+    }
+    if (setpriority(PRIO_PROCESS, 0, 19) < 0) {
+        throw std::system_error(errno, std::generic_category(), "Cannot set the CPU priority");
+    }
+}
+
+/* ListSortedFilesがstat結果を返さなかった場合に、ここでまとめてstatする */
+void LoadStatuses(const DirectorySource& source, const fs::path& dir,
+                  const std::vector<DirectoryEntry>& filepaths, std::vector<struct stat>& statuses) {
+    if (statuses.size() == filepaths.size()) {
+        return;
+    }
+    PhaseTimer timer(Stats::Phase::Stat);
+    std::vector<const DirectoryEntry*> entries;
+    entries.reserve(filepaths.size());
+    for (const auto& filepath : filepaths) {
+        entries.push_back(&filepath);
+    }
+    statuses.resize(filepaths.size());
+    source.LoadStatuses(dir, entries.data(), entries.size(), statuses.data());
+}
+
+/* statが必要な条件をバッチ単位で評価し、合わないエントリを除く。
+   statusesを渡すと、残ったエントリのstat結果を同じ順に詰めて返す */
+std::vector<DirectoryEntry>
+FilterByStatus(const DirectorySource& source, const fs::path& dir, std::vector<DirectoryEntry> entries,
+               const std::vector<bool>& decided, const Predicate& where, std::vector<struct stat> *statuses) {
+    constexpr size_t kBatchSize = 1024;
+    std::vector<DirectoryEntry> ret;
+    ret.reserve(entries.size());
+    if (statuses != nullptr) {
+        statuses->clear();
+        statuses->reserve(entries.size());
+    }
+    std::vector<size_t> indices;
+    std::vector<std::string_view> filenames;
+    std::vector<const DirectoryEntry*> batch_entries;
+    std::vector<struct stat> batch;
+    std::vector<uint8_t> matched;
+    for (size_t first = 0; first < entries.size(); first += kBatchSize) {
+        size_t last = std::min(entries.size(), first + kBatchSize);
+        indices.clear();
+        filenames.clear();
+        batch_entries.clear();
+        batch.clear();
+        {
+            PhaseTimer timer(Stats::Phase::Stat);
+            for (size_t i = first; i < last; i++) {
+                // 名前だけで一致が確定していても、呼び出し側がstat結果を使うならここでstatしておく
+                if (!decided[i] || statuses != nullptr) {
+                    indices.push_back(i);
+                    filenames.push_back(entries[i].name);
+                    batch_entries.push_back(&entries[i]);
+                }
+            }
+            batch.resize(batch_entries.size());
+            source.LoadStatuses(dir, batch_entries.data(), batch_entries.size(), batch.data());
+        }
+        matched.assign(indices.size(), 1);
+        where.MatchesBatch(filenames.data(), batch.data(), batch.size(), matched.data());
+        size_t k = 0;
+        for (size_t i = first; i < last; i++) {
+            bool stated = k < indices.size() && indices[k] == i;
+            if (stated && !matched[k] && !decided[i]) {
+                k++;
+                continue;
+            }
+            ret.push_back(std::move(entries[i]));
+            if (statuses != nullptr) {
+                statuses->push_back(batch[k]);
+            }
+            if (stated) {
+                k++;
+            }
+        }
+    }
+    return ret;
+}
+
+/* 最後の.から後ろ。先頭の.は隠しファイルの印なので拡張子とみなさない */
+std::string_view ExtensionOf(std::string_view name) {
+    size_t dot = name.rfind('.');
+    return dot == std::string_view::npos || dot == 0 ? std::string_view() : name.substr(dot);
+}
+
+bool SortNeedsStatus(SortKey key) {
+    return key == SortKey::Size || key == SortKey::Time;
+}
+
+/* -vの比較に使うキーをkeyの後ろに足す。数字の並びは先頭の0を除いた桁数 (2バイト) と数字で表し、
+   キーをバイト列として比べるだけで数値の順になるようにする。比較のたびに数字を読み直さずに済む */
+void AppendVersionKey(std::string_view name, std::string& key) {
+    for (size_t i = 0; i < name.size();) {
+        if (!std::isdigit(static_cast<unsigned char>(name[i]))) {
+            key.push_back(name[i++]);
+            continue;
+        }
+        while (i < name.size() && name[i] == '0') {
+            i++;
+        }
+        size_t first = i;
+        while (i < name.size() && std::isdigit(static_cast<unsigned char>(name[i]))) {
+            i++;
+        }
+        size_t digits = std::min<size_t>(i - first, 0xffff);
+        key.push_back('0');
+        key.push_back(static_cast<char>(digits >> 8));
+        key.push_back(static_cast<char>(digits & 0xff));
+        key.append(name.data() + first, i - first);
+    }
+}
+
+/* -Sと-tの並べ替えキー。小さいほど先に並ぶ */
+uint64_t StatusSortKey(const struct stat& status, SortKey sort_key) {
+    if (sort_key == SortKey::Size) {
+        // 大きい順なので反転する
+        return ~static_cast<uint64_t>(status.st_size);
+    }
+    int64_t ns = static_cast<int64_t>(status.st_mtim.tv_sec) * 1000000000 + status.st_mtim.tv_nsec;
+    // 符号ビットを反転して符号無しの順序に合わせ、新しい順にするためさらに反転する
+    return ~(static_cast<uint64_t>(ns) ^ (1ULL << 63));
+}
+
+/* keyの先頭8バイトをビッグエンディアンの整数に詰める。整数の大小がバイト列の辞書順と一致する */
+uint64_t PackPrefix(std::string_view key) {
+    uint64_t packed = 0;
+    for (size_t i = 0; i < 8; i++) {
+        packed = packed << 8 | (i < key.size() ? static_cast<unsigned char>(key[i]) : 0);
+    }
+    return packed;
+}
+
+/* -S、-t、-X、-vの並べ替え。エントリごとのキーを1回だけ作り、連続した (キー, 添字) の組を並べてから
+   エントリとstatusesを並べ直す。statusesは空でなければentriesと同じ順に並んでいる。
+   limitを指定すると、並べた結果の先頭 (from_endなら末尾) のlimit件だけをnth_elementで選んでから並べ、残りは捨てる */
+void SortEntries(std::vector<DirectoryEntry>& entries, std::vector<struct stat>& statuses, SortKey sort_key,
+                 bool reverse = false, size_t limit = SIZE_MAX, bool from_end = false) {
+    struct SortItem {
+        uint64_t key;
+        uint32_t index;
+    };
+    size_t n = entries.size();
+    std::vector<SortItem> items(n);
+    // 拡張子と-vのキーは先頭8バイトをitemに詰め、続きはここから引く
+    std::string tails;
+    std::vector<uint32_t> tail_offsets;
+    if (sort_key == SortKey::Extension || sort_key == SortKey::Version) {
+        tail_offsets.resize(n + 1);
+    }
+    for (size_t i = 0; i < n; i++) {
+        items[i].index = i;
+        switch (sort_key) {
+        case SortKey::Size:
+        case SortKey::Time:
+            items[i].key = StatusSortKey(statuses[i], sort_key);
+            break;
+        case SortKey::Extension: {
+            std::string_view name = entries[i].name;
+            // 拡張子の無い名前が先に来る
+            std::string_view extension = ExtensionOf(name);
+            // 拡張子が同じときに名前を引きに行かずに済むよう、名前も続けて置く
+            tail_offsets[i] = tails.size();
+            tails.append(extension);
+            tails.push_back('\0');
+            tails.append(name);
+            items[i].key = PackPrefix(extension);
+            break;
+        }
+        case SortKey::Version:
+            tail_offsets[i] = tails.size();
+            AppendVersionKey(entries[i].name, tails);
+            items[i].key = PackPrefix(std::string_view(tails).substr(tail_offsets[i]));
+            break;
+        case SortKey::Name:
+            break;
+        }
+    }
+    if (!tail_offsets.empty()) {
+        tail_offsets[n] = tails.size();
+    }
+    auto tail = [&](uint32_t index) {
+        return std::string_view(tails.data() + tail_offsets[index], tail_offsets[index + 1] - tail_offsets[index]);
+    };
+    bool has_tail = !tail_offsets.empty();
+    auto less = [&](const SortItem& a, const SortItem& b) {
+        if (a.key != b.key) {
+            return a.key < b.key;
+        }
+        if (has_tail) {
+            int cmp = tail(a.index).compare(tail(b.index));
+            if (cmp != 0) {
+                return cmp < 0;
+            }
+        }
+        return entries[a.index].name < entries[b.index].name;
+    };
+    auto before = [&](const SortItem& a, const SortItem& b) { return reverse ? less(b, a) : less(a, b); };
+    if (limit < n) {
+        if (from_end) {
+            std::nth_element(items.begin(), items.begin() + limit, items.end(),
+                             [&](const SortItem& a, const SortItem& b) { return before(b, a); });
+        } else {
+            std::nth_element(items.begin(), items.begin() + limit, items.end(), before);
+        }
+        items.resize(limit);
+    }
+    std::sort(items.begin(), items.end(), before);
+    std::vector<DirectoryEntry> sorted_entries;
+    sorted_entries.reserve(items.size());
+    for (const auto& item : items) {
+        sorted_entries.push_back(std::move(entries[item.index]));
+    }
+    entries = std::move(sorted_entries);
+    if (!statuses.empty()) {
+        std::vector<struct stat> sorted_statuses;
+        sorted_statuses.reserve(items.size());
+        for (const auto& item : items) {
+            sorted_statuses.push_back(statuses[item.index]);
+        }
+        statuses = std::move(sorted_statuses);
+    }
+}
+
+bool IsHiddenFile(std::string_view filename) {
+    return !filename.empty() && filename[0] == '.';
+}
+
+/* 隠しファイル、--ignore、.gitignore、--whereに合わないエントリをfilepathsから除く。
+   statusesについてはFilterByStatusと同じ */
+std::vector<DirectoryEntry>
+FilterEntries(const DirectorySource& source, const fs::path& target_path, const DisplayFlags& display_flags,
+              const GitignoreRules *gitignore, std::vector<DirectoryEntry>& filepaths,
+              std::vector<struct stat> *statuses) {
+    PhaseTimer timer(Stats::Phase::Filter);
+    const PatternSet *ignore_patterns = display_flags.ignore_patterns.get();
+    const Predicate *where = display_flags.where.get();
+    std::vector<DirectoryEntry> ret;
+    ret.reserve(filepaths.size());
+    std::vector<bool> decided;
+    for (auto& filepath : filepaths) {
+        std::string_view filename = filepath.name;
+        if (display_flags.ignore_hidden_file && IsHiddenFile(filename)) {
+            continue;
+        }
+        if (ignore_patterns != nullptr && ignore_patterns->Match(filename) >= 0) {
+            continue;
+        }
+        if (gitignore != nullptr && gitignore->IsIgnored(filename, filepath.type == fs::file_type::directory)) {
+            continue;
+        }
+        if (where != nullptr) {
+            // 名前とd_typeだけで決まる条件はstatの前に評価する
+            auto matched = where->MatchesWithoutStatus(filename, filepath.type);
+            if (matched == false) {
+                continue;
+            }
+            decided.push_back(matched.has_value());
+        }
+        ret.push_back(std::move(filepath));
+    }
+    if (where != nullptr && where->NeedsStatus()) {
+        ret = FilterByStatus(source, target_path, std::move(ret), decided, *where, statuses);
+    }
+    return ret;
+}
+
+std::vector<DirectoryEntry>
+ListSortedFiles(const fs::path& target_path, const DisplayFlags& display_flags,
+                std::vector<struct stat> *statuses = nullptr) {
+    const DirectorySource& source = SourceOf(display_flags);
+    // サイズや日時で並べるときは、statの結果を呼び出し側が要らなくてもここで取る
+    std::vector<struct stat> sort_statuses;
+    if (statuses == nullptr && SortNeedsStatus(display_flags.sort_key)) {
+        statuses = &sort_statuses;
+    }
+    std::optional<GitignoreRules> gitignore;
+    if (display_flags.respect_gitignore) {
+        gitignore.emplace(target_path);
+    }
+    const GitignoreRules *rules = gitignore.has_value() ? &*gitignore : nullptr;
+    std::vector<struct stat> no_statuses;
+    std::vector<DirectoryEntry> ret;
+    if (display_flags.limit == SIZE_MAX) {
+        std::vector<DirectoryEntry> filepaths;
+        {
+            PhaseTimer timer(Stats::Phase::Enumerate);
+            source.Enumerate(target_path, filepaths);
+            CountStats(Stats::Counter::EntriesRead, filepaths.size());
+        }
+        if (display_flags.sort_key == SortKey::Name) {
+            PhaseTimer timer(Stats::Phase::Sort);
+            std::sort(std::begin(filepaths), std::end(filepaths));
+        }
+        ret = FilterEntries(source, target_path, display_flags, rules, filepaths, statuses);
+        if (display_flags.sort_key != SortKey::Name) {
+            if (SortNeedsStatus(display_flags.sort_key)) {
+                LoadStatuses(source, target_path, ret, *statuses);
+            }
+            PhaseTimer timer(Stats::Phase::Sort);
+            SortEntries(ret, statuses != nullptr ? *statuses : no_statuses, display_flags.sort_key,
+                        display_flags.reverse);
+        } else if (display_flags.reverse) {
+            std::reverse(ret.begin(), ret.end());
+            if (statuses != nullptr) {
+                std::reverse(statuses->begin(), statuses->end());
+            }
+        }
+    } else {
+        // --head、--tail: 読んだ分から順に絞り込み、limit件を大きく超えたら上位limit件だけを残す。
+        // 持つのはlimit件と読み出し1回分だけで、全件の並べ替えもしない
+        std::vector<struct stat>& kept_statuses = statuses != nullptr ? *statuses : no_statuses;
+        kept_statuses.clear();
+        std::vector<struct stat> batch_statuses;
+        size_t limit = display_flags.limit;
+        auto select = [&] {
+            PhaseTimer timer(Stats::Phase::Sort);
+            SortEntries(ret, kept_statuses, display_flags.sort_key, display_flags.reverse, limit,
+                        display_flags.limit_from_end);
+        };
+        PhaseTimer timer(Stats::Phase::Enumerate);
+        source.EnumerateInBatches(target_path, [&](std::vector<DirectoryEntry>& batch) {
+            CountStats(Stats::Counter::EntriesRead, batch.size());
+            batch_statuses.clear();
+            auto filtered = FilterEntries(source, target_path, display_flags, rules, batch,
+                                          statuses != nullptr ? &batch_statuses : nullptr);
+            if (SortNeedsStatus(display_flags.sort_key)) {
+                LoadStatuses(source, target_path, filtered, batch_statuses);
+            }
+            std::move(filtered.begin(), filtered.end(), std::back_inserter(ret));
+            kept_statuses.insert(kept_statuses.end(), batch_statuses.begin(), batch_statuses.end());
+            if (ret.size() > limit && ret.size() - limit >= std::max(limit, DirectorySource::kBatchSize)) {
+                select();
+            }
+        });
+        select();
+    }
+    ret.shrink_to_fit();
+    CountStats(Stats::Counter::EntriesListed, ret.size());
+    if (g_perf != nullptr) {
+        g_perf->AddEntries(ret.size());
+    }
+    return ret;
+}
+
+std::string JoinPath(const std::string& dir, std::string_view name) {
+    std::string path;
+    path.reserve(dir.size() + 1 + name.size());
+    path = dir;
+    if (path.empty() || path.back() != '/') {
+        path.push_back('/');
+    }
+    path += name;
+    return path;
+}
+
+/* ディレクトリの木を複数のスレッドで辿る。各ディレクトリのエントリをListSortedFilesと同じ条件で絞り込み、
+   stat結果と共にvisitへ渡す。シンボリックリンクの先には降りない */
+class ParallelWalker {
+public:
+    /* workerは0からThreads()-1までのスレッドの番号。同じworkerの呼び出しが並行することは無い */
+    using Visitor = std::function<void(size_t worker, const std::string& dir, std::vector<DirectoryEntry>& entries,
+                                       std::vector<struct stat>& statuses)>;
+    /* Visitorに加えて、このディレクトリの後に辿る (待ち行列に積む順の) サブディレクトリを受け取る */
+    using TreeVisitor = std::function<void(size_t worker, const std::string& dir, std::vector<DirectoryEntry>& entries,
+                                           std::vector<struct stat>& statuses,
+                                           const std::vector<std::string>& subdirectories)>;
+
+    /* one_file_systemなら (-x)、rootと異なるファイルシステムのディレクトリには降りない */
+    ParallelWalker(const DisplayFlags& display_flags, size_t threads, bool one_file_system = false)
+        : m_display_flags(display_flags),
+          m_threads(threads != 0 ? threads : std::max(1u, std::thread::hardware_concurrency())),
+          m_one_file_system(one_file_system),
+          m_root_device(0) {
+        // --whereは一覧に載せるかどうかだけを決め、降りるかどうかには使わない
+        m_display_flags.where = nullptr;
+        m_where_flags.ignore_hidden_file = false;
+        m_where_flags.where = display_flags.where;
+        m_where_flags.source = display_flags.source;
+    }
+
+    /* pendingはまだ辿っていないディレクトリ (辿り終えた部分木の外側の境界) */
+    using Checkpoint = std::function<void(const std::vector<std::string>& pending)>;
+
+    size_t Threads() const { return m_threads; }
+
+    /* interval毎に、辿っている途中のディレクトリが無くなるまで全てのスレッドを止めて、checkpointを呼ぶ。
+       checkpointが投げた例外は辿るのを止めてWalkから投げる */
+    void SetCheckpoint(std::chrono::nanoseconds interval, Checkpoint checkpoint) {
+        m_checkpoint_interval = interval;
+        m_checkpoint = std::move(checkpoint);
+    }
+
+    /* rootの下を全て辿り終えるまで戻らない。rootを読めなければ例外を投げ、
+       その下のディレクトリを読めなければ標準エラー出力に書いて続ける。
+       frontierがあれば、rootからではなくcheckpointで受け取ったpendingから続ける */
+    void Walk(const fs::path& root, const Visitor& visit, const std::vector<std::string> *frontier = nullptr) {
+        TreeVisitor tree_visit = [&visit](size_t worker, const std::string& dir, std::vector<DirectoryEntry>& entries,
+                                          std::vector<struct stat>& statuses, const std::vector<std::string>&) {
+            visit(worker, dir, entries, statuses);
+        };
+        Run(root, tree_visit, frontier, false);
+    }
+
+    /* Walkと同じだが、visitにサブディレクトリも渡す。読めなかったディレクトリについても、
+       読めた分 (多くは空) で呼ぶので、呼び出し側は全てのディレクトリの結果が揃うのを待てる */
+    void WalkTree(const fs::path& root, const TreeVisitor& visit, const std::vector<std::string> *frontier = nullptr) {
+        Run(root, visit, frontier, true);
+    }
+private:
+    void Run(const fs::path& root, const TreeVisitor& visit, const std::vector<std::string> *frontier,
+             bool visit_unreadable) {
+        m_root = root.native();
+        m_visit_unreadable = visit_unreadable;
+        if (m_one_file_system) {
+            m_root_device = SourceOf(m_display_flags).LoadStatusOf(root).st_dev;
+        }
+        if (frontier != nullptr) {
+            m_pending = *frontier;
+        } else {
+            m_pending.assign(1, m_root);
+        }
+        m_active = 0;
+        m_fatal_error = nullptr;
+        m_next_checkpoint = std::chrono::steady_clock::now() + m_checkpoint_interval;
+        std::vector<std::thread> threads;
+        for (size_t worker = 1; worker < m_threads; worker++) {
+            threads.emplace_back([this, worker, &visit] { Work(worker, visit); });
+        }
+        Work(0, visit);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        if (m_fatal_error != nullptr) {
+            std::rethrow_exception(m_fatal_error);
+        }
+    }
+
+    void Work(size_t worker, const TreeVisitor& visit) {
+        std::vector<DirectoryEntry> entries;
+        std::vector<struct stat> statuses;
+        std::vector<std::string> subdirectories;
+        for (;;) {
+            std::string dir;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                for (;;) {
+                    if (m_fatal_error != nullptr) {
+                        return;
+                    }
+                    if (m_checkpoint != nullptr && std::chrono::steady_clock::now() >= m_next_checkpoint) {
+                        // 新しいディレクトリを取らずに、辿っている途中のものが終わるのを待ってから書く。
+                        // 書いたらすぐに次のディレクトリを取り、間隔が短くても少しずつは進む
+                        if (m_active != 0) {
+                            m_ready.wait(lock, [this] { return m_active == 0 || m_fatal_error != nullptr; });
+                            continue;
+                        }
+                        WriteCheckpoint();
+                        if (m_fatal_error != nullptr) {
+                            return;
+                        }
+                    }
+                    if (!m_pending.empty() || m_active == 0) {
+                        break;
+                    }
+                    // 他のスレッドが辿っている間は、新しいディレクトリが積まれるかもしれないので待つ
+                    m_ready.wait(lock, [this] {
+                        return !m_pending.empty() || m_active == 0 || m_fatal_error != nullptr;
+                    });
+                }
+                if (m_pending.empty()) {
+                    return;
+                }
+                dir = std::move(m_pending.back());
+                m_pending.pop_back();
+                m_active++;
+            }
+            subdirectories.clear();
+            bool visited = false;
+            try {
+                Visit(worker, dir, visit, entries, statuses, subdirectories, visited);
+            } catch (const std::system_error& e) {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    if (dir == m_root) {
+                        m_fatal_error = std::current_exception();
+                    } else {
+                        std::cerr << "ls: " << dir << ": " << e.what() << std::endl;
+                    }
+                }
+                if (m_visit_unreadable && !visited && dir != m_root) {
+                    entries.clear();
+                    statuses.clear();
+                    visit(worker, dir, entries, statuses, subdirectories);
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                // 後に積んだものから取るので、深さ優先に近い順で辿り、待ち行列が大きくならない
+                for (auto& subdirectory : subdirectories) {
+                    m_pending.push_back(std::move(subdirectory));
+                }
+                m_active--;
+            }
+            m_ready.notify_all();
+        }
+    }
+
+    void Visit(size_t worker, const std::string& dir, const TreeVisitor& visit, std::vector<DirectoryEntry>& entries,
+               std::vector<struct stat>& statuses, std::vector<std::string>& subdirectories, bool& visited) {
+        const DirectorySource& source = SourceOf(m_display_flags);
+        entries.clear();
+        statuses.clear();
+        {
+            PhaseTimer timer(Stats::Phase::Enumerate);
+            source.Enumerate(dir, entries);
+            CountStats(Stats::Counter::EntriesRead, entries.size());
+        }
+        std::optional<GitignoreRules> gitignore;
+        if (m_display_flags.respect_gitignore) {
+            gitignore.emplace(dir);
+        }
+        auto filtered = FilterEntries(source, dir, m_display_flags, gitignore.has_value() ? &*gitignore : nullptr,
+                                      entries, nullptr);
+        if (m_where_flags.where == nullptr) {
+            LoadStatuses(source, dir, filtered, statuses);
+            for (size_t i = 0; i < filtered.size(); i++) {
+                if (filtered[i].type == fs::file_type::directory && OnSameFileSystem(statuses[i])) {
+                    subdirectories.push_back(JoinPath(dir, filtered[i].name));
+                }
+            }
+        } else {
+            // --whereで一覧から外れるディレクトリにも降りる。-xのときはそれらのデバイスだけ別に調べる
+            std::vector<const DirectoryEntry*> directories;
+            for (const auto& entry : filtered) {
+                if (entry.type == fs::file_type::directory) {
+                    directories.push_back(&entry);
+                }
+            }
+            std::vector<struct stat> directory_statuses(m_one_file_system ? directories.size() : 0);
+            if (m_one_file_system && !directories.empty()) {
+                PhaseTimer timer(Stats::Phase::Stat);
+                source.LoadStatuses(dir, directories.data(), directories.size(), directory_statuses.data());
+            }
+            for (size_t i = 0; i < directories.size(); i++) {
+                if (!m_one_file_system || OnSameFileSystem(directory_statuses[i])) {
+                    subdirectories.push_back(JoinPath(dir, directories[i]->name));
+                }
+            }
+            filtered = FilterEntries(source, dir, m_where_flags, nullptr, filtered, &statuses);
+            LoadStatuses(source, dir, filtered, statuses);
+        }
+        visited = true;
+        visit(worker, dir, filtered, statuses, subdirectories);
+    }
+
+    bool OnSameFileSystem(const struct stat& status) const {
+        return !m_one_file_system || status.st_dev == m_root_device;
+    }
+
+    /* m_mutexを持ち、辿っている途中のディレクトリが無いときに呼ぶ */
+    void WriteCheckpoint() {
+        try {
+            m_checkpoint(m_pending);
+        } catch (...) {
+            m_fatal_error = std::current_exception();
+        }
+        m_next_checkpoint = std::chrono::steady_clock::now() + m_checkpoint_interval;
+        m_ready.notify_all();
+    }
+
+    DisplayFlags m_display_flags;
+    DisplayFlags m_where_flags;
+    size_t m_threads;
+    bool m_one_file_system;
+    dev_t m_root_device;
+    std::string m_root;
+    std::mutex m_mutex;
+    std::condition_variable m_ready;
+    std::vector<std::string> m_pending;
+    size_t m_active;
+    std::exception_ptr m_fatal_error;
+    bool m_visit_unreadable = false;
+    Checkpoint m_checkpoint;
+    std::chrono::nanoseconds m_checkpoint_interval{0};
+    std::chrono::steady_clock::time_point m_next_checkpoint;
+};
+
+size_t CountDisplayWidth(std::string_view s) {
+    size_t len_src = s.length();
+    // ファイル名はNAME_MAX (255バイト) までなので、普通はスタックのバッファで足りる
+    wchar_t stack_buf[256];
+    std::unique_ptr<wchar_t []> heap_buf;
+    wchar_t *buf = stack_buf;
+    if (len_src >= std::size(stack_buf)) {
+        heap_buf.reset(new wchar_t [len_src + 1]);
+        buf = heap_buf.get();
+    }
+    const char *src = s.data();
+    std::mbstate_t state{};
+    size_t len_dest = mbsnrtowcs(buf, &src, len_src, len_src, &state);
+    return wcswidth(buf, len_dest);
+}
+
+enum class Align {
+    Left,
+    Right,
+};
+
+std::string FitsStringToTargetWidth(std::string s, size_t target_width, Align aligned) {
+    size_t len = s.length();
+    size_t display_width = CountDisplayWidth(s);
+    if (target_width < display_width) {
+        return "";
+    }
+    size_t padding = target_width - display_width;
+    size_t pos = 0;
+    if (aligned == Align::Right) {
+        pos = padding;
+    }
+    std::string ret(s.length() + padding, ' ');
+    s.copy(&ret.data()[pos], ret.length());
+    return ret;
+}
+
+/* 10進数での桁数。log10(2)を1233/4096で近似し、10のべき乗との比較1回で補正する */
+size_t CountDigits(uint64_t value) {
+    static constexpr uint64_t kPowersOf10[] = {
+        1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL,
+        1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+        100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+        1000000000000000000ULL, 10000000000000000000ULL,
+    };
+    value |= 1; /* 0も1桁。最下位ビットを立てても桁数は変わらない */
+    size_t digits = (64 - __builtin_clzll(value)) * 1233 >> 12;
+    return digits + 1 - (value < kPowersOf10[digits]);
+}
+
+/* FormatSizeの出力に必要なバッファの大きさ */
+constexpr size_t kSizeBufferLen = 32;
+
+/* bytesをformatに従ってbufに書き、長さを返す。default_unitはformat.unitが0のときの単位。
+   GNU lsと同じく、単位で割った値は切り上げる */
+size_t FormatSize(uint64_t bytes, uint64_t default_unit, const SizeFormat& format, char *buf) {
+    char *p = buf;
+    if (format.human_readable) {
+        static const char kPrefixes[] = "KMGTPE";
+        uint64_t base = format.base;
+        if (bytes < base) {
+            return std::to_chars(buf, buf + kSizeBufferLen, bytes).ptr - buf;
+        }
+        size_t exponent = 0;
+        uint64_t scale = base;
+        while (bytes / scale >= base) {
+            scale *= base;
+            exponent++;
+        }
+        uint64_t quotient = bytes / scale;
+        uint64_t remainder = bytes % scale;
+        // 10未満なら小数点以下1桁、それ以上は整数に切り上げる
+        uint64_t tenths = quotient * 10 + (static_cast<unsigned __int128>(remainder) * 10 + scale - 1) / scale;
+        if (tenths < 100) {
+            *p++ = static_cast<char>('0' + tenths / 10);
+            *p++ = '.';
+            *p++ = static_cast<char>('0' + tenths % 10);
+        } else {
+            uint64_t whole = quotient + (remainder != 0);
+            if (whole == base) {
+                // 切り上げで次の接頭辞に繰り上がった
+                whole = 1;
+                exponent++;
+                p = std::to_chars(p, buf + kSizeBufferLen, whole).ptr;
+                *p++ = '.';
+                *p++ = '0';
+            } else {
+                p = std::to_chars(p, buf + kSizeBufferLen, whole).ptr;
+            }
+        }
+        *p++ = base == 1000 && exponent == 0 ? 'k' : kPrefixes[exponent];
+        return p - buf;
+    }
+    uint64_t unit = format.unit != 0 ? format.unit : default_unit;
+    uint64_t value = bytes / unit + (bytes % unit != 0);
+    p = std::to_chars(p, buf + kSizeBufferLen, value).ptr;
+    std::memcpy(p, format.suffix.data(), format.suffix.size());
+    return p - buf + format.suffix.size();
+}
+
+/* FormatSizeで書いたときの長さ。単位付きで表さない場合は書かずに桁数から求める */
+size_t SizeLength(uint64_t bytes, uint64_t default_unit, const SizeFormat& format) {
+    if (format.human_readable) {
+        char buf[kSizeBufferLen];
+        return FormatSize(bytes, default_unit, format, buf);
+    }
+    uint64_t unit = format.unit != 0 ? format.unit : default_unit;
+    return CountDigits(bytes / unit + (bytes % unit != 0)) + format.suffix.size();
+}
+
+/* statのst_blocksは512バイト単位。GNU lsに合わせて既定では1024バイト単位で表す */
+constexpr uint64_t kStatBlockSize = 512;
+constexpr uint64_t kDefaultBlockUnit = 1024;
+
+size_t FormatBlocks(uint64_t blocks, const SizeFormat& format, char *buf) {
+    return FormatSize(blocks * kStatBlockSize, kDefaultBlockUnit, format, buf);
+}
+
+size_t BlocksLength(uint64_t blocks, const SizeFormat& format) {
+    return SizeLength(blocks * kStatBlockSize, kDefaultBlockUnit, format);
+}
+
+/* "--block-size" の引数を解釈する。"K"、"1M"、"KB" (1000単位)、"KiB"、"human-readable"、"si"を受け付ける */
+SizeFormat ParseBlockSize(const std::string& spec) {
+    SizeFormat format;
+    if (spec == "human-readable" || spec == "si") {
+        format.human_readable = true;
+        format.base = spec == "si" ? 1000 : 1024;
+        return format;
+    }
+    auto invalid = [&] {
+        return cxxopts::OptionParseException("Invalid argument '" + spec + "' for --block-size");
+    };
+    const char *p = spec.data();
+    const char *end = spec.data() + spec.size();
+    uint64_t count = 1;
+    if (p == end) {
+        throw invalid();
+    }
+    bool has_count = std::isdigit(static_cast<unsigned char>(*p));
+    if (has_count) {
+        auto [ptr, ec] = std::from_chars(p, end, count);
+        if (ec != std::errc() || count == 0) {
+            throw invalid();
+        }
+        p = ptr;
+    }
+    uint64_t multiplier = 1;
+    if (p != end) {
+        static const char kPrefixes[] = "KMGTPE";
+        const char *prefix = std::strchr(kPrefixes, std::toupper(static_cast<unsigned char>(*p)));
+        if (prefix == nullptr || *prefix == '\0') {
+            throw invalid();
+        }
+        std::string_view rest(p + 1, end - p - 1);
+        uint64_t base = 1024;
+        if (rest == "B") {
+            base = 1000;
+        } else if (!rest.empty() && rest != "iB") {
+            throw invalid();
+        }
+        for (const char *q = kPrefixes; q <= prefix; q++) {
+            multiplier *= base;
+        }
+        if (!has_count) {
+            // SIの "kB" はGNU lsと同じく小文字で表す
+            format.suffix = std::string(p, end);
+            format.suffix[0] = base == 1000 && *prefix == 'K' ? 'k' : *prefix;
+        }
+    }
+    if (count > UINT64_MAX / multiplier) {
+        throw invalid();
+    }
+    format.unit = count * multiplier;
+    return format;
+}
+
+/* "--timeout" の引数を解釈する。"500ms"、"2s"、"1.5m"、"1h"を受け付け、単位が無ければ秒とみなす */
+std::chrono::nanoseconds ParseDuration(const std::string& spec) {
+    static const std::pair<const char *, double> kUnits[] = {
+        {"ms", 1e-3}, {"s", 1}, {"m", 60}, {"h", 3600}, {"", 1},
+    };
+    size_t pos = 0;
+    double value = -1;
+    try {
+        value = std::stod(spec, &pos);
+    } catch (const std::logic_error&) {
+    }
+    for (const auto& [unit, scale] : kUnits) {
+        if (value >= 0 && std::isfinite(value) && spec.compare(pos, std::string::npos, unit) == 0) {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double>(value * scale));
+        }
+    }
+    throw cxxopts::OptionParseException("Invalid argument '" + spec + "' for --timeout");
+}
+
+/* 各列の幅 (表示幅の最大値+2) と行数 */
+struct ColumnLayout {
+    size_t display_len;
+    size_t number_of_rows;
+};
+
+ColumnLayout ComputeColumnLayout(const std::vector<size_t>& widths, size_t terminal_width) {
+    if (widths.empty()) {
+        return ColumnLayout{0, 0};
+    }
+    size_t display_len = 0;
+    for (size_t width : widths) {
+        display_len = std::max(display_len, width + 2);
+    }
+    size_t number_per_onerow = std::max<size_t>(terminal_width / display_len, 1);
+    return ColumnLayout{display_len, (widths.size() + number_per_onerow-1) / number_per_onerow};
+}
+
+std::vector<std::string>
+LayoutInColumns(const std::vector<std::string>& files, size_t terminal_width) {
+    std::vector<std::string> rows;
+    std::vector<size_t> widths;
+    widths.reserve(files.size());
+    for (const auto& file : files) {
+        widths.push_back(CountDisplayWidth(file));
+    }
+    auto [display_len, number_of_rows] = ComputeColumnLayout(widths, terminal_width);
+    rows.reserve(number_of_rows);
+    for (size_t row = 0; row < number_of_rows; row++) {
+        std::string line;
+        for (size_t col = row; col < files.size(); col += number_of_rows) {
+            line += FitsStringToTargetWidth(files[col], display_len, Align::Left);
+        }
+        rows.push_back(std::move(line));
+    }
+    return rows;
+}
+
+/* LayoutInColumnsと同じ並びを、行の文字列を作らずにoutへ直接書く。
+   widthsは呼び出しをまたいで使い回す作業領域。
+   statusesを渡すと (-s)、合計の行と、各名前の前に右寄せしたブロック数を書く */
+void WriteColumns(OutputBuffer& out, const std::vector<DirectoryEntry>& entries,
+                  std::vector<size_t>& widths, size_t terminal_width,
+                  const std::vector<struct stat> *statuses = nullptr,
+                  const SizeFormat& size_format = SizeFormat()) {
+    size_t blocks_len = 0;
+    if (statuses != nullptr) {
+        uint64_t total_blocks = 0;
+        for (const auto& status : *statuses) {
+            blocks_len = std::max(blocks_len, BlocksLength(status.st_blocks, size_format));
+            total_blocks += status.st_blocks;
+        }
+        char buf[kSizeBufferLen];
+        out.Append("total ", 6);
+        out.Append(buf, FormatBlocks(total_blocks, size_format, buf));
+        out.Append('\n');
+    }
+    size_t prefix_len = statuses != nullptr ? blocks_len + 1 : 0;
+    widths.clear();
+    for (const auto& entry : entries) {
+        widths.push_back(prefix_len + CountDisplayWidth(entry.name));
+    }
+    auto [display_len, number_of_rows] = ComputeColumnLayout(widths, terminal_width);
+    for (size_t row = 0; row < number_of_rows; row++) {
+        for (size_t col = row; col < entries.size(); col += number_of_rows) {
+            // 幅に収まらない名前はFitsStringToTargetWidthと同じく出力しない
+            if (widths[col] > display_len) {
+                continue;
+            }
+            if (statuses != nullptr) {
+                char buf[kSizeBufferLen];
+                size_t len = FormatBlocks((*statuses)[col].st_blocks, size_format, buf);
+                char *p = out.Reserve(prefix_len);
+                std::memset(p, ' ', blocks_len - len);
+                std::memcpy(p + blocks_len - len, buf, len);
+                p[blocks_len] = ' ';
+                out.Commit(prefix_len);
+            }
+            const std::string& filename = entries[col].name;
+            out.Append(filename.data(), filename.size());
+            for (size_t padding = display_len - widths[col]; padding > 0; padding--) {
+                out.Append(' ');
+            }
+        }
+        out.Append('\n');
+    }
+}
+
+/* --timeoutで一覧が期限に間に合わなかったときの終了ステータス。GNU lsの1 (軽微)、2 (深刻) と区別する */
+constexpr int kExitTimedOut = 3;
+
+/* 期限までに取得できた分の一覧。entriesは並べ終えた順で、先頭からloaded件だけstatusesがある */
+struct PartialListing {
+    bool enumerated = false;
+    /* falseなら並べ替えや--whereの絞り込みに要るstatが期限に間に合わず、entriesは名前順のまま */
+    bool sorted = false;
+    std::vector<DirectoryEntry> entries;
+    std::vector<struct stat> statuses;
+    size_t loaded = 0;
+};
+
+/* 先頭のloaded件 (statusesがある分) のうちwhereに合わないものを、順序を保ったままentriesとstatusesから除く。
+   loaded件より後ろは判定できないので残す。残ったstat済みの件数を返す */
+size_t RemoveUnmatched(const Predicate& where, std::vector<DirectoryEntry>& entries,
+                       std::vector<struct stat>& statuses, size_t loaded) {
+    std::vector<std::string_view> filenames;
+    filenames.reserve(loaded);
+    for (size_t i = 0; i < loaded; i++) {
+        filenames.push_back(entries[i].name);
+    }
+    std::vector<uint8_t> matched(loaded, 1);
+    where.MatchesBatch(filenames.data(), statuses.data(), loaded, matched.data());
+    size_t kept = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (i < loaded && !matched[i]) {
+            continue;
+        }
+        if (kept != i) {
+            entries[kept] = std::move(entries[i]);
+            if (i < statuses.size()) {
+                statuses[kept] = statuses[i];
+            }
+        }
+        kept++;
+    }
+    size_t removed = entries.size() - kept;
+    entries.resize(kept);
+    statuses.resize(statuses.size() - removed);
+    return loaded - removed;
+}
+
+/* ListSortedFilesとLoadStatusesを切り離したスレッドで行い、display_flags.deadlineまでに終わった分を返す。
+   ハングしたNFSのシステムコールで止まったスレッドは待たずに置いていくので、呼び出し側は止まらない。
+   -t、-S、statの要る--whereでは全件のstatが揃うまで並べられないので、名前順の列挙を先に見せ、
+   statを少しずつ取ってから並べ替える。期限に間に合わなければ名前順のまま返す */
+PartialListing ListWithDeadline(const DisplayFlags& display_flags, const fs::path& target_path, bool need_statuses) {
+    struct Shared {
+        std::mutex mutex;
+        std::condition_variable changed;
+        bool enumerated = false;
+        bool sorted = false;
+        bool finished = false;
+        std::exception_ptr error;
+        std::vector<DirectoryEntry> entries;
+        std::vector<struct stat> statuses;
+        /* 取得済みのstatusesの件数。スレッドはこれより後ろだけに書く */
+        std::atomic<size_t> loaded{0};
+    };
+    const Predicate *where = display_flags.where.get();
+    bool where_needs_status = where != nullptr && where->NeedsStatus();
+    bool stat_first = SortNeedsStatus(display_flags.sort_key) || where_needs_status;
+    bool load_statuses = need_statuses || stat_first;
+    auto shared = std::make_shared<Shared>();
+    std::thread([shared, display_flags, target_path, where_needs_status, stat_first, load_statuses] {
+        try {
+            DisplayFlags list_flags = display_flags;
+            if (stat_first) {
+                list_flags.sort_key = SortKey::Name;
+                list_flags.limit = SIZE_MAX;
+                if (where_needs_status) {
+                    list_flags.where = nullptr;
+                }
+            }
+            std::vector<struct stat> statuses;
+            auto entries = ListSortedFiles(target_path, list_flags, &statuses);
+            size_t n = entries.size();
+            {
+                std::lock_guard<std::mutex> lock(shared->mutex);
+                // --whereで取った分があればそのまま使う
+                shared->loaded = statuses.size() == n ? n : 0;
+                statuses.resize(n);
+                shared->entries = std::move(entries);
+                shared->statuses = std::move(statuses);
+                shared->enumerated = true;
+                shared->sorted = !stat_first;
+            }
+            shared->changed.notify_all();
+            if (load_statuses && shared->loaded < n) {
+                // 途中で止まっても、それまでの分は見せられるように少しずつ取る
+                constexpr size_t kChunk = 32;
+                const DirectorySource& source = SourceOf(display_flags);
+                std::vector<const DirectoryEntry*> chunk;
+                for (size_t i = 0; i < n; i += kChunk) {
+                    chunk.clear();
+                    for (size_t j = i; j < std::min(n, i + kChunk); j++) {
+                        chunk.push_back(&shared->entries[j]);
+                    }
+                    PhaseTimer timer(Stats::Phase::Stat);
+                    source.LoadStatuses(target_path, chunk.data(), chunk.size(), &shared->statuses[i]);
+                    shared->loaded.store(i + chunk.size(), std::memory_order_release);
+                }
+            }
+            if (stat_first) {
+                // entriesとstatusesに書くのはこのスレッドだけなので、ロックせずに写して並べ替え、最後に差し替える
+                auto sorted_entries = shared->entries;
+                auto sorted_statuses = shared->statuses;
+                if (where_needs_status) {
+                    RemoveUnmatched(*display_flags.where, sorted_entries, sorted_statuses, n);
+                }
+                {
+                    PhaseTimer timer(Stats::Phase::Sort);
+                    SortEntries(sorted_entries, sorted_statuses, display_flags.sort_key, display_flags.reverse,
+                                display_flags.limit, display_flags.limit_from_end);
+                }
+                std::lock_guard<std::mutex> lock(shared->mutex);
+                shared->loaded = sorted_entries.size();
+                shared->entries = std::move(sorted_entries);
+                shared->statuses = std::move(sorted_statuses);
+                shared->sorted = true;
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(shared->mutex);
+            shared->error = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> lock(shared->mutex);
+            shared->finished = true;
+        }
+        shared->changed.notify_all();
+    }).detach();
+
+    PartialListing ret;
+    std::unique_lock<std::mutex> lock(shared->mutex);
+    shared->changed.wait_until(lock, display_flags.deadline, [&] {
+        return shared->finished || (shared->enumerated && !load_statuses);
+    });
+    if (shared->error != nullptr) {
+        std::rethrow_exception(shared->error);
+    }
+    if (!shared->enumerated) {
+        return ret;
+    }
+    // 列挙後のentriesはスレッドからは読むだけなので写せる。statusesは取得済みの分だけ写す
+    ret.enumerated = true;
+    ret.sorted = shared->sorted;
+    ret.entries = shared->entries;
+    ret.loaded = load_statuses ? shared->loaded.load(std::memory_order_acquire) : 0;
+    ret.statuses.assign(shared->statuses.begin(), shared->statuses.begin() + ret.loaded);
+    lock.unlock();
+    if (!ret.sorted) {
+        // 名前順のまま、stat済みの分だけは--whereで絞り、--head、--tailの件数に揃える
+        if (where_needs_status) {
+            ret.loaded = RemoveUnmatched(*where, ret.entries, ret.statuses, ret.loaded);
+        }
+        size_t limit = display_flags.limit;
+        if (ret.entries.size() > limit) {
+            size_t excess = ret.entries.size() - limit;
+            if (display_flags.limit_from_end) {
+                size_t dropped = std::min(excess, ret.loaded);
+                ret.entries.erase(ret.entries.begin(), ret.entries.begin() + excess);
+                ret.statuses.erase(ret.statuses.begin(), ret.statuses.begin() + dropped);
+                ret.loaded -= dropped;
+            } else {
+                ret.entries.resize(limit);
+                ret.loaded = std::min(ret.loaded, limit);
+                ret.statuses.resize(ret.loaded);
+            }
+        }
+    }
+    if (!need_statuses) {
+        ret.statuses.clear();
+        ret.loaded = 0;
+    }
+    return ret;
+}
+
+class FilesListerInColumns : public FilesLister {
+public:
+    FilesListerInColumns(DisplayFlags display_flags)
+        : FilesListerInColumns(display_flags, LoadTerminalSize()) {}
+    FilesListerInColumns(DisplayFlags display_flags, TerminalSize terminal_size)
+        : m_terminal_size(terminal_size),
+          m_display_flags(display_flags) {}
+    ~FilesListerInColumns() = default;
+
+    void ListFiles(const fs::path& target_path) {
+        if (m_display_flags.deadline != std::chrono::steady_clock::time_point::max()) {
+            auto listing = ListWithDeadline(m_display_flags, target_path, false);
+            if (!listing.enumerated) {
+                std::cerr << "ls: " << target_path.native() << ": timed out reading the directory" << std::endl;
+                m_timed_out = true;
+                return;
+            }
+            if (!listing.sorted) {
+                std::cerr << "ls: " << target_path.native() << ": timed out sorting, listed in name order" << std::endl;
+                m_timed_out = true;
+            }
+            PhaseTimer timer(Stats::Phase::Layout);
+            WriteColumns(m_out, listing.entries, m_widths, m_terminal_size.col);
+            m_out.Flush();
+            return;
+        }
+        if (!m_display_flags.show_blocks) {
+            auto filepaths = ListSortedFiles(target_path, m_display_flags);
+            PhaseTimer timer(Stats::Phase::Layout);
+            WriteColumns(m_out, filepaths, m_widths, m_terminal_size.col);
+        } else {
+            std::vector<struct stat> statuses;
+            auto filepaths = ListSortedFiles(target_path, m_display_flags, &statuses);
+            LoadStatuses(SourceOf(m_display_flags), target_path, filepaths, statuses);
+            PhaseTimer timer(Stats::Phase::Layout);
+            WriteColumns(m_out, filepaths, m_widths, m_terminal_size.col, &statuses, m_display_flags.size_format);
+        }
+        m_out.Flush();
+    }
+
+    int ExitStatus() const {
+        return m_timed_out ? kExitTimedOut : EXIT_SUCCESS;
+    }
+private:
+    TerminalSize m_terminal_size;
+    DisplayFlags m_display_flags;
+    OutputBuffer m_out;
+    std::vector<size_t> m_widths;
+    bool m_timed_out = false;
+};
+
+struct FileInfo {
+    std::string filetype_permisson;
+    std::size_t hard_link_count;
+    std::string ownername;
+    std::string groupname;
+    std::size_t bytes;
+    std::string access_time;
+    std::string filename;
+    std::size_t blocks;
+};
+
+/* "drwxr-xr-x" の10文字をbufに書き、NUL終端する */
+void FormatFiletypeAndPermission(mode_t mode, char (&buf)[11]) {
+    char *p = buf;
+    if (S_ISDIR(mode)) {
+        *p++ = 'd';
+    } else if (S_ISLNK(mode)) {
+        *p++ = 'l';
+    } else {
+        *p++ = '-';
+    }
+    for (int i = 2; i >= 0; --i) {
+        *p++ = (mode >> (3*i+2)) & 1 ? 'r' : '-';
+        *p++ = (mode >> (3*i+1)) & 1 ? 'w' : '-';
+        *p++ = (mode >> (3*i))   & 1 ? 'x' : '-';
+    }
+    *p = '\0';
+}
+
+std::string FormatFiletypeAndPermission(mode_t mode) {
+    char buf[11];
+    FormatFiletypeAndPermission(mode, buf);
+    return std::string(buf);
+}
+
+/* NSSの問い合わせ結果をIDごとに覚えておく。名前が引けないIDはGNU lsと同じく数字で表す */
+template <class Entry, int (*Lookup)(unsigned int, Entry*, char*, size_t, Entry**), char *Entry::*Name>
+const std::string& LookupName(unsigned int id) {
+    thread_local std::unordered_map<unsigned int, std::string> cache;
+    auto it = cache.find(id);
+    if (it != cache.end()) {
+        return it->second;
+    }
+    PhaseTimer timer(Stats::Phase::Nss);
+    CountSyscall(Stats::Syscall::NssLookup);
+    Entry entry;
+    Entry *result = nullptr;
+    std::vector<char> buf(1024);
+    int error;
+    while ((error = Lookup(id, &entry, buf.data(), buf.size(), &result)) == ERANGE) {
+        buf.resize(buf.size() * 2);
+    }
+    std::string name = result != nullptr ? std::string(result->*Name) : std::to_string(id);
+    return cache.emplace(id, std::move(name)).first->second;
+}
+
+const std::string& UserName(uid_t uid) {
+    return LookupName<struct passwd, getpwuid_r, &passwd::pw_name>(uid);
+}
+
+const std::string& GroupName(gid_t gid) {
+    return LookupName<struct group, getgrgid_r, &group::gr_name>(gid);
+}
+
+FileInfo LoadFileInfo(const fs::path& target, const struct stat& status) {
+    FileInfo file_info;
+    file_info.filetype_permisson = FormatFiletypeAndPermission(status.st_mode);
+    file_info.hard_link_count = status.st_nlink;
+    file_info.ownername = UserName(status.st_uid);
+    file_info.groupname = GroupName(status.st_gid);
+    file_info.bytes = status.st_size;
+    file_info.access_time = std::ctime(&status.st_atim.tv_sec);
+    file_info.access_time.pop_back(); /* 改行を除く */
+    file_info.filename = target.filename().u8string();
+    file_info.blocks = status.st_blocks;
+    return std::move(file_info);
+}
+
+FileInfo LoadFileInfo(const fs::path& target) {
+    return LoadFileInfo(target, LoadStatus(target));
+}
+
+const char kLongListFormat[] = "%*s %*zu %*s %*s %*s %*s %*s";
+
+std::vector<std::string> FormatLongList(const std::vector<FileInfo>& file_infos,
+                                        const SizeFormat& size_format = SizeFormat()) {
+    size_t total_block = 0;
+    struct DisplayLen {
+        size_t hard_link_count;
+        size_t filetype_permisson;
+        size_t ownername;
+        size_t groupname;
+        size_t bytes;
+        size_t access_time;
+        size_t filename;
+    } display_len{};
+    display_len.filetype_permisson = 10;
+    display_len.access_time = 24;
+    for (const auto& file_info : file_infos) {
+        display_len.hard_link_count = std::max(
+            display_len.hard_link_count, CountDigits(file_info.hard_link_count)
+        );
+        display_len.ownername = std::max(display_len.ownername, file_info.ownername.length());
+        display_len.groupname = std::max(display_len.groupname, file_info.groupname.length());
+        display_len.bytes = std::max(display_len.bytes, SizeLength(file_info.bytes, 1, size_format));
+        display_len.filename = std::max(display_len.filename, file_info.filename.length());
+        total_block += file_info.blocks;
+    }
+
+    const char *fmt = kLongListFormat;
+
+    std::vector<std::string> rows;
+    rows.reserve(file_infos.size() + 1);
+    char total[kSizeBufferLen];
+    rows.push_back("total " + std::string(total, FormatBlocks(total_block, size_format, total)));
+    for (const auto& file_info : file_infos) {
+        char bytes[kSizeBufferLen];
+        bytes[FormatSize(file_info.bytes, 1, size_format, bytes)] = '\0';
+        auto format = [&](char *buf, size_t size) {
+            return std::snprintf(buf, size, fmt,
+                static_cast<int>(display_len.filetype_permisson),
+                file_info.filetype_permisson.c_str(),
+                static_cast<int>(display_len.hard_link_count),
+                file_info.hard_link_count,
+                static_cast<int>(display_len.ownername),
+                file_info.ownername.c_str(),
+                static_cast<int>(display_len.groupname),
+                file_info.groupname.c_str(),
+                static_cast<int>(display_len.bytes),
+                bytes,
+                static_cast<int>(display_len.access_time),
+                file_info.access_time.c_str(),
+                -static_cast<int>(display_len.filename),
+                file_info.filename.c_str()
+            );
+        };
+        std::string row(format(nullptr, 0), '\0');
+        format(row.data(), row.size() + 1);
+        rows.push_back(std::move(row));
+    }
+    return rows;
+}
+
+/* textをwidth桁の右寄せでpに書き、続きの位置を返す */
+char *WriteRightAligned(char *p, const char *text, size_t len, size_t width) {
+    std::memset(p, ' ', width - len);
+    std::memcpy(p + width - len, text, len);
+    return p + width;
+}
+
+char *WriteRightAligned(char *p, const std::string& text, size_t width) {
+    return WriteRightAligned(p, text.data(), text.size(), width);
+}
+
+/* statの結果が無いエントリの行。種類はd_typeから分かる分だけ書き、他の欄は?にする。
+   blocks_lenが0なら-sの欄を書かない */
+void WriteUnknownLongListRow(char *p, const DirectoryEntry& entry, size_t blocks_len, size_t hard_link_count_len,
+                             size_t ownername_len, size_t groupname_len, size_t bytes_len, size_t access_time_len,
+                             size_t filename_len) {
+    if (blocks_len != 0) {
+        p = WriteRightAligned(p, "?", 1, blocks_len);
+        *p++ = ' ';
+    }
+    *p++ = entry.type == fs::file_type::directory ? 'd' : entry.type == fs::file_type::symlink ? 'l' : '-';
+    std::memset(p, '?', 9);
+    p += 9;
+    for (size_t width : {hard_link_count_len, ownername_len, groupname_len, bytes_len, access_time_len}) {
+        *p++ = ' ';
+        p = WriteRightAligned(p, "?", 1, width);
+    }
+    *p++ = ' ';
+    std::memcpy(p, entry.name.data(), entry.name.size());
+    std::memset(p + entry.name.size(), ' ', filename_len - entry.name.size());
+    p[filename_len] = '\n';
+}
+
+/* FormatLongListと同じ出力を、FileInfoや行の文字列を作らずにoutへ直接書く。
+   数値はto_charsで行のバッファに直接書き、列の幅は桁数から求める */
+/* loaded件目以降はstatが間に合わなかったエントリとして、GNU lsと同じく名前以外を?で書く */
+void WriteLongList(OutputBuffer& out, const std::vector<DirectoryEntry>& entries,
+                   const std::vector<struct stat>& statuses, const SizeFormat& size_format = SizeFormat(),
+                   bool show_blocks = false, size_t loaded = SIZE_MAX) {
+    loaded = std::min(loaded, entries.size());
+    // ?だけの行があれば、どの列も少なくとも1文字の幅が要る
+    size_t unknown_len = loaded < entries.size() ? 1 : 0;
+    uint64_t total_block = 0;
+    size_t blocks_len = unknown_len;
+    size_t hard_link_count_len = unknown_len;
+    size_t ownername_len = unknown_len;
+    size_t groupname_len = unknown_len;
+    size_t bytes_len = unknown_len;
+    size_t filename_len = 0;
+    for (size_t i = loaded; i < entries.size(); i++) {
+        filename_len = std::max(filename_len, entries[i].name.length());
+    }
+    for (size_t i = 0; i < loaded; i++) {
+        const struct stat& status = statuses[i];
+        if (show_blocks) {
+            blocks_len = std::max(blocks_len, BlocksLength(status.st_blocks, size_format));
+        }
+        hard_link_count_len = std::max(hard_link_count_len, CountDigits(status.st_nlink));
+        ownername_len = std::max(ownername_len, UserName(status.st_uid).length());
+        groupname_len = std::max(groupname_len, GroupName(status.st_gid).length());
+        bytes_len = std::max(bytes_len, SizeLength(status.st_size, 1, size_format));
+        filename_len = std::max(filename_len, entries[i].name.length());
+        total_block += status.st_blocks;
+    }
+    char buf[kSizeBufferLen];
+    out.Append("total ", 6);
+    out.Append(buf, FormatBlocks(total_block, size_format, buf));
+    out.Append('\n');
+    constexpr size_t kAccessTimeLen = 24;
+    size_t row_len = (show_blocks ? blocks_len + 1 : 0) + 10 + hard_link_count_len + ownername_len
+                     + groupname_len + bytes_len + kAccessTimeLen + filename_len + 7;
+    // アーカイブのメンバー名はNAME_MAXより長くなりうる。outに収まらない行は別に組み立ててからAppendする
+    std::string long_row;
+    auto reserve_row = [&] {
+        if (row_len <= OutputBuffer::kCapacity) {
+            return out.Reserve(row_len);
+        }
+        long_row.resize(row_len);
+        return long_row.data();
+    };
+    auto commit_row = [&] {
+        if (row_len <= OutputBuffer::kCapacity) {
+            out.Commit(row_len);
+        } else {
+            out.Append(long_row.data(), row_len);
+        }
+    };
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (i >= loaded) {
+            WriteUnknownLongListRow(reserve_row(), entries[i], show_blocks ? blocks_len : 0, hard_link_count_len,
+                                    ownername_len, groupname_len, bytes_len, kAccessTimeLen, filename_len);
+            commit_row();
+            continue;
+        }
+        const struct stat& status = statuses[i];
+        char *p = reserve_row();
+        if (show_blocks) {
+            p = WriteRightAligned(p, buf, FormatBlocks(status.st_blocks, size_format, buf), blocks_len);
+            *p++ = ' ';
+        }
+        char permission[11];
+        FormatFiletypeAndPermission(status.st_mode, permission);
+        std::memcpy(p, permission, 10);
+        p += 10;
+        *p++ = ' ';
+        p = WriteRightAligned(p, buf, std::to_chars(buf, buf + sizeof(buf), status.st_nlink).ptr - buf,
+                              hard_link_count_len);
+        *p++ = ' ';
+        p = WriteRightAligned(p, UserName(status.st_uid), ownername_len);
+        *p++ = ' ';
+        p = WriteRightAligned(p, GroupName(status.st_gid), groupname_len);
+        *p++ = ' ';
+        p = WriteRightAligned(p, buf, FormatSize(status.st_size, 1, size_format, buf), bytes_len);
+        *p++ = ' ';
+        char access_time[26];
+        ctime_r(&status.st_atim.tv_sec, access_time);
+        std::memcpy(p, access_time, kAccessTimeLen); /* 改行を除く */
+        p += kAccessTimeLen;
+        *p++ = ' ';
+        const std::string& filename = entries[i].name;
+        std::memcpy(p, filename.data(), filename.size());
+        std::memset(p + filename.size(), ' ', filename_len - filename.size());
+        p[filename_len] = '\n';
+        commit_row();
+    }
+}
+
+class FilesListerInLongList : public FilesLister {
+public:
+    FilesListerInLongList(DisplayFlags display_flags)
+        : FilesListerInLongList(display_flags, LoadTerminalSize()) {}
+    FilesListerInLongList(DisplayFlags display_flags, TerminalSize terminal_size)
+        : m_terminal_size(terminal_size),
+          m_display_flags(display_flags) {}
+    ~FilesListerInLongList() = default;
+    void ListFiles(const fs::path& target_path) {
+        if (m_display_flags.deadline != std::chrono::steady_clock::time_point::max()) {
+            ListFilesWithDeadline(target_path);
+            return;
+        }
+        std::vector<struct stat> statuses;
+        auto filepaths = ListSortedFiles(target_path, m_display_flags, &statuses);
+        LoadStatuses(SourceOf(m_display_flags), target_path, filepaths, statuses);
+        {
+            PhaseTimer timer(Stats::Phase::Layout);
+            WriteLongList(m_out, filepaths, statuses, m_display_flags.size_format, m_display_flags.show_blocks);
+        }
+        m_out.Flush();
+    }
+
+    int ExitStatus() const {
+        return m_timed_out ? kExitTimedOut : EXIT_SUCCESS;
+    }
+private:
+    /* 期限までにstatできなかったエントリは?で書く */
+    void ListFilesWithDeadline(const fs::path& target_path) {
+        auto listing = ListWithDeadline(m_display_flags, target_path, true);
+        if (!listing.enumerated) {
+            std::cerr << "ls: " << target_path.native() << ": timed out reading the directory" << std::endl;
+            m_timed_out = true;
+            return;
+        }
+        if (listing.loaded < listing.entries.size()) {
+            std::cerr << "ls: " << target_path.native() << ": timed out after " << listing.loaded << " of "
+                      << listing.entries.size() << " entries" << std::endl;
+            m_timed_out = true;
+        }
+        if (!listing.sorted) {
+            std::cerr << "ls: " << target_path.native() << ": timed out sorting, listed in name order" << std::endl;
+            m_timed_out = true;
+        }
+        {
+            PhaseTimer timer(Stats::Phase::Layout);
+            WriteLongList(m_out, listing.entries, listing.statuses, m_display_flags.size_format,
+                          m_display_flags.show_blocks, listing.loaded);
+        }
+        m_out.Flush();
+    }
+
+    TerminalSize m_terminal_size;
+    DisplayFlags m_display_flags;
+    OutputBuffer m_out;
+    bool m_timed_out = false;
+};
+
+/* --count: エントリの数だけを書く。並べ替え、stat、幅の計算をせず、名前も取り出さない。
+   with_pathなら複数の対象を区別できるよう、数の後ろにタブと対象のパスを書く */
+class FilesListerInCount : public FilesLister {
+public:
+    FilesListerInCount(DisplayFlags display_flags, bool with_path)
+        : m_display_flags(display_flags),
+          m_with_path(with_path) {}
+
+    void ListFiles(const fs::path& target_path) {
+        const DirectorySource& source = SourceOf(m_display_flags);
+        uint64_t count;
+        if (m_display_flags.ignore_patterns == nullptr && !m_display_flags.respect_gitignore
+            && m_display_flags.where == nullptr) {
+            PhaseTimer timer(Stats::Phase::Enumerate);
+            count = source.CountEntries(target_path, m_display_flags.ignore_hidden_file);
+        } else {
+            // 名前で絞り込むときは一覧と同じ経路で数える
+            count = ListSortedFiles(target_path, m_display_flags).size();
+        }
+        CountStats(Stats::Counter::EntriesListed, count);
+        m_out.AppendUnsigned(count);
+        if (m_with_path) {
+            m_out.Append('\t');
+            m_out.Append(target_path.c_str(), target_path.native().size());
+        }
+        m_out.Append('\n');
+    }
+
+    void Finish() {
+        m_out.Flush();
+    }
+private:
+    DisplayFlags m_display_flags;
+    bool m_with_path;
+    OutputBuffer m_out;
+};
+
+/* -R --top N: 木全体から、並び順で先頭のN件のファイルを選んで一覧する。
+   ワーカーごとにN件程度だけを持ち、全てのディレクトリを辿り終えたらまとめて選び直す */
+class FilesListerInTreeTop : public FilesLister {
+public:
+    FilesListerInTreeTop(DisplayFlags display_flags, bool long_format, size_t threads, bool one_file_system = false)
+        : m_display_flags(display_flags),
+          m_long_format(long_format),
+          m_walker(display_flags, threads, one_file_system),
+          m_kept(m_walker.Threads()) {}
+
+    void ListFiles(const fs::path& target_path) {
+        m_walker.Walk(target_path, [this](size_t worker, const std::string& dir, std::vector<DirectoryEntry>& entries,
+                                          std::vector<struct stat>& statuses) {
+            Keep(m_kept[worker], dir, entries, statuses);
+        });
+    }
+
+    void Finish() {
+        TopEntries merged;
+        for (auto& kept : m_kept) {
+            std::move(kept.entries.begin(), kept.entries.end(), std::back_inserter(merged.entries));
+            merged.statuses.insert(merged.statuses.end(), kept.statuses.begin(), kept.statuses.end());
+        }
+        {
+            PhaseTimer timer(Stats::Phase::Sort);
+            SortEntries(merged.entries, merged.statuses, m_display_flags.sort_key, m_display_flags.reverse,
+                        m_display_flags.limit);
+        }
+        CountStats(Stats::Counter::EntriesListed, merged.entries.size());
+        {
+            PhaseTimer timer(Stats::Phase::Layout);
+            if (m_long_format) {
+                WriteLongList(m_out, merged.entries, merged.statuses, m_display_flags.size_format,
+                              m_display_flags.show_blocks);
+            } else {
+                // 長いパスが並ぶので1行に1件ずつ書く
+                std::vector<size_t> widths;
+                WriteColumns(m_out, merged.entries, widths, 0,
+                             m_display_flags.show_blocks ? &merged.statuses : nullptr, m_display_flags.size_format);
+            }
+        }
+        m_out.Flush();
+    }
+private:
+    /* ワーカーごとの候補。隣のワーカーの候補と同じキャッシュラインに載らないようにする */
+    struct alignas(64) TopEntries {
+        std::vector<DirectoryEntry> entries;
+        std::vector<struct stat> statuses;
+        /* 候補がちょうどN件に絞られているとき、最後の候補の-S、-tのキー */
+        std::optional<uint64_t> boundary;
+    };
+
+    void Keep(TopEntries& top, const std::string& dir, const std::vector<DirectoryEntry>& entries,
+              const std::vector<struct stat>& statuses) {
+        SortKey sort_key = m_display_flags.sort_key;
+        size_t limit = m_display_flags.limit;
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (entries[i].type == fs::file_type::directory) {
+                continue;
+            }
+            // 残っている候補の最後より後ろに並ぶものは、パスを作らずに捨てる
+            if (top.boundary.has_value()) {
+                uint64_t key = StatusSortKey(statuses[i], sort_key);
+                if (m_display_flags.reverse ? key < *top.boundary : key > *top.boundary) {
+                    continue;
+                }
+            }
+            top.entries.push_back(DirectoryEntry{JoinPath(dir, entries[i].name), entries[i].type, entries[i].ino});
+            top.statuses.push_back(statuses[i]);
+        }
+        if (top.entries.size() > limit && top.entries.size() - limit >= std::max(limit, DirectorySource::kBatchSize)) {
+            PhaseTimer timer(Stats::Phase::Sort);
+            SortEntries(top.entries, top.statuses, sort_key, m_display_flags.reverse, limit);
+            if (SortNeedsStatus(sort_key) && !top.statuses.empty()) {
+                top.boundary = StatusSortKey(top.statuses.back(), sort_key);
+            }
+        }
+    }
+
+    DisplayFlags m_display_flags;
+    bool m_long_format;
+    ParallelWalker m_walker;
+    std::vector<TopEntries> m_kept;
+    OutputBuffer m_out;
+};
+
+/* 複数のスレッドから使う (st_dev, st_ino) の集合。ロックの競合を減らすため、ハッシュ値で分けた区画ごとにロックする */
+class ConcurrentInodeSet {
+public:
+    /* 初めて加えたときだけtrueを返す */
+    bool Insert(dev_t device, ino_t inode) {
+        Key key{device, inode};
+        size_t hash = KeyHash()(key);
+        Shard& shard = m_shards[hash % kShards];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.keys.insert(key).second;
+    }
+private:
+    static constexpr size_t kShards = 64;
+
+    struct Key {
+        dev_t device;
+        ino_t inode;
+        bool operator==(const Key& other) const { return device == other.device && inode == other.inode; }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            // 上位ビットを混ぜて区画の選択と表の中の位置を散らす
+            uint64_t hash = (static_cast<uint64_t>(key.device) * 0x9e3779b97f4a7c15ULL) ^ key.inode;
+            hash ^= hash >> 29;
+            hash *= 0xbf58476d1ce4e5b9ULL;
+            return hash ^ (hash >> 32);
+        }
+    };
+
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::unordered_set<Key, KeyHash> keys;
+    };
+
+    Shard m_shards[kShards];
+};
+
+/* --du: 木を並列に辿り、ディレクトリごとにその下の全てのst_blocksの合計を書く。
+   ハードリンクされたファイルは最初に見つけた1回だけ数え、-xなら他のファイルシステムには降りない */
+class FilesListerInDiskUsage : public FilesLister {
+public:
+    FilesListerInDiskUsage(DisplayFlags display_flags, size_t threads, bool one_file_system)
+        : m_display_flags(WithHiddenFiles(display_flags)),
+          m_one_file_system(one_file_system),
+          m_walker(m_display_flags, threads, one_file_system),
+          m_usages(m_walker.Threads()) {}
+
+    void ListFiles(const fs::path& target_path) {
+        const DirectorySource& source = SourceOf(m_display_flags);
+        struct stat root_status = source.LoadStatusOf(target_path);
+        if (!S_ISDIR(root_status.st_mode)) {
+            WriteUsage(root_status.st_blocks, target_path.native());
+            return;
+        }
+        m_root_device = root_status.st_dev;
+        for (auto& usage : m_usages) {
+            usage.directories.clear();
+        }
+        m_walker.Walk(target_path, [this](size_t worker, const std::string& dir, std::vector<DirectoryEntry>& entries,
+                                          std::vector<struct stat>& statuses) {
+            Sum(m_usages[worker], dir, entries, statuses);
+        });
+        WriteTotals(target_path.native(), root_status.st_blocks);
+    }
+
+    void Finish() {
+        m_out.Flush();
+    }
+private:
+    /* ディレクトリの中のディレクトリ以外の合計と、その中のサブディレクトリ自身のブロック数 */
+    struct DirectoryUsage {
+        std::string path;
+        uint64_t blocks;
+        std::vector<std::pair<std::string, uint64_t>> subdirectories;
+    };
+
+    /* ワーカーごとの集計。隣のワーカーの集計と同じキャッシュラインに載らないようにする */
+    struct alignas(64) WorkerUsage {
+        std::vector<DirectoryUsage> directories;
+    };
+
+    /* duと同じく、-aが無くても隠しファイルを数える */
+    static DisplayFlags WithHiddenFiles(DisplayFlags display_flags) {
+        display_flags.ignore_hidden_file = false;
+        return display_flags;
+    }
+
+    void Sum(WorkerUsage& usage, const std::string& dir, const std::vector<DirectoryEntry>& entries,
+             const std::vector<struct stat>& statuses) {
+        DirectoryUsage directory{dir, 0, {}};
+        for (size_t i = 0; i < entries.size(); i++) {
+            const struct stat& status = statuses[i];
+            if (entries[i].type == fs::file_type::directory) {
+                // 降りないマウントポイントは数えない
+                if (!m_one_file_system || status.st_dev == m_root_device) {
+                    directory.subdirectories.emplace_back(JoinPath(dir, entries[i].name), status.st_blocks);
+                }
+            } else if (status.st_nlink <= 1 || m_inodes.Insert(status.st_dev, status.st_ino)) {
+                directory.blocks += status.st_blocks;
+            }
+        }
+        usage.directories.push_back(std::move(directory));
+    }
+
+    /* 子を名前順に、親より先に書く (duと同じ後行順) */
+    void WriteTotals(const std::string& root, uint64_t root_blocks) {
+        struct Node {
+            uint64_t blocks = 0;
+            std::vector<std::string> children;
+        };
+        std::unordered_map<std::string, Node> nodes;
+        {
+            PhaseTimer timer(Stats::Phase::Sort);
+            nodes[root].blocks += root_blocks;
+            for (auto& usage : m_usages) {
+                for (auto& directory : usage.directories) {
+                    Node& node = nodes[directory.path];
+                    node.blocks += directory.blocks;
+                    for (auto& [path, blocks] : directory.subdirectories) {
+                        nodes[path].blocks += blocks;
+                        node.children.push_back(std::move(path));
+                    }
+                }
+                usage.directories.clear();
+            }
+        }
+        PhaseTimer timer(Stats::Phase::Layout);
+        // (ノード, 次に辿る子の位置) のスタックで後行順に辿り、子の合計を親に足す
+        std::vector<std::pair<const std::string*, size_t>> stack;
+        auto root_node = nodes.find(root);
+        std::sort(root_node->second.children.begin(), root_node->second.children.end());
+        stack.emplace_back(&root_node->first, 0);
+        while (!stack.empty()) {
+            auto& [path, next] = stack.back();
+            Node& node = nodes[*path];
+            if (next < node.children.size()) {
+                auto child = nodes.find(node.children[next++]);
+                std::sort(child->second.children.begin(), child->second.children.end());
+                stack.emplace_back(&child->first, 0);
+                continue;
+            }
+            WriteUsage(node.blocks, *path);
+            CountStats(Stats::Counter::EntriesListed, 1);
+            uint64_t blocks = node.blocks;
+            stack.pop_back();
+            if (!stack.empty()) {
+                nodes[*stack.back().first].blocks += blocks;
+            }
+        }
+    }
+
+    void WriteUsage(uint64_t blocks, const std::string& path) {
+        char buf[kSizeBufferLen];
+        m_out.Append(buf, FormatBlocks(blocks, m_display_flags.size_format, buf));
+        m_out.Append('\t');
+        m_out.Append(path.data(), path.size());
+        m_out.Append('\n');
+    }
+
+    DisplayFlags m_display_flags;
+    bool m_one_file_system;
+    dev_t m_root_device = 0;
+    ParallelWalker m_walker;
+    std::vector<WorkerUsage> m_usages;
+    ConcurrentInodeSet m_inodes;
+    OutputBuffer m_out;
+};
+
+/* --estimate: 根から子のディレクトリを無作為に1つずつ選んで葉まで降りる探索 (Knuthの推定法) を
+   時間の許す限り繰り返し、木全体のファイル数などを推定する。子をk個から一様に選ぶので、通った
+   ディレクトリの値にそこへ至る確率の逆数 (途中の子の数の積) を掛けて足すと、1回ごとに不偏な推定値になる。
+   読んだディレクトリは覚えておき、同じ道を通る探索では読み直さない */
+class TreeEstimator {
+public:
+    /* 推定値と、その95%信頼区間の半分の幅。探索が1回だけなら幅はNaN */
+    struct Estimate {
+        double mean;
+        double half_width;
+    };
+
+    struct Result {
+        uint64_t probes;
+        uint64_t directories_read;
+        Estimate files;
+        Estimate directories;
+        Estimate bytes;
+    };
+
+    TreeEstimator(const DisplayFlags& display_flags, bool one_file_system, uint64_t seed)
+        : m_display_flags(display_flags),
+          m_where(display_flags.where),
+          m_one_file_system(one_file_system),
+          m_random(seed) {
+        // ParallelWalkerと同じく、--whereは数えるファイルだけを決め、降りるディレクトリは絞らない
+        m_display_flags.where = nullptr;
+    }
+
+    /* budgetを使い切るかmax_probes回探索するまで繰り返す。探索は少なくとも1回行う */
+    Result Run(const fs::path& root, std::chrono::nanoseconds budget, uint64_t max_probes = UINT64_MAX) {
+        auto deadline = std::chrono::steady_clock::now() + budget;
+        m_directories.clear();
+        m_root_device = SourceOf(m_display_flags).LoadStatusOf(root).st_dev;
+        // 根を読めなければ、推定せずに例外を投げる
+        Read(root.native(), true);
+        Moments files;
+        Moments directories;
+        Moments bytes;
+        uint64_t probes = 0;
+        do {
+            double probe_files = 0;
+            double probe_directories = 0;
+            double probe_bytes = 0;
+            double weight = 1;
+            const Directory *directory = &Read(root.native(), true);
+            for (;;) {
+                probe_files += weight * directory->files;
+                probe_directories += weight;
+                probe_bytes += weight * directory->bytes;
+                const auto& subdirectories = directory->subdirectories;
+                if (subdirectories.empty()) {
+                    break;
+                }
+                weight *= subdirectories.size();
+                std::uniform_int_distribution<size_t> choose(0, subdirectories.size() - 1);
+                directory = &Read(subdirectories[choose(m_random)], false);
+            }
+            files.Add(probe_files);
+            directories.Add(probe_directories);
+            bytes.Add(probe_bytes);
+            probes++;
+        } while (probes < max_probes && std::chrono::steady_clock::now() < deadline);
+        return Result{probes, m_directories.size(), files.Get(), directories.Get(), bytes.Get()};
+    }
+private:
+    /* ディレクトリ自身を除いた直下のファイルとバイト数、降りる先のディレクトリ */
+    struct Directory {
+        uint64_t files = 0;
+        uint64_t bytes = 0;
+        std::vector<std::string> subdirectories;
+    };
+
+    /* 平均と分散をWelfordの方法で1回ずつ更新する */
+    class Moments {
+    public:
+        void Add(double value) {
+            m_count++;
+            double delta = value - m_mean;
+            m_mean += delta / m_count;
+            m_m2 += delta * (value - m_mean);
+        }
+
+        Estimate Get() const {
+            if (m_count < 2) {
+                return Estimate{m_mean, std::nan("")};
+            }
+            double standard_error = std::sqrt(m_m2 / (m_count - 1) / m_count);
+            return Estimate{m_mean, 1.96 * standard_error};
+        }
+    private:
+        uint64_t m_count = 0;
+        double m_mean = 0;
+        double m_m2 = 0;
+    };
+
+    /* 読めないディレクトリは、根でなければ空の葉として扱う */
+    const Directory& Read(const std::string& dir, bool is_root) {
+        auto found = m_directories.find(dir);
+        if (found != m_directories.end()) {
+            return found->second;
+        }
+        Directory directory;
+        try {
+            const DirectorySource& source = SourceOf(m_display_flags);
+            std::vector<DirectoryEntry> entries;
+            {
+                PhaseTimer timer(Stats::Phase::Enumerate);
+                source.Enumerate(dir, entries);
+                CountStats(Stats::Counter::EntriesRead, entries.size());
+            }
+            std::optional<GitignoreRules> gitignore;
+            if (m_display_flags.respect_gitignore) {
+                gitignore.emplace(dir);
+            }
+            std::vector<struct stat> statuses;
+            auto filtered = FilterEntries(source, dir, m_display_flags, gitignore.has_value() ? &*gitignore : nullptr,
+                                          entries, nullptr);
+            LoadStatuses(source, dir, filtered, statuses);
+            std::vector<uint8_t> matched(filtered.size(), 1);
+            if (m_where != nullptr) {
+                std::vector<std::string_view> filenames;
+                filenames.reserve(filtered.size());
+                for (const auto& entry : filtered) {
+                    filenames.push_back(entry.name);
+                }
+                m_where->MatchesBatch(filenames.data(), statuses.data(), filtered.size(), matched.data());
+            }
+            for (size_t i = 0; i < filtered.size(); i++) {
+                if (filtered[i].type != fs::file_type::directory) {
+                    if (!matched[i]) {
+                        continue;
+                    }
+                    directory.files++;
+                    directory.bytes += statuses[i].st_size;
+                } else if (!m_one_file_system || statuses[i].st_dev == m_root_device) {
+                    directory.subdirectories.push_back(JoinPath(dir, filtered[i].name));
+                }
+            }
+        } catch (const std::system_error& e) {
+            if (is_root) {
+                throw;
+            }
+            std::cerr << "ls: " << dir << ": " << e.what() << std::endl;
+        }
+        return m_directories.emplace(dir, std::move(directory)).first->second;
+    }
+
+    DisplayFlags m_display_flags;
+    std::shared_ptr<const Predicate> m_where;
+    bool m_one_file_system;
+    dev_t m_root_device = 0;
+    std::mt19937_64 m_random;
+    std::unordered_map<std::string, Directory> m_directories;
+};
+
+/* --estimate: TreeEstimatorの結果を、推定値と95%信頼区間の幅で書く */
+class FilesListerInEstimate : public FilesLister {
+public:
+    FilesListerInEstimate(DisplayFlags display_flags, std::chrono::nanoseconds budget, bool one_file_system,
+                          bool with_path)
+        : m_display_flags(display_flags),
+          m_budget(budget),
+          m_with_path(with_path),
+          m_estimator(display_flags, one_file_system, std::random_device()()) {}
+
+    void ListFiles(const fs::path& target_path) {
+        auto begin = std::chrono::steady_clock::now();
+        auto result = m_estimator.Run(target_path, m_budget);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+        if (m_with_path) {
+            m_out.Append(target_path.c_str(), target_path.native().size());
+            m_out.Append(":\n", 2);
+        }
+        WriteEstimate("files", result.files, nullptr);
+        WriteEstimate("directories", result.directories, nullptr);
+        WriteEstimate("bytes", result.bytes, &m_display_flags.size_format);
+        char line[128];
+        int len = std::snprintf(line, sizeof(line), "%" PRIu64 " probes, %" PRIu64 " directories read, %.2f s\n",
+                                result.probes, result.directories_read, elapsed.count());
+        m_out.Append(line, len);
+    }
+
+    void Finish() {
+        m_out.Flush();
+    }
+private:
+    /* "name  推定値 ± 幅" の1行。size_formatがあればバイト数として-hなどに従って書く */
+    void WriteEstimate(const char *name, const TreeEstimator::Estimate& estimate, const SizeFormat *size_format) {
+        char buf[kSizeBufferLen];
+        size_t name_len = std::strlen(name);
+        m_out.Append(name, name_len);
+        for (size_t i = name_len; i < 12; i++) {
+            m_out.Append(' ');
+        }
+        m_out.Append(buf, FormatEstimate(estimate.mean, size_format, buf));
+        m_out.Append(" \xc2\xb1 ", 4);
+        if (std::isnan(estimate.half_width)) {
+            m_out.Append('?');
+        } else {
+            m_out.Append(buf, FormatEstimate(estimate.half_width, size_format, buf));
+        }
+        m_out.Append('\n');
+    }
+
+    static size_t FormatEstimate(double value, const SizeFormat *size_format, char *buf) {
+        uint64_t rounded = static_cast<uint64_t>(std::llround(std::max(value, 0.0)));
+        if (size_format != nullptr) {
+            return FormatSize(rounded, 1, *size_format, buf);
+        }
+        return std::to_chars(buf, buf + kSizeBufferLen, rounded).ptr - buf;
+    }
+
+    DisplayFlags m_display_flags;
+    std::chrono::nanoseconds m_budget;
+    bool m_with_path;
+    TreeEstimator m_estimator;
+    OutputBuffer m_out;
+};
+
+/* JSONの文字列中でエスケープか検査が必要な最初のバイトの位置を返す。
+   非ASCIIのバイトもUTF-8として正しいかを確かめるためにここで止まる */
+size_t FindJsonEscape(const char *s, size_t len) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+        __m128i hit = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+            _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control)
+        );
+        // 最上位ビットが立ったバイトはそのままmovemaskに出る
+        int mask = _mm_movemask_epi8(hit) | _mm_movemask_epi8(chunk);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\' || c < 0x20 || c >= 0x80) {
+            return i;
+        }
+    }
+    return len;
+}
+
+/* sの先頭が正しいUTF-8の1文字ならそのバイト数を、そうでなければ0を返す。
+   冗長な符号化、サロゲート、U+10FFFFより大きい値は正しくないものとして扱う */
+size_t ValidUtf8Length(const char *s, size_t len) {
+    auto byte = [&](size_t i) { return static_cast<unsigned char>(s[i]); };
+    unsigned char c = byte(0);
+    size_t n;
+    unsigned char low = 0x80, high = 0xbf;
+    if (c >= 0xc2 && c <= 0xdf) {
+        n = 2;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        n = 3;
+        low = c == 0xe0 ? 0xa0 : 0x80;
+        high = c == 0xed ? 0x9f : 0xbf;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        n = 4;
+        low = c == 0xf0 ? 0x90 : 0x80;
+        high = c == 0xf4 ? 0x8f : 0xbf;
+    } else {
+        return 0;
+    }
+    if (len < n || byte(1) < low || byte(1) > high) {
+        return 0;
+    }
+    for (size_t i = 2; i < n; i++) {
+        if ((byte(i) & 0xc0) != 0x80) {
+            return 0;
+        }
+    }
+    return n;
+}
+
+/* JSONの文字列として書く。ファイル名はUTF-8とは限らないが、JSONはUTF-8でなければ読めないので、
+   正しくないバイトは1バイトずつU+FFFD (REPLACEMENT CHARACTER) に置き換える */
+void AppendJsonString(OutputBuffer& out, const char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    out.Append('"');
+    for (;;) {
+        size_t n = FindJsonEscape(s, len);
+        out.Append(s, n);
+        if (n == len) {
+            break;
+        }
+        unsigned char c = s[n];
+        if (c >= 0x80) {
+            size_t valid = ValidUtf8Length(s + n, len - n);
+            if (valid != 0) {
+                out.Append(s + n, valid);
+            } else {
+                out.Append("\xef\xbf\xbd", 3);
+                valid = 1;
+            }
+            s += n + valid;
+            len -= n + valid;
+            continue;
+        }
+        switch (c) {
+        case '"':  out.Append("\\\"", 2); break;
+        case '\\': out.Append("\\\\", 2); break;
+        case '\b': out.Append("\\b", 2); break;
+        case '\f': out.Append("\\f", 2); break;
+        case '\n': out.Append("\\n", 2); break;
+        case '\r': out.Append("\\r", 2); break;
+        case '\t': out.Append("\\t", 2); break;
+        default: {
+            const char escaped[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+            out.Append(escaped, sizeof(escaped));
+        }
+        }
+        s += n + 1;
+        len -= n + 1;
+    }
+    out.Append('"');
+}
+
+const char *FiletypeName(mode_t mode) {
+    switch (mode & S_IFMT) {
+    case S_IFREG:  return "file";
+    case S_IFDIR:  return "directory";
+    case S_IFLNK:  return "symlink";
+    case S_IFBLK:  return "block";
+    case S_IFCHR:  return "char";
+    case S_IFIFO:  return "fifo";
+    case S_IFSOCK: return "socket";
+    default:       return "unknown";
+    }
+}
+
+template <size_t N>
+void AppendJsonField(OutputBuffer& out, const char (&key)[N], uint64_t value) {
+    out.Append(key, N - 1);
+    out.AppendUnsigned(value);
+}
+
+/* 1970年より前の時刻は負になる */
+template <size_t N>
+void AppendJsonSignedField(OutputBuffer& out, const char (&key)[N], int64_t value) {
+    out.Append(key, N - 1);
+    out.AppendSigned(value);
+}
+
+/* 1エントリ分をNDJSONの1行としてstatの値から直接書き出す */
+void AppendJsonEntry(OutputBuffer& out, std::string_view filename, const struct stat& status) {
+    out.Append("{\"name\":", 8);
+    AppendJsonString(out, filename.data(), filename.size());
+    const char *type = FiletypeName(status.st_mode);
+    out.Append(",\"type\":\"", 9);
+    out.Append(type, std::strlen(type));
+    out.Append('"');
+    AppendJsonField(out, ",\"mode\":", status.st_mode & 07777);
+    AppendJsonField(out, ",\"nlink\":", status.st_nlink);
+    AppendJsonField(out, ",\"uid\":", status.st_uid);
+    AppendJsonField(out, ",\"gid\":", status.st_gid);
+    AppendJsonField(out, ",\"size\":", status.st_size);
+    AppendJsonField(out, ",\"blocks\":", status.st_blocks);
+    AppendJsonField(out, ",\"ino\":", status.st_ino);
+    AppendJsonSignedField(out, ",\"mtime\":", status.st_mtim.tv_sec);
+    AppendJsonField(out, ",\"mtime_nsec\":", status.st_mtim.tv_nsec);
+    out.Append("}\n", 2);
+}
+
+class FilesListerInJson : public FilesLister {
+public:
+    FilesListerInJson(DisplayFlags display_flags)
+        : m_display_flags(display_flags) {}
+    ~FilesListerInJson() = default;
+
+    void ListFiles(const fs::path& target_path) {
+        std::vector<struct stat> statuses;
+        auto filepaths = ListSortedFiles(target_path, m_display_flags, &statuses);
+        LoadStatuses(SourceOf(m_display_flags), target_path, filepaths, statuses);
+        {
+            PhaseTimer timer(Stats::Phase::Layout);
+            for (size_t i = 0; i < filepaths.size(); i++) {
+                AppendJsonEntry(m_out, filepaths[i].name, statuses[i]);
+            }
+        }
+        m_out.Flush();
+    }
+private:
+    DisplayFlags m_display_flags;
+    OutputBuffer m_out;
+};
+
+/* --summarize-by: 一覧 (-Rなら木全体) を所有者、グループ、拡張子、種類ごとに集計し、
+   件数、合計バイト数、最も大きいエントリを書く。エントリごとの出力はしない */
+class FilesListerInSummary : public FilesLister {
+public:
+    FilesListerInSummary(DisplayFlags display_flags, SummaryKey key, bool recursive, size_t threads,
+                         bool one_file_system = false)
+        : m_display_flags(display_flags),
+          m_key(key),
+          m_recursive(recursive),
+          m_walker(display_flags, threads, one_file_system),
+          m_groups(m_walker.Threads()) {}
+
+    void ListFiles(const fs::path& target_path) {
+        if (m_recursive) {
+            m_walker.Walk(target_path, [this](size_t worker, const std::string& dir,
+                                              std::vector<DirectoryEntry>& entries, std::vector<struct stat>& statuses) {
+                Add(m_groups[worker], dir, entries, statuses);
+            });
+            return;
+        }
+        // 並べ替えは要らないので、列挙して絞り込むだけにする
+        const DirectorySource& source = SourceOf(m_display_flags);
+        std::vector<DirectoryEntry> entries;
+        {
+            PhaseTimer timer(Stats::Phase::Enumerate);
+            source.Enumerate(target_path, entries);
+            CountStats(Stats::Counter::EntriesRead, entries.size());
+        }
+        std::optional<GitignoreRules> gitignore;
+        if (m_display_flags.respect_gitignore) {
+            gitignore.emplace(target_path);
+        }
+        std::vector<struct stat> statuses;
+        auto filtered = FilterEntries(source, target_path, m_display_flags,
+                                      gitignore.has_value() ? &*gitignore : nullptr, entries, &statuses);
+        LoadStatuses(source, target_path, filtered, statuses);
+        Add(m_groups[0], target_path.native(), filtered, statuses);
+    }
+
+    void Finish() {
+        std::vector<std::pair<std::string, Group>> rows = MergeGroups();
+        {
+            PhaseTimer timer(Stats::Phase::Sort);
+            // 合計の大きい順
+            std::sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) {
+                return a.second.bytes != b.second.bytes ? a.second.bytes > b.second.bytes : a.first < b.first;
+            });
+        }
+        PhaseTimer timer(Stats::Phase::Layout);
+        static const char *kKeyNames[] = {"owner", "group", "extension", "type"};
+        std::string_view key_name = kKeyNames[static_cast<size_t>(m_key)];
+        const SizeFormat& size_format = m_display_flags.size_format;
+        size_t key_width = key_name.size();
+        size_t count_width = std::strlen("count");
+        size_t bytes_width = std::strlen("size");
+        for (const auto& [key, group] : rows) {
+            key_width = std::max(key_width, CountDisplayWidth(key));
+            count_width = std::max(count_width, CountDigits(group.count));
+            bytes_width = std::max(bytes_width, SizeLength(group.bytes, 1, size_format));
+        }
+        WriteRow(key_name, key_name.size(), key_width, "count", count_width, "size", bytes_width, "largest");
+        for (const auto& [key, group] : rows) {
+            char count[kSizeBufferLen];
+            char bytes[kSizeBufferLen];
+            size_t count_len = std::to_chars(count, count + sizeof(count), group.count).ptr - count;
+            size_t bytes_len = FormatSize(group.bytes, 1, size_format, bytes);
+            WriteRow(key, CountDisplayWidth(key), key_width, std::string_view(count, count_len), count_width,
+                     std::string_view(bytes, bytes_len), bytes_width, group.largest);
+        }
+        CountStats(Stats::Counter::EntriesListed, rows.size());
+        m_out.Flush();
+    }
+private:
+    struct Group {
+        uint64_t count = 0;
+        uint64_t bytes = 0;
+        uint64_t largest_bytes = 0;
+        std::string largest;
+
+        /* Mergeと同じく、並んだときはパスの小さい方を選ぶ。どのワーカーがどの順に辿っても同じ結果にする */
+        void Add(const std::string& dir, std::string_view name, uint64_t size) {
+            if (count++ == 0 || size > largest_bytes
+                || (size == largest_bytes && JoinedPathLess(dir, name, largest))) {
+                largest_bytes = size;
+                largest = JoinPath(dir, name);
+            }
+            bytes += size;
+        }
+
+        /* JoinPath(dir, name) < pathを、空ファイルのように並ぶことが多くても文字列を作らずに比べる */
+        static bool JoinedPathLess(const std::string& dir, std::string_view name, std::string_view path) {
+            std::string_view pieces[] = {dir, dir.empty() || dir.back() != '/' ? "/" : "", name};
+            for (std::string_view piece : pieces) {
+                size_t n = std::min(piece.size(), path.size());
+                int compared = piece.compare(0, n, path.substr(0, n));
+                if (compared != 0) {
+                    return compared < 0;
+                }
+                if (n < piece.size()) {
+                    return false;
+                }
+                path.remove_prefix(n);
+            }
+            return !path.empty();
+        }
+    };
+
+    /* ワーカーごとの集計。所有者、グループ、種類は数値のまま数え、名前は最後に一度だけ引く。
+       拡張子は8バイトまでならPackPrefixで詰めた値、それより長ければ文字列で数える */
+    struct alignas(64) WorkerGroups {
+        std::unordered_map<uint64_t, Group> by_id;
+        std::unordered_map<std::string, Group> by_extension;
+        /* 拡張子を探すときの使い回しのキー */
+        std::string extension;
+    };
+
+    void Add(WorkerGroups& groups, const std::string& dir, const std::vector<DirectoryEntry>& entries,
+             const std::vector<struct stat>& statuses) {
+        for (size_t i = 0; i < entries.size(); i++) {
+            const struct stat& status = statuses[i];
+            Group *group;
+            switch (m_key) {
+            case SummaryKey::Owner:
+                group = &groups.by_id[status.st_uid];
+                break;
+            case SummaryKey::Group:
+                group = &groups.by_id[status.st_gid];
+                break;
+            case SummaryKey::Type:
+                group = &groups.by_id[status.st_mode & S_IFMT];
+                break;
+            case SummaryKey::Extension:
+            default: {
+                std::string_view extension = ExtensionOf(entries[i].name);
+                // 8バイトまでの拡張子はほぼ全てなので、整数に詰めて数え文字列を作らない
+                if (extension.size() <= 8) {
+                    group = &groups.by_id[PackPrefix(extension)];
+                } else {
+                    groups.extension.assign(extension);
+                    group = &groups.by_extension[groups.extension];
+                }
+                break;
+            }
+            }
+            group->Add(dir, entries[i].name, status.st_size);
+        }
+    }
+
+    std::string KeyName(uint64_t id) const {
+        switch (m_key) {
+        case SummaryKey::Owner:
+            return UserName(static_cast<uid_t>(id));
+        case SummaryKey::Group:
+            return GroupName(static_cast<gid_t>(id));
+        case SummaryKey::Extension: {
+            // ファイル名には\0が無いので、詰めた値の\0は拡張子の終わりを表す
+            std::string extension;
+            for (int shift = 56; shift >= 0 && static_cast<char>(id >> shift) != '\0'; shift -= 8) {
+                extension.push_back(static_cast<char>(id >> shift));
+            }
+            return extension.empty() ? "(none)" : extension;
+        }
+        default:
+            return FiletypeName(static_cast<mode_t>(id));
+        }
+    }
+
+    std::vector<std::pair<std::string, Group>> MergeGroups() {
+        std::unordered_map<std::string, Group> merged;
+        for (auto& groups : m_groups) {
+            for (auto& [id, group] : groups.by_id) {
+                Merge(merged[KeyName(id)], group);
+            }
+            for (auto& [extension, group] : groups.by_extension) {
+                Merge(merged[extension], group);
+            }
+            groups.by_id.clear();
+            groups.by_extension.clear();
+        }
+        return std::vector<std::pair<std::string, Group>>(std::make_move_iterator(merged.begin()),
+                                                          std::make_move_iterator(merged.end()));
+    }
+
+    /* 最大のエントリが並んだときは名前の小さい方を選び、スレッドの数や順によらない結果にする */
+    static void Merge(Group& into, Group& from) {
+        if (into.count == 0 || from.largest_bytes > into.largest_bytes
+            || (from.largest_bytes == into.largest_bytes && from.largest < into.largest)) {
+            into.largest_bytes = from.largest_bytes;
+            into.largest = std::move(from.largest);
+        }
+        into.count += from.count;
+        into.bytes += from.bytes;
+    }
+
+    void WriteRow(std::string_view key, size_t key_display_width, size_t key_width, std::string_view count,
+                  size_t count_width, std::string_view bytes, size_t bytes_width, std::string_view largest) {
+        m_out.Append(key.data(), key.size());
+        AppendSpaces(key_width - key_display_width + 1 + count_width - count.size());
+        m_out.Append(count.data(), count.size());
+        AppendSpaces(1 + bytes_width - bytes.size());
+        m_out.Append(bytes.data(), bytes.size());
+        m_out.Append(' ');
+        m_out.Append(largest.data(), largest.size());
+        m_out.Append('\n');
+    }
+
+    void AppendSpaces(size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            m_out.Append(' ');
+        }
+    }
+
+    DisplayFlags m_display_flags;
+    SummaryKey m_key;
+    bool m_recursive;
+    ParallelWalker m_walker;
+    std::vector<WorkerGroups> m_groups;
+    OutputBuffer m_out;
+};
+
+SummaryKey ParseSummaryKey(const std::string& key) {
+    static const std::pair<const char *, SummaryKey> kKeys[] = {
+        {"owner", SummaryKey::Owner}, {"group", SummaryKey::Group},
+        {"ext", SummaryKey::Extension}, {"type", SummaryKey::Type},
+    };
+    for (const auto& [name, summary_key] : kKeys) {
+        if (key == name) {
+            return summary_key;
+        }
+    }
+    throw cxxopts::OptionParseException("Invalid argument '" + key + "' for --summarize-by");
+}
+
+/* -Rの目録を途中から続けるための状態。pendingの外側の部分木は辿り終えて、その行はoutput_sizeまでに書いてある */
+struct WalkCheckpoint {
+    std::string root;
+    uint64_t output_size = 0;
+    std::vector<std::string> pending;
+};
+
+/* 改行を含むパスもあるので、文字列は "<バイト数>:<バイト列>\n" で書く */
+void WriteCheckpointFile(const std::string& path, const WalkCheckpoint& checkpoint) {
+    std::string tmp_path = path + ".tmp";
+    {
+        FileDescriptor fd(open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+        if (fd.Get() < 0) {
+            throw std::system_error(errno, std::generic_category(), "Cannot write checkpoint");
+        }
+        OutputBuffer out(fd.Get());
+        auto append_string = [&out](const std::string& s) {
+            out.AppendUnsigned(s.size());
+            out.Append(':');
+            out.Append(s.data(), s.size());
+            out.Append('\n');
+        };
+        out.Append("ls-checkpoint 1\n", 16);
+        append_string(checkpoint.root);
+        out.AppendUnsigned(checkpoint.output_size);
+        out.Append('\n');
+        out.AppendUnsigned(checkpoint.pending.size());
+        out.Append('\n');
+        for (const auto& pending : checkpoint.pending) {
+            append_string(pending);
+        }
+        out.Flush();
+        if (fsync(fd.Get()) < 0) {
+            throw std::system_error(errno, std::generic_category(), "Cannot write checkpoint");
+        }
+    }
+    // 書き終えてから置き換えるので、途中で止まっても前のcheckpointが残る
+    if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+        throw std::system_error(errno, std::generic_category(), "Cannot write checkpoint");
+    }
+}
+
+WalkCheckpoint ReadCheckpointFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::system_error(errno, std::generic_category(), "Cannot read checkpoint");
+    }
+    auto invalid = [&path]() {
+        return std::system_error(EINVAL, std::generic_category(), "Invalid checkpoint " + path);
+    };
+    auto read_string = [&]() {
+        size_t len;
+        if (!(in >> len) || in.get() != ':') {
+            throw invalid();
+        }
+        std::string s(len, '\0');
+        if (!in.read(s.data(), len) || in.get() != '\n') {
+            throw invalid();
+        }
+        return s;
+    };
+    std::string header;
+    if (!std::getline(in, header) || header != "ls-checkpoint 1") {
+        throw invalid();
+    }
+    WalkCheckpoint checkpoint;
+    checkpoint.root = read_string();
+    size_t pending;
+    if (!(in >> checkpoint.output_size >> pending) || in.get() != '\n') {
+        throw invalid();
+    }
+    for (size_t i = 0; i < pending; i++) {
+        checkpoint.pending.push_back(read_string());
+    }
+    return checkpoint;
+}
+
+/* -R --format=json: 木全体の目録をJSON Linesで書く。nameはtarget_pathからのパス。
+   checkpoint_pathがあれば、一定の間隔で出力をディスクへ書き出してから、辿り終えていないディレクトリを記録する。
+   resumeならその記録から続け、出力は記録した長さに切り詰めてから書き足すので、各エントリはちょうど1回ずつ書かれる。
+   各ディレクトリの行は、辿り終えた順ではなく1スレッドで辿ったときの順に並べ替えて書くので、
+   スレッド数によらず、中断して続けても、中断しなかったときと同じ出力になる */
+class FilesListerInTreeJson : public FilesLister {
+public:
+    FilesListerInTreeJson(DisplayFlags display_flags, size_t threads, bool one_file_system,
+                          std::string checkpoint_path, std::chrono::nanoseconds checkpoint_interval, bool resume)
+        : m_walker(display_flags, threads, one_file_system),
+          m_checkpoint_path(std::move(checkpoint_path)),
+          m_resume(resume) {
+        if (!m_checkpoint_path.empty()) {
+            // 記録するのは、書き終えた行に続くディレクトリ (m_order)。辿り終えてもまだ書いていないものはやり直す
+            m_walker.SetCheckpoint(checkpoint_interval, [this](const std::vector<std::string>&) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                Checkpoint(m_order);
+            });
+        }
+    }
+
+    void ListFiles(const fs::path& target_path) {
+        m_root = target_path.native();
+        auto visit = [this](size_t, const std::string& dir, std::vector<DirectoryEntry>& entries,
+                            std::vector<struct stat>& statuses, const std::vector<std::string>& subdirectories) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto& visited = m_visited[dir];
+            visited.entries.swap(entries);
+            visited.statuses.swap(statuses);
+            visited.subdirectories = subdirectories;
+            WriteInOrder();
+        };
+        if (!m_resume) {
+            if (!m_checkpoint_path.empty()) {
+                // 書けないことに最初のcheckpointで気付くのでは遅い
+                OutputSize();
+            }
+            m_order.assign(1, m_root);
+            m_walker.WalkTree(target_path, visit);
+        } else {
+            auto checkpoint = ReadCheckpointFile(m_checkpoint_path);
+            if (checkpoint.root != m_root) {
+                throw std::system_error(EINVAL, std::generic_category(),
+                                        "Checkpoint " + m_checkpoint_path + " is for " + checkpoint.root);
+            }
+            // 前回のcheckpointより後に書いた行は、続きを辿るときにもう一度書くので捨てる
+            if (OutputSize() < checkpoint.output_size) {
+                throw std::system_error(EINVAL, std::generic_category(), "The output is shorter than the checkpoint");
+            }
+            if (ftruncate(STDOUT_FILENO, checkpoint.output_size) < 0
+                || lseek(STDOUT_FILENO, checkpoint.output_size, SEEK_SET) < 0) {
+                throw std::system_error(errno, std::generic_category(), "Cannot restore the output to the checkpoint");
+            }
+            m_order = checkpoint.pending;
+            m_walker.WalkTree(target_path, visit, &checkpoint.pending);
+        }
+        if (!m_checkpoint_path.empty()) {
+            // 辿り終えた印として、pendingの無いcheckpointを残す
+            std::lock_guard<std::mutex> lock(m_mutex);
+            Checkpoint({});
+        }
+    }
+
+    void Finish() {
+        m_out.Flush();
+    }
+private:
+    /* checkpointの出力の長さは、標準出力が通常のファイルでなければ測れない */
+    uint64_t OutputSize() const {
+        struct stat status;
+        if (fstat(STDOUT_FILENO, &status) < 0) {
+            throw std::system_error(errno, std::generic_category(), "Cannot stat the output");
+        }
+        if (!S_ISREG(status.st_mode)) {
+            throw std::system_error(EINVAL, std::generic_category(),
+                                    "--checkpoint and --resume need the output redirected to a regular file");
+        }
+        return status.st_size;
+    }
+
+    /* 1スレッドのParallelWalkerと同じく、m_orderの末尾から取り、そのサブディレクトリを積む。
+       末尾のディレクトリをまだ辿り終えていなければ、そこで止めて次のvisitを待つ */
+    void WriteInOrder() {
+        while (!m_order.empty()) {
+            auto it = m_visited.find(m_order.back());
+            if (it == m_visited.end()) {
+                return;
+            }
+            m_order.pop_back();
+            const auto& visited = it->second;
+            {
+                PhaseTimer timer(Stats::Phase::Layout);
+                for (size_t i = 0; i < visited.entries.size(); i++) {
+                    m_path = JoinPath(it->first, visited.entries[i].name);
+                    AppendJsonEntry(m_out, m_path, visited.statuses[i]);
+                }
+                CountStats(Stats::Counter::EntriesListed, visited.entries.size());
+            }
+            m_order.insert(m_order.end(), visited.subdirectories.begin(), visited.subdirectories.end());
+            m_visited.erase(it);
+        }
+    }
+
+    /* m_mutexを持って呼ぶ */
+    void Checkpoint(const std::vector<std::string>& pending) {
+        m_out.Flush();
+        // 再起動でcheckpointだけが残らないよう、出力を先にディスクへ書き出す
+        if (fdatasync(STDOUT_FILENO) < 0) {
+            throw std::system_error(errno, std::generic_category(), "Cannot sync the output");
+        }
+        WriteCheckpointFile(m_checkpoint_path, WalkCheckpoint{m_root, OutputSize(), pending});
+    }
+
+    ParallelWalker m_walker;
+    std::string m_checkpoint_path;
+    bool m_resume;
+    std::string m_root;
+    std::mutex m_mutex;
+    std::string m_path;
+    OutputBuffer m_out;
+    /* 辿り終えたが、まだ書いていないディレクトリ */
+    struct VisitedDirectory {
+        std::vector<DirectoryEntry> entries;
+        std::vector<struct stat> statuses;
+        std::vector<std::string> subdirectories;
+    };
+    std::unordered_map<std::string, VisitedDirectory> m_visited;
+    /* 次に書くディレクトリを末尾に置いた、1スレッドで辿ったときの待ち行列 */
+    std::vector<std::string> m_order;
+};
+
+/* statの結果を列ごとに保持する (structure of arrays)。
+   各列はArrowのバッファと同じ形式なので、そのまま書き出せる */
+struct EntryTable {
+    std::vector<int32_t> name_offsets{0};
+    std::string names;
+    std::vector<int64_t> size;
+    std::vector<uint32_t> mode;
+    std::vector<uint32_t> uid;
+    std::vector<uint32_t> gid;
+    std::vector<int64_t> mtime;
+    std::vector<uint64_t> ino;
+    std::vector<uint64_t> nlink;
+
+    size_t Size() const { return size.size(); }
+
+    void Reserve(size_t rows) {
+        name_offsets.reserve(rows + 1);
+        size.reserve(rows);
+        mode.reserve(rows);
+        uid.reserve(rows);
+        gid.reserve(rows);
+        mtime.reserve(rows);
+        ino.reserve(rows);
+        nlink.reserve(rows);
+    }
+
+    void Clear() {
+        name_offsets.resize(1);
+        names.clear();
+        size.clear();
+        mode.clear();
+        uid.clear();
+        gid.clear();
+        mtime.clear();
+        ino.clear();
+        nlink.clear();
+    }
+
+    void Append(std::string_view filename, const struct stat& status) {
+        names.append(filename);
+        name_offsets.push_back(names.size());
+        size.push_back(status.st_size);
+        mode.push_back(status.st_mode);
+        uid.push_back(status.st_uid);
+        gid.push_back(status.st_gid);
+        mtime.push_back(status.st_mtim.tv_sec * 1000000000LL + status.st_mtim.tv_nsec);
+        ino.push_back(status.st_ino);
+        nlink.push_back(status.st_nlink);
+    }
+};
+
+/* Arrow IPCのメタデータを書くための最小限のFlatBuffersエンコーダ。
+   先頭から順に書き、子オブジェクトへのオフセットは子を書いた後でSetOffsetで埋める */
+class FlatBufferBuilder {
+public:
+    struct Field {
+        uint16_t id;
+        uint8_t size;
+        uint64_t value;
+    };
+
+    FlatBufferBuilder() : m_buf(4, 0) {}
+
+    /* テーブルを書き、fieldsと同じ順で各フィールドの位置を返す。
+       オフセットのフィールドはsize 4で確保しておく */
+    std::vector<size_t> AddTable(const std::vector<Field>& fields, size_t *table_pos) {
+        size_t number_of_slots = 0;
+        for (const auto& field : fields) {
+            number_of_slots = std::max<size_t>(number_of_slots, field.id + 1);
+        }
+        Align(2);
+        size_t vtable = m_buf.size();
+        m_buf.resize(vtable + 4 + 2 * number_of_slots);
+        Align(4);
+        size_t table = m_buf.size();
+        Put<int32_t>(table - vtable);
+        std::vector<size_t> positions;
+        positions.reserve(fields.size());
+        for (const auto& field : fields) {
+            Align(field.size);
+            positions.push_back(m_buf.size());
+            Set<uint16_t>(vtable + 4 + 2 * field.id, m_buf.size() - table);
+            m_buf.resize(m_buf.size() + field.size);
+            std::memcpy(&m_buf[positions.back()], &field.value, field.size);
+        }
+        Set<uint16_t>(vtable, 4 + 2 * number_of_slots);
+        Set<uint16_t>(vtable + 2, m_buf.size() - table);
+        *table_pos = table;
+        return positions;
+    }
+
+    /* 長さの後ろの要素がalignment境界に来るようにベクタを確保し、長さの位置を返す */
+    size_t AddVector(size_t length, size_t element_size, size_t alignment) {
+        while ((m_buf.size() + 4) % alignment != 0) {
+            m_buf.push_back(0);
+        }
+        size_t pos = m_buf.size();
+        Put<uint32_t>(length);
+        m_buf.resize(m_buf.size() + length * element_size);
+        return pos;
+    }
+
+    size_t AddString(std::string_view s) {
+        Align(4);
+        size_t pos = m_buf.size();
+        Put<uint32_t>(s.size());
+        m_buf.insert(m_buf.end(), s.begin(), s.end());
+        m_buf.push_back(0);
+        return pos;
+    }
+
+    template <class T>
+    void Set(size_t pos, T value) {
+        std::memcpy(&m_buf[pos], &value, sizeof(value));
+    }
+
+    void SetOffset(size_t pos, size_t target) {
+        Set<uint32_t>(pos, target - pos);
+    }
+
+    void SetRoot(size_t table) { SetOffset(0, table); }
+
+    /* 8バイト境界まで埋めたバッファを返す */
+    const std::vector<uint8_t>& Finish() {
+        Align(8);
+        return m_buf;
+    }
+private:
+    template <class T>
+    void Put(T value) {
+        m_buf.resize(m_buf.size() + sizeof(value));
+        Set<T>(m_buf.size() - sizeof(value), value);
+    }
+
+    void Align(size_t alignment) {
+        while (m_buf.size() % alignment != 0) {
+            m_buf.push_back(0);
+        }
+    }
+
+    std::vector<uint8_t> m_buf;
 };
 
-TerminalSize LoadTerminalSize() {
-    struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1) {
-        throw std::system_error(errno, std::generic_category(), "Cannot get terminal size information");
+/* EntryTableをArrow IPCのファイル形式 (Feather V2) で書き出す。
+   スキーマやフッタのレイアウトはArrowのSchema.fbs/Message.fbs/File.fbsに従う */
+class ArrowFileWriter {
+public:
+    explicit ArrowFileWriter(OutputBuffer& out) : m_out(out), m_offset(0) {}
+
+    void WriteBatch(const EntryTable& table) {
+        if (m_offset == 0) {
+            WriteHeader();
+        }
+        std::vector<Buffer> buffers = {
+            {nullptr, 0}, {table.name_offsets.data(), table.name_offsets.size() * sizeof(int32_t)},
+            {table.names.data(), table.names.size()},
+            {nullptr, 0}, {table.size.data(), table.size.size() * sizeof(int64_t)},
+            {nullptr, 0}, {table.mode.data(), table.mode.size() * sizeof(uint32_t)},
+            {nullptr, 0}, {table.uid.data(), table.uid.size() * sizeof(uint32_t)},
+            {nullptr, 0}, {table.gid.data(), table.gid.size() * sizeof(uint32_t)},
+            {nullptr, 0}, {table.mtime.data(), table.mtime.size() * sizeof(int64_t)},
+            {nullptr, 0}, {table.ino.data(), table.ino.size() * sizeof(uint64_t)},
+            {nullptr, 0}, {table.nlink.data(), table.nlink.size() * sizeof(uint64_t)},
+        };
+        uint64_t body_length = 0;
+        for (const auto& buffer : buffers) {
+            body_length += Padded(buffer.length, kBodyAlignment);
+        }
+
+        FlatBufferBuilder builder;
+        size_t batch_pos = BuildMessage(builder, kRecordBatch, body_length);
+        size_t batch;
+        auto fields = builder.AddTable({
+            {0, 8, table.Size()},
+            {1, 4, 0},
+            {2, 4, 0},
+        }, &batch);
+        builder.SetOffset(batch_pos, batch);
+        size_t nodes = builder.AddVector(kColumns.size(), 16, 8);
+        builder.SetOffset(fields[1], nodes);
+        for (size_t i = 0; i < kColumns.size(); i++) {
+            builder.Set<int64_t>(nodes + 4 + 16 * i, table.Size());
+            builder.Set<int64_t>(nodes + 4 + 16 * i + 8, 0);
+        }
+        size_t buffer_vector = builder.AddVector(buffers.size(), 16, 8);
+        builder.SetOffset(fields[2], buffer_vector);
+        uint64_t buffer_offset = 0;
+        for (size_t i = 0; i < buffers.size(); i++) {
+            builder.Set<int64_t>(buffer_vector + 4 + 16 * i, buffer_offset);
+            builder.Set<int64_t>(buffer_vector + 4 + 16 * i + 8, buffers[i].length);
+            buffer_offset += Padded(buffers[i].length, kBodyAlignment);
+        }
+
+        Block block{m_offset, 0, body_length};
+        block.metadata_length = WriteMessage(builder.Finish());
+        for (const auto& buffer : buffers) {
+            m_out.Append(static_cast<const char *>(buffer.data), buffer.length);
+            WritePadding(Padded(buffer.length, kBodyAlignment) - buffer.length);
+        }
+        m_offset += body_length;
+        m_blocks.push_back(block);
     }
-    TerminalSize ret;
-    ret.row = ws.ws_row;
-    ret.col = ws.ws_col;
-    return std::move(ret);
-}
 
-bool IsHiddenFile(fs::path target) {
-    std::string filename = target.filename().u8string();
-    return filename[0] == '.';
-}
+    void Finish() {
+        if (m_offset == 0) {
+            WriteHeader();
+        }
+        static const char end_of_stream[] = {'\xff', '\xff', '\xff', '\xff', 0, 0, 0, 0};
+        Write(end_of_stream, sizeof(end_of_stream));
 
-std::vector<fs::directory_entry>
-ListSortedFiles(fs::path target_path, bool ignore_hidden_file = false) {
-    auto iter = fs::directory_iterator(target_path);
-    std::vector filepaths(begin(iter), end(iter));
-    std::sort(std::begin(filepaths), std::end(filepaths));
-    std::vector<fs::directory_entry> ret;
-    ret.reserve(filepaths.size());
-    for (auto filepath : filepaths) {
-        if (ignore_hidden_file && IsHiddenFile(filepath)) {
-            continue;
+        FlatBufferBuilder builder;
+        size_t footer;
+        auto fields = builder.AddTable({
+            {0, 2, kMetadataVersionV5},
+            {1, 4, 0},
+            {2, 4, 0},
+            {3, 4, 0},
+        }, &footer);
+        builder.SetRoot(footer);
+        BuildSchema(builder, fields[1]);
+        builder.SetOffset(fields[2], builder.AddVector(0, 24, 8));
+        size_t blocks = builder.AddVector(m_blocks.size(), 24, 8);
+        builder.SetOffset(fields[3], blocks);
+        for (size_t i = 0; i < m_blocks.size(); i++) {
+            builder.Set<int64_t>(blocks + 4 + 24 * i, m_blocks[i].offset);
+            builder.Set<int32_t>(blocks + 4 + 24 * i + 8, m_blocks[i].metadata_length);
+            builder.Set<int64_t>(blocks + 4 + 24 * i + 16, m_blocks[i].body_length);
         }
-        ret.push_back(filepath);
+        const auto& data = builder.Finish();
+        Write(data.data(), data.size());
+        int32_t footer_length = data.size();
+        Write(&footer_length, sizeof(footer_length));
+        Write("ARROW1", 6);
     }
-    ret.shrink_to_fit();
-    return std::move(ret);
-}
+private:
+    struct Column {
+        const char *name;
+        uint8_t type;
+        int32_t bit_width;
+        bool is_signed;
+    };
 
-size_t CountDisplayWidth(std::string s) {
-    size_t len_src = s.length();
-    std::unique_ptr<wchar_t []> buf(new wchar_t [len_src + 1]);
-    size_t len_dest = std::mbstowcs(buf.get(), s.c_str(), len_src);
-    return wcswidth(buf.get(), len_dest);
-}
+    struct Buffer {
+        const void *data;
+        size_t length;
+    };
 
-enum class Align {
-    Left,
-    Right,
-};
+    struct Block {
+        uint64_t offset;
+        int32_t metadata_length;
+        uint64_t body_length;
+    };
 
-std::string FitsStringToTargetWidth(std::string s, size_t target_width, Align aligned) {
-    size_t len = s.length();
-    size_t display_width = CountDisplayWidth(s);
-    if (target_width < display_width) {
-        return "";
+    static constexpr uint64_t kMetadataVersionV5 = 4;
+    static constexpr uint8_t kSchema = 1;
+    static constexpr uint8_t kRecordBatch = 3;
+    static constexpr uint8_t kTypeInt = 2;
+    static constexpr uint8_t kTypeUtf8 = 5;
+    static constexpr uint8_t kTypeTimestamp = 10;
+    static constexpr uint64_t kTimeUnitNanosecond = 3;
+    static constexpr size_t kBodyAlignment = 64;
+    static constexpr std::array<Column, 8> kColumns = {{
+        {"name",  kTypeUtf8,      0,  false},
+        {"size",  kTypeInt,       64, true},
+        {"mode",  kTypeInt,       32, false},
+        {"uid",   kTypeInt,       32, false},
+        {"gid",   kTypeInt,       32, false},
+        {"mtime", kTypeTimestamp, 64, true},
+        {"inode", kTypeInt,       64, false},
+        {"nlink", kTypeInt,       64, false},
+    }};
+
+    static uint64_t Padded(uint64_t length, uint64_t alignment) {
+        return (length + alignment - 1) / alignment * alignment;
     }
-    size_t padding = target_width - display_width;
-    size_t pos = 0;
-    if (aligned == Align::Right) {
-        pos = padding;
+
+    void WriteHeader() {
+        Write("ARROW1\0\0", 8);
+        FlatBufferBuilder builder;
+        size_t schema_pos = BuildMessage(builder, kSchema, 0);
+        BuildSchema(builder, schema_pos);
+        WriteMessage(builder.Finish());
     }
-    std::string ret(s.length() + padding, ' ');
-    s.copy(&ret.data()[pos], ret.length());
-    return ret;
-}
 
-class FilesListerInColumns : public FilesLister {
-public:
-    FilesListerInColumns(DisplayFlags display_flags)
-        : m_terminal_size(LoadTerminalSize()),
-          m_display_flags(display_flags) {}
-    ~FilesListerInColumns() = default;
+    /* Messageテーブルを書き、ヘッダ (Schema/RecordBatch) を指すフィールドの位置を返す */
+    static size_t BuildMessage(FlatBufferBuilder& builder, uint8_t header_type, uint64_t body_length) {
+        size_t message;
+        auto fields = builder.AddTable({
+            {0, 2, kMetadataVersionV5},
+            {1, 1, header_type},
+            {2, 4, 0},
+            {3, 8, body_length},
+        }, &message);
+        builder.SetRoot(message);
+        return fields[2];
+    }
 
-    void ListFiles(fs::path target_path) {
-        auto filepaths = ListSortedFiles(target_path, m_display_flags.ignore_hidden_file);
-        size_t display_len = 0;
-        std::vector<std::string> files;
-        files.reserve(filepaths.size());
-        for (const auto& file : filepaths) {
-            std::string filename = file.path().filename().generic_u8string();
-            files.push_back(filename);
-            display_len = std::max(display_len, CountDisplayWidth(filename) + 2);
+    static void BuildSchema(FlatBufferBuilder& builder, size_t schema_pos) {
+        size_t schema;
+        auto schema_fields = builder.AddTable({{0, 2, 0}, {1, 4, 0}}, &schema);
+        builder.SetOffset(schema_pos, schema);
+        size_t columns = builder.AddVector(kColumns.size(), 4, 4);
+        builder.SetOffset(schema_fields[1], columns);
+        for (size_t i = 0; i < kColumns.size(); i++) {
+            const Column& column = kColumns[i];
+            size_t field;
+            auto fields = builder.AddTable({
+                {0, 4, 0},
+                {1, 1, 0},
+                {2, 1, column.type},
+                {3, 4, 0},
+                {5, 4, 0},
+            }, &field);
+            builder.SetOffset(columns + 4 + 4 * i, field);
+            builder.SetOffset(fields[0], builder.AddString(column.name));
+            size_t type;
+            if (column.type == kTypeInt) {
+                builder.AddTable({
+                    {0, 4, static_cast<uint64_t>(column.bit_width)},
+                    {1, 1, column.is_signed},
+                }, &type);
+                builder.SetOffset(fields[3], type);
+            } else if (column.type == kTypeTimestamp) {
+                auto type_fields = builder.AddTable({{0, 2, kTimeUnitNanosecond}, {1, 4, 0}}, &type);
+                builder.SetOffset(fields[3], type);
+                builder.SetOffset(type_fields[1], builder.AddString("UTC"));
+            } else {
+                builder.AddTable({}, &type);
+                builder.SetOffset(fields[3], type);
+            }
+            builder.SetOffset(fields[4], builder.AddVector(0, 4, 4));
         }
-        size_t number_per_onerow = m_terminal_size.col / display_len;
-        size_t number_of_rows = (filepaths.size() + number_per_onerow-1) / number_per_onerow;
-        std::ios::fmtflags prev_flags = std::cout.setf(std::ios::left, std::ios::adjustfield);
-        for (size_t row = 0; row < number_of_rows; row++) {
-            for (size_t col = row; col < files.size(); col += number_of_rows) {
-                std::cout << FitsStringToTargetWidth(files[col], display_len, Align::Left);
+    }
+
+    /* 継続マーカと長さを付けてメッセージを書き、その合計の長さを返す */
+    int32_t WriteMessage(const std::vector<uint8_t>& metadata) {
+        int32_t prefix[2] = {-1, static_cast<int32_t>(metadata.size())};
+        Write(prefix, sizeof(prefix));
+        Write(metadata.data(), metadata.size());
+        return sizeof(prefix) + metadata.size();
+    }
+
+    void Write(const void *data, size_t length) {
+        m_out.Append(static_cast<const char *>(data), length);
+        m_offset += length;
+    }
+
+    void WritePadding(size_t length) {
+        static const char zeros[kBodyAlignment] = {};
+        m_out.Append(zeros, length);
+    }
+
+    OutputBuffer& m_out;
+    uint64_t m_offset;
+    std::vector<Block> m_blocks;
+};
+
+class FilesListerInArrow : public FilesLister {
+public:
+    FilesListerInArrow(DisplayFlags display_flags, size_t batch_size)
+        : m_display_flags(display_flags),
+          m_batch_size(batch_size),
+          m_writer(m_out) {
+        m_table.Reserve(batch_size);
+    }
+    ~FilesListerInArrow() = default;
+
+    void ListFiles(const fs::path& target_path) {
+        std::vector<struct stat> statuses;
+        auto filepaths = ListSortedFiles(target_path, m_display_flags, &statuses);
+        LoadStatuses(SourceOf(m_display_flags), target_path, filepaths, statuses);
+        PhaseTimer timer(Stats::Phase::Layout);
+        for (size_t i = 0; i < filepaths.size(); i++) {
+            m_table.Append(filepaths[i].name, statuses[i]);
+            if (m_table.Size() == m_batch_size) {
+                m_writer.WriteBatch(m_table);
+                m_table.Clear();
             }
-            std::cout << '\n';
         }
-        std::cout.flags(prev_flags);
+    }
+
+    void Finish() {
+        if (m_table.Size() > 0) {
+            m_writer.WriteBatch(m_table);
+            m_table.Clear();
+        }
+        m_writer.Finish();
+        m_out.Flush();
     }
 private:
-    TerminalSize m_terminal_size;
     DisplayFlags m_display_flags;
+    size_t m_batch_size;
+    OutputBuffer m_out;
+    ArrowFileWriter m_writer;
+    EntryTable m_table;
 };
 
-struct FileInfo {
-    std::string filetype_permisson;
-    std::size_t hard_link_count;
-    std::string ownername;
-    std::string groupname;
-    std::size_t bytes;
-    std::string access_time;
-    std::string filename;
-    std::size_t blocks;
-};
+/* inotifyのイベントを反映しながらディレクトリのエントリをファイル名順に保持する */
+class WatchedDirectory {
+public:
+    WatchedDirectory(fs::path target_path, DisplayFlags display_flags, bool load_file_info)
+        : m_target_path(target_path),
+          m_display_flags(display_flags),
+          m_load_file_info(load_file_info),
+          m_inotify(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {
+        if (m_inotify.Get() < 0) {
+            throw std::system_error(errno, std::generic_category(), "Cannot initialize inotify");
+        }
+        uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB
+                      | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+        if (load_file_info) {
+            mask |= IN_MODIFY;
+        }
+        if (inotify_add_watch(m_inotify.Get(), target_path.c_str(), mask) < 0) {
+            throw std::system_error(errno, std::generic_category(), "Cannot watch " + target_path.string());
+        }
+        // 監視を開始してから列挙することで、その間の変更を取りこぼさない
+        Reload();
+    }
 
-std::string FormatFiletypeAndPermission(mode_t mode) {
-    std::string ret;
-    if (S_ISDIR(mode)) {
-        ret += "d";
-    } else if (S_ISLNK(mode)) {
-        ret += "l";
-    } else {
-        ret += "-";
+    int Fd() const { return m_inotify.Get(); }
+
+    const std::map<std::string, FileInfo>& Entries() const { return m_entries; }
+
+    /* 溜まっているイベントを全て反映する。監視対象自体が消えた場合はfalseを返す */
+    bool ApplyPendingEvents() {
+        alignas(struct inotify_event) char buf[64 * 1024];
+        for (;;) {
+            ssize_t len = read(m_inotify.Get(), buf, sizeof(buf));
+            if (len < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN) {
+                    return true;
+                }
+                throw std::system_error(errno, std::generic_category(), "Cannot read inotify events");
+            }
+            for (char *p = buf; p < buf + len; ) {
+                auto event = reinterpret_cast<const struct inotify_event *>(p);
+                p += sizeof(struct inotify_event) + event->len;
+                if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                    return false;
+                }
+                if (event->mask & IN_Q_OVERFLOW) {
+                    Reload();
+                    continue;
+                }
+                if (event->len == 0) {
+                    continue;
+                }
+                std::string filename = event->name;
+                if (m_display_flags.respect_gitignore && filename == ".gitignore") {
+                    // 規則が変わったので全体を絞り込み直す
+                    Reload();
+                    continue;
+                }
+                if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    m_entries.erase(filename);
+                } else if (IsListed(filename, event->mask & IN_ISDIR ? fs::file_type::directory
+                                                                     : fs::file_type::unknown)) {
+                    Update(filename);
+                }
+            }
+        }
     }
-    for (int i = 2; i >= 0; --i) {
-        ret += (mode >> (3*i+2)) & 1 ? "r" : "-";
-        ret += (mode >> (3*i+1)) & 1 ? "w" : "-";
-        ret += (mode >> (3*i))   & 1 ? "x" : "-";
+private:
+    void Reload() {
+        m_entries.clear();
+        if (m_display_flags.respect_gitignore) {
+            m_gitignore.emplace(m_target_path);
+        }
+        for (const auto& entry : ListSortedFiles(m_target_path, m_display_flags)) {
+            Update(entry.name);
+        }
     }
-    return std::move(ret);
-}
 
-FileInfo LoadFileInfo(fs::path target) {
-    struct stat status;
-    if (lstat(target.c_str(), &status) < 0) {
-        throw std::system_error(errno, std::generic_category(), "Cannot execute stat");
-    }
-    FileInfo file_info;
-    file_info.filetype_permisson = FormatFiletypeAndPermission(status.st_mode);
-    file_info.hard_link_count = status.st_nlink;
-    struct passwd* user_info = getpwuid(status.st_uid);
-    if (user_info == nullptr) {
-        throw std::system_error(errno, std::generic_category(), "Cannot get user information");
+    /* イベントで知ったエントリを、Reloadと同じ条件 (隠しファイル、--ignore、--hide、.gitignore) で絞り込む */
+    bool IsListed(const std::string& filename, fs::file_type type) {
+        std::vector<DirectoryEntry> entries{DirectoryEntry{filename, type, 0}};
+        const GitignoreRules *rules = m_gitignore.has_value() ? &*m_gitignore : nullptr;
+        return !FilterEntries(SourceOf(m_display_flags), m_target_path, m_display_flags, rules, entries, nullptr)
+                    .empty();
     }
-    file_info.ownername = user_info->pw_name;
-    struct group* group_info = getgrgid(status.st_gid);
-    if (group_info == nullptr) {
-        throw std::system_error(errno, std::generic_category(), "Cannot group user information");
+
+    void Update(const std::string& filename) {
+        FileInfo file_info;
+        file_info.filename = filename;
+        if (m_load_file_info) {
+            try {
+                file_info = LoadFileInfo(m_target_path / filename);
+            } catch (const std::system_error& e) {
+                // イベントを受け取るまでの間に削除されている
+                if (e.code() != std::errc::no_such_file_or_directory) {
+                    throw;
+                }
+                m_entries.erase(filename);
+                return;
+            }
+        }
+        m_entries[filename] = std::move(file_info);
     }
-    file_info.groupname = group_info->gr_name;
-    file_info.bytes = status.st_size;
-    file_info.access_time = std::ctime(&status.st_atim.tv_sec);
-    file_info.access_time.pop_back(); /* 改行を除く */
-    file_info.filename = target.filename().u8string();
-    file_info.blocks = status.st_blocks;
-    return std::move(file_info);
-}
 
-class FilesListerInLongList : public FilesLister {
+    fs::path m_target_path;
+    DisplayFlags m_display_flags;
+    bool m_load_file_info;
+    FileDescriptor m_inotify;
+    std::optional<GitignoreRules> m_gitignore;
+    std::map<std::string, FileInfo> m_entries;
+};
+
+class FilesListerInWatchMode : public FilesLister {
 public:
-    FilesListerInLongList(DisplayFlags display_flags)
+    FilesListerInWatchMode(DisplayFlags display_flags, bool long_format)
         : m_terminal_size(LoadTerminalSize()),
-          m_display_flags(display_flags) {}
-    ~FilesListerInLongList() = default;
-    void ListFiles(fs::path target_path) {
-        auto filepaths = ListSortedFiles(target_path, m_display_flags.ignore_hidden_file);
-        std::vector<FileInfo> file_infos;
-        size_t total_block = 0;
-        file_infos.reserve(filepaths.size());
-        struct DisplayLen {
-            size_t hard_link_count;
-            size_t filetype_permisson;
-            size_t ownername;
-            size_t groupname;
-            size_t bytes;
-            size_t access_time;
-            size_t filename;
-        } display_len{};
-        display_len.filetype_permisson = 10;
-        display_len.access_time = 24;
-        for (const auto& filepath : filepaths) {
-            auto file_info = LoadFileInfo(filepath);
-            display_len.hard_link_count = std::max(
-                display_len.hard_link_count, std::to_string(file_info.hard_link_count).length()
-            );
-            display_len.ownername = std::max(display_len.ownername, file_info.ownername.length());
-            display_len.groupname = std::max(display_len.groupname, file_info.groupname.length());
-            display_len.bytes = std::max(display_len.bytes, std::to_string(file_info.bytes).length());
-            display_len.filename = std::max(display_len.filename, file_info.filename.length());
-            total_block += file_info.blocks;
-            file_infos.push_back(file_info);
-        }
-
-        const char *fmt = "%*s %*zd %*s %*s %*zd %*s %*s\n";
-
-        // GNU lsがブロックを1024bytes単位で表してるのに対し、statのst_blocksは512bytes単位で表すため、GNU lsに合わせる
-        total_block /= 2;
-        std::cout << "total " << total_block << '\n';
-        for (auto file_info : file_infos) {
-            std::printf(fmt,
-                display_len.filetype_permisson,
-                file_info.filetype_permisson.c_str(),
-                display_len.hard_link_count,
-                file_info.hard_link_count,
-                display_len.ownername,
-                file_info.ownername.c_str(),
-                display_len.groupname,
-                file_info.groupname.c_str(),
-                display_len.bytes,
-                file_info.bytes,
-                display_len.access_time,
-                file_info.access_time.c_str(),
-                -display_len.filename,
-                file_info.filename.c_str()
-            );
+          m_display_flags(display_flags),
+          m_long_format(long_format) {}
+    ~FilesListerInWatchMode() = default;
+
+    void ListFiles(const fs::path& target_path) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGWINCH);
+        if (sigprocmask(SIG_BLOCK, &mask, nullptr) < 0) {
+            throw std::system_error(errno, std::generic_category(), "Cannot block SIGWINCH");
+        }
+        FileDescriptor sigwinch(signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC));
+        if (sigwinch.Get() < 0) {
+            throw std::system_error(errno, std::generic_category(), "Cannot create signalfd");
+        }
+        WatchedDirectory directory(target_path, m_display_flags, m_long_format);
+        m_rows = Render(directory);
+        for (const auto& row : m_rows) {
+            std::cout << row << '\n';
+        }
+        std::cout << std::flush;
+        for (;;) {
+            struct pollfd fds[2] = {
+                {directory.Fd(), POLLIN, 0},
+                {sigwinch.Get(), POLLIN, 0},
+            };
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error(errno, std::generic_category(), "Cannot poll");
+            }
+            if (fds[1].revents & POLLIN) {
+                struct signalfd_siginfo info;
+                while (read(sigwinch.Get(), &info, sizeof(info)) == sizeof(info)) {}
+                m_terminal_size = LoadTerminalSize();
+                Redraw(Render(directory), true);
+            }
+            if (fds[0].revents & POLLIN) {
+                if (!directory.ApplyPendingEvents()) {
+                    return;
+                }
+                Redraw(Render(directory), false);
+            }
         }
     }
 private:
+    std::vector<std::string> Render(const WatchedDirectory& directory) {
+        if (m_long_format) {
+            std::vector<FileInfo> file_infos;
+            file_infos.reserve(directory.Entries().size());
+            for (const auto& entry : directory.Entries()) {
+                file_infos.push_back(entry.second);
+            }
+            return FormatLongList(file_infos, m_display_flags.size_format);
+        }
+        std::vector<std::string> files;
+        files.reserve(directory.Entries().size());
+        for (const auto& entry : directory.Entries()) {
+            files.push_back(entry.first);
+        }
+        return LayoutInColumns(files, m_terminal_size.col);
+    }
+
+    /* 前回の描画から変化した行だけを書き換える */
+    void Redraw(const std::vector<std::string>& rows, bool relayout) {
+        if (!relayout && rows == m_rows) {
+            return;
+        }
+        std::string out;
+        size_t lines = std::max(rows.size(), m_rows.size());
+        if (relayout || lines >= m_terminal_size.row) {
+            // 画面に収まらない場合はカーソル移動で戻れないため、全体を描き直す
+            out += "\x1b[H\x1b[2J";
+            for (const auto& row : rows) {
+                out += row;
+                out += '\n';
+            }
+        } else {
+            if (!m_rows.empty()) {
+                out += "\x1b[" + std::to_string(m_rows.size()) + "F";
+            }
+            for (size_t i = 0; i < lines; i++) {
+                if (i < rows.size() && i < m_rows.size() && rows[i] == m_rows[i]) {
+                    out += "\x1b[1E";
+                    continue;
+                }
+                out += "\x1b[2K";
+                if (i < rows.size()) {
+                    out += rows[i];
+                }
+                out += '\n';
+            }
+            if (m_rows.size() > rows.size()) {
+                out += "\x1b[" + std::to_string(m_rows.size() - rows.size()) + "F";
+            }
+        }
+        std::cout << out << std::flush;
+        m_rows = rows;
+    }
+
     TerminalSize m_terminal_size;
     DisplayFlags m_display_flags;
+    bool m_long_format;
+    std::vector<std::string> m_rows;
 };
 } /* unnamed namespace */
 
@@ -248,11 +5871,238 @@ Ls::Ls(
     std::vector<std::string> args,
     cxxopts::ParseResult opts)
         : target_paths(args) {
+    if (opts.count("stats")) {
+        static Stats stats;
+        g_stats = &stats;
+    }
+    if (opts.count("perf-counters")) {
+        static PerfCounters perf;
+        if (perf.Available()) {
+            g_perf = &perf;
+        } else {
+            std::cerr << "perf counters are not available: " << perf.Error() << std::endl;
+        }
+    }
+    if (opts.count("trace")) {
+        static Tracer tracer;
+        g_tracer = &tracer;
+        m_trace_path = opts["trace"].as<std::string>();
+    }
     DisplayFlags display_flags;
     if (opts.count("a")) {
         display_flags.ignore_hidden_file = false;
     }
-    if (opts.count("l")) {
+    std::vector<std::string> ignore_patterns;
+    if (opts.count("ignore")) {
+        ignore_patterns = opts["ignore"].as<std::vector<std::string>>();
+    }
+    // --hideは-aが指定されたら効かない
+    if (opts.count("hide") && display_flags.ignore_hidden_file) {
+        for (const auto& pattern : opts["hide"].as<std::vector<std::string>>()) {
+            ignore_patterns.push_back(pattern);
+        }
+    }
+    if (!ignore_patterns.empty()) {
+        auto pattern_set = std::make_shared<PatternSet>();
+        for (const auto& pattern : ignore_patterns) {
+            pattern_set->Add(pattern, 0);
+        }
+        pattern_set->Compile();
+        display_flags.ignore_patterns = pattern_set;
+    }
+    if (opts.count("respect-gitignore")) {
+        display_flags.respect_gitignore = true;
+    }
+    if (opts.count("where")) {
+        display_flags.where = std::make_shared<Predicate>(opts["where"].as<std::string>());
+    }
+    if (opts.count("block-size")) {
+        display_flags.size_format = ParseBlockSize(opts["block-size"].as<std::string>());
+    }
+    // -hと--siは--block-sizeより優先する
+    if (opts.count("si")) {
+        display_flags.size_format = ParseBlockSize("si");
+    } else if (opts.count("h")) {
+        display_flags.size_format = ParseBlockSize("human-readable");
+    }
+    if (opts.count("s")) {
+        display_flags.show_blocks = true;
+    }
+    const std::pair<const char *, SortKey> sort_options[] = {
+        {"S", SortKey::Size}, {"t", SortKey::Time}, {"X", SortKey::Extension}, {"v", SortKey::Version},
+    };
+    for (const auto& [option, sort_key] : sort_options) {
+        if (!opts.count(option)) {
+            continue;
+        }
+        if (display_flags.sort_key != SortKey::Name) {
+            throw cxxopts::OptionParseException("-S, -t, -X and -v cannot be combined");
+        }
+        display_flags.sort_key = sort_key;
+    }
+    if (opts.count("r")) {
+        display_flags.reverse = true;
+    }
+    if (opts.count("top") && !opts.count("R")) {
+        throw cxxopts::OptionParseException("--top requires -R");
+    }
+    std::string format = opts.count("l") ? "long" : "vertical";
+    if (opts.count("format")) {
+        format = opts["format"].as<std::string>();
+    }
+    if (opts.count("R") && !opts.count("top") && !opts.count("summarize-by") && format != "json") {
+        throw cxxopts::OptionParseException("-R is only supported together with --top, --summarize-by or --format=json");
+    }
+    if ((opts.count("checkpoint") || opts.count("resume")) && (!opts.count("R") || opts.count("top")
+                                                               || opts.count("summarize-by") || format != "json")) {
+        throw cxxopts::OptionParseException("--checkpoint and --resume require -R --format=json");
+    }
+    if (opts.count("top") && (opts.count("head") || opts.count("tail"))) {
+        throw cxxopts::OptionParseException("--top cannot be combined with --head or --tail");
+    }
+    if (opts.count("top")) {
+        display_flags.limit = opts["top"].as<size_t>();
+    }
+    if (opts.count("head") && opts.count("tail")) {
+        throw cxxopts::OptionParseException("--head cannot be combined with --tail");
+    }
+    if (opts.count("head")) {
+        display_flags.limit = opts["head"].as<size_t>();
+    } else if (opts.count("tail")) {
+        display_flags.limit = opts["tail"].as<size_t>();
+        display_flags.limit_from_end = true;
+    }
+    bool long_format = format == "long" || format == "verbose";
+    if (!long_format && format != "vertical" && format != "json" && format != "arrow") {
+        throw cxxopts::OptionParseException("Invalid argument '" + format + "' for --format");
+    }
+    if (opts.count("x") && !opts.count("R") && !opts.count("du") && !opts.count("estimate")) {
+        throw cxxopts::OptionParseException("-x requires -R, --du or --estimate");
+    }
+    double max_iops = opts["max-iops"].as<double>();
+    double max_dirs_per_sec = opts["max-dirs-per-sec"].as<double>();
+    if (!(max_iops >= 0) || !(max_dirs_per_sec >= 0)) {
+        throw cxxopts::OptionParseException("--max-iops and --max-dirs-per-sec must not be negative");
+    }
+    if (max_iops > 0 || max_dirs_per_sec > 0) {
+        display_flags.source = std::make_shared<RateLimitedDirectorySource>(display_flags.source, max_iops,
+                                                                            max_dirs_per_sec);
+    }
+    if (opts.count("low-priority")) {
+        LowerPriority();
+    }
+    if (opts.count("timeout")) {
+        // 期限を気にするのは1つのディレクトリを一覧する2つの形式だけ
+        if (opts.count("R") || opts.count("du") || opts.count("summarize-by") || opts.count("count")
+            || opts.count("estimate") || opts.count("watch") || (format != "long" && format != "verbose"
+                                                                 && (format != "vertical" || opts.count("s")))) {
+            throw cxxopts::OptionParseException("--timeout is only supported with -l or the default format without -s");
+        }
+        display_flags.deadline = std::chrono::steady_clock::now() + ParseDuration(opts["timeout"].as<std::string>());
+    }
+    if (opts.count("estimate")) {
+        if (opts.count("R") || opts.count("du") || opts.count("summarize-by") || opts.count("count")
+            || opts.count("watch") || display_flags.limit != SIZE_MAX || format == "json" || format == "arrow") {
+            throw cxxopts::OptionParseException("--estimate cannot be combined with -R, --du, --summarize-by, "
+                                                "--count, --watch, --head, --tail, --format=json or --format=arrow");
+        }
+        double budget = opts["time-budget"].as<double>();
+        if (!(budget >= 0)) {
+            throw cxxopts::OptionParseException("--time-budget must not be negative");
+        }
+        m_file_lister = std::unique_ptr<FilesLister>(
+            new FilesListerInEstimate(display_flags,
+                                      std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                          std::chrono::duration<double>(budget)),
+                                      opts.count("x") != 0, target_paths.size() > 1)
+        );
+    } else if (opts.count("count")) {
+        if (opts.count("R") || opts.count("du") || opts.count("summarize-by") || opts.count("watch")
+            || display_flags.limit != SIZE_MAX || format == "json" || format == "arrow") {
+            throw cxxopts::OptionParseException("--count cannot be combined with -R, --du, --summarize-by, --watch, "
+                                                "--head, --tail, --format=json or --format=arrow");
+        }
+        m_file_lister = std::unique_ptr<FilesLister>(
+            new FilesListerInCount(display_flags, target_paths.size() > 1)
+        );
+    } else if (opts.count("summarize-by")) {
+        if (opts.count("top") || opts.count("du") || opts.count("watch") || display_flags.limit != SIZE_MAX
+            || format == "json" || format == "arrow") {
+            throw cxxopts::OptionParseException("--summarize-by cannot be combined with --top, --du, --watch, "
+                                                "--head, --tail, --format=json or --format=arrow");
+        }
+        m_file_lister = std::unique_ptr<FilesLister>(
+            new FilesListerInSummary(display_flags, ParseSummaryKey(opts["summarize-by"].as<std::string>()),
+                                     opts.count("R") != 0, opts["threads"].as<size_t>(), opts.count("x") != 0)
+        );
+    } else if (opts.count("du")) {
+        if (opts.count("R") || opts.count("watch") || opts.count("where") || format == "json" || format == "arrow") {
+            throw cxxopts::OptionParseException("--du cannot be combined with -R, --watch, --where, --format=json or --format=arrow");
+        }
+        m_file_lister = std::unique_ptr<FilesLister>(
+            new FilesListerInDiskUsage(display_flags, opts["threads"].as<size_t>(), opts.count("x") != 0)
+        );
+    } else if (opts.count("R") && format == "json" && !opts.count("top")) {
+        if (opts.count("watch") || display_flags.limit != SIZE_MAX) {
+            throw cxxopts::OptionParseException("-R --format=json cannot be combined with --watch, --head or --tail");
+        }
+        // --resumeは読んだcheckpointに書き足していく
+        std::string checkpoint_path = opts.count("resume") ? opts["resume"].as<std::string>()
+                                    : opts.count("checkpoint") ? opts["checkpoint"].as<std::string>() : "";
+        double interval = opts["checkpoint-interval"].as<double>();
+        if (!(interval > 0)) {
+            throw cxxopts::OptionParseException("--checkpoint-interval must be positive");
+        }
+        if (target_paths.size() > 1) {
+            throw cxxopts::OptionParseException("-R --format=json takes at most one directory");
+        }
+        m_file_lister = std::unique_ptr<FilesLister>(
+            new FilesListerInTreeJson(display_flags, opts["threads"].as<size_t>(), opts.count("x") != 0,
+                                      checkpoint_path,
+                                      std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                          std::chrono::duration<double>(interval)),
+                                      opts.count("resume") != 0)
+        );
+    } else if (opts.count("R")) {
+        if (opts.count("watch") || format == "json" || format == "arrow") {
+            throw cxxopts::OptionParseException("-R cannot be combined with --watch or --format=" + format);
+        }
+        m_file_lister = std::unique_ptr<FilesLister>(
+            new FilesListerInTreeTop(display_flags, long_format, opts["threads"].as<size_t>(), opts.count("x") != 0)
+        );
+    } else if (opts.count("watch")) {
+        if (opts.count("where")) {
+            throw cxxopts::OptionParseException("--watch cannot be combined with --where");
+        }
+        if (format == "json" || format == "arrow") {
+            throw cxxopts::OptionParseException("--watch cannot be combined with --format=" + format);
+        }
+        if (opts.count("s")) {
+            throw cxxopts::OptionParseException("--watch cannot be combined with -s");
+        }
+        // 監視中の一覧は名前順の木で持っている
+        if (display_flags.sort_key != SortKey::Name || display_flags.reverse || display_flags.limit != SIZE_MAX) {
+            throw cxxopts::OptionParseException("--watch only lists all entries in name order");
+        }
+        if (target_paths.size() > 1) {
+            throw cxxopts::OptionParseException("--watch takes at most one directory");
+        }
+        m_file_lister = std::unique_ptr<FilesLister>(
+            new FilesListerInWatchMode(display_flags, long_format)
+        );
+    } else if (format == "json") {
+        m_file_lister = std::unique_ptr<FilesLister>(
+            new FilesListerInJson(display_flags)
+        );
+    } else if (format == "arrow") {
+        size_t batch_size = opts["batch-size"].as<size_t>();
+        if (batch_size == 0) {
+            throw cxxopts::OptionParseException("--batch-size must be positive");
+        }
+        m_file_lister = std::unique_ptr<FilesLister>(
+            new FilesListerInArrow(display_flags, batch_size)
+        );
+    } else if (long_format) {
         m_file_lister = std::unique_ptr<FilesLister>(
             new FilesListerInLongList(display_flags)
         );
@@ -263,12 +6113,30 @@ Ls::Ls(
     }
 }
 
-void Ls::Run() {
+int Ls::Run() {
     if (target_paths.size() == 0) {
         m_file_lister->ListFiles(".");
-        return;
     }
-    for (auto target_path : target_paths) {
+    for (const auto& target_path : target_paths) {
         m_file_lister->ListFiles(target_path);
     }
+    m_file_lister->Finish();
+    if (g_stats != nullptr) {
+        g_stats->Print(std::cerr);
+    }
+    if (g_perf != nullptr) {
+        g_perf->Print(std::cerr);
+    }
+    if (g_tracer != nullptr) {
+        Tracer *tracer = g_tracer;
+        g_tracer = nullptr;
+        FileDescriptor fd(open(m_trace_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+        if (fd.Get() < 0) {
+            throw std::system_error(errno, std::generic_category(), "Cannot open trace file");
+        }
+        OutputBuffer out(fd.Get());
+        tracer->Write(out);
+        out.Flush();
+    }
+    return m_file_lister->ExitStatus();
 }
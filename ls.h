@@ -11,7 +11,11 @@ namespace fs = std::filesystem;
 
 class FilesLister {
 public:
-    virtual void ListFiles(fs::path target_path) = 0;
+    virtual void ListFiles(const fs::path& target_path) = 0;
+    /* 全てのパスを列挙し終えた後に呼ばれる */
+    virtual void Finish() {}
+    /* Finishの後に呼ばれ、プロセスの終了ステータスを返す */
+    virtual int ExitStatus() const { return 0; }
     virtual ~FilesLister() {}
 };
 
@@ -19,10 +23,12 @@ class Ls {
 public:
     Ls(std::vector<std::string> args, cxxopts::ParseResult opts);
     ~Ls() = default;
-    void Run();
+    /* 終了ステータスを返す */
+    int Run();
 private:
     std::vector<std::string> target_paths;
     std::unique_ptr<FilesLister> m_file_lister;
+    std::string m_trace_path;
 };
 
 #endif /* LS_H */
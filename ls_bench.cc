@@ -0,0 +1,305 @@
+#include <benchmark/benchmark.h>
+#include <clocale>
+#include <cstdlib>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <string>
+#include <tuple>
+#include <unistd.h>
+#include <vector>
+#include "ls.cc"
+#include "ls.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+/* ファイル名順に並べたエントリをパスとして返す */
+std::vector<fs::path>
+ListSortedFiles(const fs::path& target_path, bool ignore_hidden_file = false) {
+    DisplayFlags display_flags;
+    display_flags.ignore_hidden_file = ignore_hidden_file;
+    std::vector<fs::path> ret;
+    for (const auto& entry : ListSortedFiles(target_path, display_flags)) {
+        ret.push_back(target_path / entry.name);
+    }
+    return ret;
+}
+
+/* 1e7件のディレクトリは作るだけで時間がかかるため、既定では1e5件までにする */
+int64_t MaxEntries() {
+    const char *env = std::getenv("LS_BENCH_MAX_ENTRIES");
+    return env != nullptr ? std::atoll(env) : 100000;
+}
+
+std::vector<int64_t> EntryCounts() {
+    std::vector<int64_t> counts;
+    for (int64_t count = 100; count <= std::max<int64_t>(MaxEntries(), 100); count *= 10) {
+        counts.push_back(count);
+    }
+    return counts;
+}
+
+/* i番目のファイル名を作る。multibyteなら半分の文字を3バイトの文字にする */
+std::string MakeName(size_t i, size_t name_length, bool multibyte) {
+    static const char *kana[] = {"あ", "い", "う", "え", "お", "か", "き", "く", "け", "こ"};
+    std::string digits = std::to_string(i);
+    std::string name;
+    for (size_t c = 0; c < name_length; c++) {
+        char digit = c < digits.size() ? digits[digits.size() - 1 - c] : 'a' + c % 26;
+        if (multibyte && c % 2 == 1) {
+            name += kana[digit % 10];
+        } else {
+            name += digit;
+        }
+    }
+    return name;
+}
+
+class Fixtures {
+public:
+    ~Fixtures() {
+        if (!m_root.empty()) {
+            std::error_code ec;
+            fs::remove_all(m_root, ec);
+        }
+    }
+
+    /* 指定した件数と名前の空ファイルを持つディレクトリを返す。同じ条件なら使い回す */
+    const fs::path& Directory(size_t count, size_t name_length, bool multibyte) {
+        auto key = std::make_tuple(count, name_length, multibyte);
+        auto it = m_directories.find(key);
+        if (it != m_directories.end()) {
+            return it->second;
+        }
+        if (m_root.empty()) {
+            std::string temp = (fs::temp_directory_path() / "ls_bench.XXXXXX").string();
+            m_root = mkdtemp(temp.data());
+        }
+        fs::path dir = m_root / (std::to_string(count) + "_" + std::to_string(name_length)
+                                 + (multibyte ? "_mb" : "_ascii"));
+        fs::create_directory(dir);
+        for (size_t i = 0; i < count; i++) {
+            int fd = open((dir / MakeName(i, name_length, multibyte)).c_str(), O_CREAT | O_WRONLY, 0644);
+            close(fd);
+        }
+        return m_directories.emplace(key, dir).first->second;
+    }
+private:
+    fs::path m_root;
+    std::map<std::tuple<size_t, size_t, bool>, fs::path> m_directories;
+};
+
+Fixtures fixtures;
+
+/* ベンチマーク中だけ標準出力を/dev/nullに向ける */
+class StdoutToDevNull {
+public:
+    StdoutToDevNull() : m_saved(dup(STDOUT_FILENO)) {
+        std::fflush(stdout);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        close(null);
+    }
+    ~StdoutToDevNull() {
+        std::cout.flush();
+        std::fflush(stdout);
+        dup2(m_saved, STDOUT_FILENO);
+        close(m_saved);
+    }
+private:
+    int m_saved;
+};
+
+void BM_ListSortedFiles(benchmark::State& state) {
+    const auto& dir = fixtures.Directory(state.range(0), state.range(1), state.range(2));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(ListSortedFiles(dir, true));
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ListSortedFiles)
+    ->ArgsProduct({EntryCounts(), {8, 64}, {0, 1}})
+    ->ArgNames({"entries", "name_len", "multibyte"})
+    ->Unit(benchmark::kMillisecond);
+
+void BM_CountDisplayWidth(benchmark::State& state) {
+    std::vector<std::string> names;
+    for (size_t i = 0; i < 1024; i++) {
+        names.push_back(MakeName(i, state.range(0), state.range(1)));
+    }
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(CountDisplayWidth(names[i++ % names.size()]));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CountDisplayWidth)
+    ->ArgsProduct({{8, 64, 255}, {0, 1}})
+    ->ArgNames({"name_len", "multibyte"});
+
+void BM_FitsStringToTargetWidth(benchmark::State& state) {
+    std::vector<std::string> names;
+    for (size_t i = 0; i < 1024; i++) {
+        names.push_back(MakeName(i, state.range(0), state.range(1)));
+    }
+    size_t target_width = state.range(0) * 2 + 2;
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(FitsStringToTargetWidth(names[i++ % names.size()], target_width, Align::Left));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FitsStringToTargetWidth)
+    ->ArgsProduct({{8, 64, 255}, {0, 1}})
+    ->ArgNames({"name_len", "multibyte"});
+
+void BM_FormatFiletypeAndPermission(benchmark::State& state) {
+    const mode_t modes[] = {S_IFREG | 0644, S_IFDIR | 0755, S_IFLNK | 0777, S_IFREG | 0600};
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(FormatFiletypeAndPermission(modes[i++ % 4]));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FormatFiletypeAndPermission);
+
+void BM_LoadFileInfo(benchmark::State& state) {
+    const auto& dir = fixtures.Directory(state.range(0), 16, false);
+    auto entries = ListSortedFiles(dir, true);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(LoadFileInfo(entries[i++ % entries.size()]));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LoadFileInfo)
+    ->ArgsProduct({EntryCounts()})
+    ->ArgNames({"entries"});
+
+template <class Lister>
+void BM_ListFiles(benchmark::State& state) {
+    const auto& dir = fixtures.Directory(state.range(0), state.range(1), state.range(2));
+    Lister lister(DisplayFlags(), TerminalSize{50, 200});
+    StdoutToDevNull redirect;
+    uint64_t allocations = g_allocation_count;
+    for (auto _ : state) {
+        lister.ListFiles(dir);
+        std::cout.flush();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.counters["allocs/entry"] = static_cast<double>(g_allocation_count - allocations)
+                                     / (state.iterations() * state.range(0));
+}
+BENCHMARK_TEMPLATE(BM_ListFiles, FilesListerInColumns)
+    ->ArgsProduct({EntryCounts(), {8, 64}, {0, 1}})
+    ->ArgNames({"entries", "name_len", "multibyte"})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_ListFiles, FilesListerInLongList)
+    ->ArgsProduct({EntryCounts(), {8, 64}, {0, 1}})
+    ->ArgNames({"entries", "name_len", "multibyte"})
+    ->Unit(benchmark::kMillisecond);
+/* カーネルを介さない合成のディレクトリ "/memory" を持つソース。100万件規模でもソートと整形だけを測れる */
+std::shared_ptr<const MemoryDirectorySource> MemorySource(size_t count) {
+    static std::map<size_t, std::shared_ptr<MemoryDirectorySource>> sources;
+    auto& source = sources[count];
+    if (source == nullptr) {
+        source = std::make_shared<MemoryDirectorySource>();
+        struct stat status{};
+        status.st_mode = S_IFREG | 0644;
+        status.st_nlink = 1;
+        for (size_t i = 0; i < count; i++) {
+            status.st_size = i * 7919 % 1000003;
+            status.st_mtim.tv_sec = 1600000000 + i;
+            // 列挙順がソート済みにならないように名前の並びを崩す
+            source->Add("/memory", MakeName(i * 2654435761u % count, 16, false), status);
+        }
+    }
+    return source;
+}
+
+template <class Lister>
+void BM_ListFilesInMemory(benchmark::State& state) {
+    DisplayFlags display_flags;
+    display_flags.source = MemorySource(state.range(0));
+    Lister lister(display_flags, TerminalSize{50, 200});
+    StdoutToDevNull redirect;
+    for (auto _ : state) {
+        lister.ListFiles("/memory");
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_TEMPLATE(BM_ListFilesInMemory, FilesListerInColumns)
+    ->ArgsProduct({{1000, 100000, 1000000}})
+    ->ArgNames({"entries"})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_ListFilesInMemory, FilesListerInLongList)
+    ->ArgsProduct({{1000, 100000, 1000000}})
+    ->ArgNames({"entries"})
+    ->Unit(benchmark::kMillisecond);
+
+void BM_SummarizeInMemory(benchmark::State& state) {
+    DisplayFlags display_flags;
+    display_flags.source = MemorySource(state.range(0));
+    auto key = static_cast<SummaryKey>(state.range(1));
+    StdoutToDevNull redirect;
+    for (auto _ : state) {
+        FilesListerInSummary lister(display_flags, key, false, 1);
+        lister.ListFiles("/memory");
+        lister.Finish();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SummarizeInMemory)
+    ->ArgsProduct({{1000000},
+                   {static_cast<int64_t>(SummaryKey::Owner), static_cast<int64_t>(SummaryKey::Extension),
+                    static_cast<int64_t>(SummaryKey::Type)}})
+    ->ArgNames({"entries", "key"})
+    ->Unit(benchmark::kMillisecond);
+
+/* キーを作ってから並べ替えるまで。エントリの列挙とstatは含めない */
+void BM_SortEntries(benchmark::State& state) {
+    size_t count = state.range(0);
+    std::vector<DirectoryEntry> entries;
+    std::vector<struct stat> statuses(count);
+    for (size_t i = 0; i < count; i++) {
+        size_t shuffled = i * 2654435761u % count;
+        entries.push_back(DirectoryEntry{"release-" + std::to_string(shuffled % 97) + "." + std::to_string(shuffled)
+                                         + (shuffled % 3 == 0 ? ".tar.gz" : ".log"),
+                                         fs::file_type::regular, i});
+        statuses[i].st_size = shuffled * 7919 % 1000003;
+        statuses[i].st_mtim.tv_sec = 1600000000 + shuffled % 86400;
+    }
+    auto sort_key = static_cast<SortKey>(state.range(1));
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto copied_entries = entries;
+        auto copied_statuses = statuses;
+        state.ResumeTiming();
+        SortEntries(copied_entries, copied_statuses, sort_key);
+        benchmark::DoNotOptimize(copied_entries.data());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_SortEntries)
+    ->ArgsProduct({{100000, 1000000},
+                   {static_cast<int64_t>(SortKey::Name), static_cast<int64_t>(SortKey::Size), static_cast<int64_t>(SortKey::Time),
+                    static_cast<int64_t>(SortKey::Extension), static_cast<int64_t>(SortKey::Version)}})
+    ->ArgNames({"entries", "key"})
+    ->Unit(benchmark::kMillisecond);
+} /* unnamed namespace */
+
+int main(int argc, char **argv) {
+    // マルチバイト文字の表示幅を測るためにUTF-8のロケールが要る
+    if (std::setlocale(LC_CTYPE, "") == nullptr || MB_CUR_MAX == 1) {
+        std::setlocale(LC_CTYPE, "C.UTF-8");
+    }
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
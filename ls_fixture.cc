@@ -0,0 +1,288 @@
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+#include "cxxopts.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+/* 実装によって結果が変わらないように、乱数と分布は自前で持つ (splitmix64) */
+class Random {
+public:
+    explicit Random(uint64_t seed) : m_state(seed) {}
+
+    uint64_t Next() {
+        uint64_t z = (m_state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    /* [low, high] の一様分布 */
+    uint64_t Uniform(uint64_t low, uint64_t high) {
+        return low + Next() % (high - low + 1);
+    }
+
+    /* 確率pでtrue */
+    bool Bernoulli(double p) {
+        return (Next() >> 11) * (1.0 / (1ULL << 53)) < p;
+    }
+
+    /* [1, high] の対数一様分布。ファイルサイズのように桁がばらつく値に使う */
+    uint64_t LogUniform(uint64_t high) {
+        int bits = 64 - __builtin_clzll(std::max<uint64_t>(high, 1));
+        uint64_t top = 1ULL << Uniform(0, bits - 1);
+        return std::min(high, top + Next() % top);
+    }
+private:
+    uint64_t m_state;
+};
+
+struct Parameters {
+    uint64_t seed;
+    uint64_t depth;
+    uint64_t fanout;
+    uint64_t files;
+    uint64_t name_min;
+    uint64_t name_max;
+    double unicode_ratio;
+    uint64_t max_size;
+    bool allocate;
+    uint64_t owners;
+    double symlink_ratio;
+    double hardlink_ratio;
+    uint64_t max_entries;
+};
+
+class FixtureGenerator {
+public:
+    FixtureGenerator(const Parameters& params, fs::path root, std::ostream& manifest)
+        : m_params(params),
+          m_random(params.seed),
+          m_root(root),
+          m_manifest(manifest),
+          m_entries(0),
+          m_chown_failed(false) {}
+
+    void Generate() {
+        fs::create_directories(m_root);
+        m_manifest << "# ls_fixture manifest\n"
+                   << "# seed=" << m_params.seed << '\n'
+                   << "# depth=" << m_params.depth << '\n'
+                   << "# fanout=" << m_params.fanout << '\n'
+                   << "# files=" << m_params.files << '\n'
+                   << "# name_length=" << m_params.name_min << '-' << m_params.name_max << '\n'
+                   << "# unicode_ratio=" << m_params.unicode_ratio << '\n'
+                   << "# max_size=" << m_params.max_size << (m_params.allocate ? " allocated" : " sparse") << '\n'
+                   << "# owners=" << m_params.owners << '\n'
+                   << "# symlink_ratio=" << m_params.symlink_ratio << '\n'
+                   << "# hardlink_ratio=" << m_params.hardlink_ratio << '\n'
+                   << "# type\tpath\tsize\tuid\ttarget\n";
+        GenerateDirectory(fs::path(), 0);
+    }
+
+    uint64_t Entries() const { return m_entries; }
+private:
+    void GenerateDirectory(const fs::path& relative, uint64_t level) {
+        std::unordered_set<std::string> names;
+        uint64_t files = m_params.files == 0 ? 0 : m_random.Uniform(m_params.files / 2, m_params.files * 3 / 2);
+        for (uint64_t i = 0; i < files && m_entries < m_params.max_entries; i++) {
+            fs::path path = relative / UniqueName(names);
+            if (!m_files.empty() && m_random.Bernoulli(m_params.symlink_ratio)) {
+                CreateSymlink(path);
+            } else if (!m_files.empty() && m_random.Bernoulli(m_params.hardlink_ratio)) {
+                CreateHardlink(path);
+            } else {
+                CreateFile(path);
+            }
+            m_entries++;
+        }
+        if (level == m_params.depth) {
+            return;
+        }
+        uint64_t subdirectories = m_params.fanout == 0 ? 0 : m_random.Uniform(1, m_params.fanout * 2 - 1);
+        for (uint64_t i = 0; i < subdirectories && m_entries < m_params.max_entries; i++) {
+            fs::path path = relative / UniqueName(names);
+            fs::create_directory(m_root / path);
+            uint32_t uid = Chown(path);
+            m_manifest << "d\t" << path.string() << "\t0\t" << uid << "\t\n";
+            m_entries++;
+            GenerateDirectory(path, level + 1);
+        }
+    }
+
+    void CreateFile(const fs::path& path) {
+        fs::path full_path = m_root / path;
+        int fd = open(full_path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "Cannot create " + full_path.string());
+        }
+        uint64_t size = m_params.max_size == 0 || m_random.Bernoulli(0.1) ? 0 : m_random.LogUniform(m_params.max_size);
+        int error = 0;
+        if (size > 0) {
+            // 既定では疎なファイルにして、ディスクを使わずにst_sizeだけを揃える
+            error = m_params.allocate ? posix_fallocate(fd, 0, size) : (ftruncate(fd, size) < 0 ? errno : 0);
+        }
+        close(fd);
+        if (error != 0) {
+            throw std::system_error(error, std::generic_category(), "Cannot resize " + full_path.string());
+        }
+        uint32_t uid = Chown(path);
+        m_files.push_back(path);
+        m_manifest << "f\t" << path.string() << '\t' << size << '\t' << uid << "\t\n";
+    }
+
+    void CreateSymlink(const fs::path& path) {
+        const fs::path& target = m_files[m_random.Uniform(0, m_files.size() - 1)];
+        fs::path link_target = target.lexically_relative(path.parent_path());
+        fs::create_symlink(link_target, m_root / path);
+        uint32_t uid = Chown(path);
+        m_manifest << "l\t" << path.string() << "\t0\t" << uid << '\t' << link_target.string() << '\n';
+    }
+
+    void CreateHardlink(const fs::path& path) {
+        const fs::path& target = m_files[m_random.Uniform(0, m_files.size() - 1)];
+        fs::create_hard_link(m_root / target, m_root / path);
+        m_manifest << "h\t" << path.string() << "\t0\t-\t" << target.string() << '\n';
+    }
+
+    /* 所有者をowners人に散らす。権限が無ければ諦めて現在のuidのままにする。
+       権限の有無で後の名前やサイズが変わらないよう、乱数は常に同じだけ引く */
+    uint32_t Chown(const fs::path& path) {
+        uint32_t uid = getuid();
+        if (m_params.owners == 0) {
+            return uid;
+        }
+        uint32_t owner = kFirstUid + m_random.Uniform(0, m_params.owners - 1);
+        if (m_chown_failed) {
+            return uid;
+        }
+        if (lchown((m_root / path).c_str(), owner, owner) < 0) {
+            std::cerr << "ls_fixture: cannot change owners (" << std::strerror(errno) << "), keeping uid " << uid << std::endl;
+            m_chown_failed = true;
+            return uid;
+        }
+        return owner;
+    }
+
+    std::string UniqueName(std::unordered_set<std::string>& names) {
+        for (;;) {
+            std::string name = RandomName();
+            if (names.insert(name).second) {
+                return name;
+            }
+        }
+    }
+
+    std::string RandomName() {
+        static const char ascii[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-";
+        // 全角 (表示幅2)、アクセント付きラテン文字、絵文字 (4バイト)
+        static const char *unicode[] = {"あ", "ア", "漢", "字", "é", "ü", "ñ", "ß", "😀", "🚀"};
+        bool use_unicode = m_random.Bernoulli(m_params.unicode_ratio);
+        uint64_t length = m_random.Uniform(m_params.name_min, m_params.name_max);
+        std::string name;
+        for (uint64_t i = 0; i < length; i++) {
+            if (use_unicode && m_random.Bernoulli(0.5)) {
+                name += unicode[m_random.Uniform(0, std::size(unicode) - 1)];
+            } else {
+                name += ascii[m_random.Uniform(0, sizeof(ascii) - 2)];
+            }
+        }
+        if (name == "." || name == "..") {
+            name += '_';
+        }
+        return name;
+    }
+
+    static constexpr uint32_t kFirstUid = 10000;
+
+    Parameters m_params;
+    Random m_random;
+    fs::path m_root;
+    std::ostream& m_manifest;
+    uint64_t m_entries;
+    bool m_chown_failed;
+    std::vector<fs::path> m_files;
+};
+} /* unnamed namespace */
+
+int main(int argc, char *argv[]) {
+    cxxopts::Options options("ls_fixture", "Create a deterministic directory tree for benchmarking ls.");
+    options.add_options()
+        ("seed", "random seed", cxxopts::value<uint64_t>()->default_value("1"))
+        ("depth", "depth of subdirectories", cxxopts::value<uint64_t>()->default_value("2"))
+        ("fanout", "average number of subdirectories per directory", cxxopts::value<uint64_t>()->default_value("4"))
+        ("files", "average number of files per directory", cxxopts::value<uint64_t>()->default_value("100"))
+        ("name-min", "minimum name length in characters", cxxopts::value<uint64_t>()->default_value("4"))
+        ("name-max", "maximum name length in characters", cxxopts::value<uint64_t>()->default_value("24"))
+        ("unicode-ratio", "fraction of names containing non-ASCII characters", cxxopts::value<double>()->default_value("0.1"))
+        ("max-size", "maximum file size in bytes (log-uniform)", cxxopts::value<uint64_t>()->default_value("1048576"))
+        ("allocate", "allocate file data instead of creating sparse files")
+        ("owners", "number of distinct owners (needs privileges to chown)", cxxopts::value<uint64_t>()->default_value("0"))
+        ("symlink-ratio", "fraction of entries that are symbolic links", cxxopts::value<double>()->default_value("0.02"))
+        ("hardlink-ratio", "fraction of entries that are hard links", cxxopts::value<double>()->default_value("0.01"))
+        ("max-entries", "stop after creating this many entries", cxxopts::value<uint64_t>()->default_value("18446744073709551615"))
+        ("manifest", "write the manifest to FILE (default: DIR.manifest)", cxxopts::value<std::string>())
+        ("help", "display this help and exit")
+    ;
+    try {
+        options.custom_help("[OPTION]... DIR");
+        auto result = options.parse(argc, argv);
+        if (result.count("help") || result.unmatched().size() != 1) {
+            std::cout << options.help() << std::endl;
+            std::exit(result.count("help") ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        Parameters params;
+        params.seed = result["seed"].as<uint64_t>();
+        params.depth = result["depth"].as<uint64_t>();
+        params.fanout = result["fanout"].as<uint64_t>();
+        params.files = result["files"].as<uint64_t>();
+        params.name_min = std::max<uint64_t>(result["name-min"].as<uint64_t>(), 1);
+        params.name_max = std::max(result["name-max"].as<uint64_t>(), params.name_min);
+        params.unicode_ratio = result["unicode-ratio"].as<double>();
+        params.max_size = result["max-size"].as<uint64_t>();
+        params.allocate = result.count("allocate") > 0;
+        params.owners = result["owners"].as<uint64_t>();
+        params.symlink_ratio = result["symlink-ratio"].as<double>();
+        params.hardlink_ratio = result["hardlink-ratio"].as<double>();
+        params.max_entries = result["max-entries"].as<uint64_t>();
+        fs::path root = result.unmatched()[0];
+        if (fs::exists(root) && !fs::is_empty(root)) {
+            std::cerr << "ls_fixture: " << root.string() << " is not empty" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        std::string manifest_path = root.lexically_normal().string();
+        while (manifest_path.size() > 1 && manifest_path.back() == '/') {
+            manifest_path.pop_back();
+        }
+        manifest_path += ".manifest";
+        if (result.count("manifest")) {
+            manifest_path = result["manifest"].as<std::string>();
+        }
+        std::ofstream manifest(manifest_path);
+        if (!manifest) {
+            throw std::system_error(errno, std::generic_category(), "Cannot open " + manifest_path);
+        }
+        FixtureGenerator generator(params, root, manifest);
+        generator.Generate();
+        std::cerr << "ls_fixture: created " << generator.Entries() << " entries in " << root.string()
+                  << ", manifest " << manifest_path << std::endl;
+    } catch (const cxxopts::OptionException& e) {
+        std::cerr << e.what() << std::endl;
+        std::exit(EXIT_FAILURE);
+    } catch (const std::system_error& e) {
+        std::cerr << e.what() << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+}
@@ -0,0 +1,179 @@
+#include <atomic>
+#include <cstdio>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <string>
+#include <unistd.h>
+#include "ls.cc"
+#include "ls.h"
+
+namespace fs = std::filesystem;
+
+/* 実行ファイルで定義した関数はlibstdc++などからの呼び出しにも優先されるので、
+   ここで数えてからRTLD_NEXTで本物を呼ぶ */
+namespace {
+struct SyscallCounts {
+    std::atomic<bool> enabled{false};
+    std::atomic<uint64_t> stat{0};
+    std::atomic<uint64_t> opendir{0};
+    std::atomic<uint64_t> stdout_write{0};
+} g_syscalls;
+
+template <class Function>
+Function Next(const char *name) {
+    return reinterpret_cast<Function>(dlsym(RTLD_NEXT, name));
+}
+
+void CountStat() {
+    if (g_syscalls.enabled) {
+        g_syscalls.stat++;
+    }
+}
+} /* unnamed namespace */
+
+extern "C" {
+int stat(const char *path, struct stat *buf) noexcept {
+    static auto next = Next<int (*)(const char *, struct stat *)>("stat");
+    CountStat();
+    return next(path, buf);
+}
+
+int lstat(const char *path, struct stat *buf) noexcept {
+    static auto next = Next<int (*)(const char *, struct stat *)>("lstat");
+    CountStat();
+    return next(path, buf);
+}
+
+int fstatat(int dirfd, const char *path, struct stat *buf, int flags) noexcept {
+    static auto next = Next<int (*)(int, const char *, struct stat *, int)>("fstatat");
+    CountStat();
+    return next(dirfd, path, buf, flags);
+}
+
+int statx(int dirfd, const char *path, int flags, unsigned int mask, struct statx *buf) noexcept {
+    static auto next = Next<int (*)(int, const char *, int, unsigned int, struct statx *)>("statx");
+    CountStat();
+    return next(dirfd, path, flags, mask, buf);
+}
+
+DIR *opendir(const char *path) {
+    static auto next = Next<DIR *(*)(const char *)>("opendir");
+    if (g_syscalls.enabled) {
+        g_syscalls.opendir++;
+    }
+    return next(path);
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+    static auto next = Next<ssize_t (*)(int, const void *, size_t)>("write");
+    if (g_syscalls.enabled && fd == STDOUT_FILENO) {
+        g_syscalls.stdout_write++;
+    }
+    return next(fd, buf, count);
+}
+}
+
+/* 数えるのはこのオブジェクトが生きている間だけ */
+class CountSyscalls {
+public:
+    CountSyscalls() {
+        g_syscalls.stat = 0;
+        g_syscalls.opendir = 0;
+        g_syscalls.stdout_write = 0;
+        g_syscalls.enabled = true;
+    }
+    ~CountSyscalls() { g_syscalls.enabled = false; }
+};
+
+class SyscallBudget : public ::testing::Test {
+protected:
+    static constexpr size_t kEntries = 2000;
+
+    void SetUp() override {
+        char dir[] = "ls_syscall_test.XXXXXX";
+        m_dir = mkdtemp(dir);
+        for (size_t i = 0; i < kEntries; i++) {
+            std::string name = "entry_with_a_fairly_long_name_" + std::to_string(i);
+            close(open((m_dir / name).c_str(), O_CREAT | O_WRONLY, 0644));
+        }
+        // 出力は一時ファイルに向けて、書かれたバイト数を後で測る
+        std::fflush(stdout);
+        m_saved_stdout = dup(STDOUT_FILENO);
+        m_output = std::tmpfile();
+        dup2(fileno(m_output), STDOUT_FILENO);
+    }
+
+    void TearDown() override {
+        std::fflush(stdout);
+        dup2(m_saved_stdout, STDOUT_FILENO);
+        close(m_saved_stdout);
+        std::fclose(m_output);
+        fs::remove_all(m_dir);
+    }
+
+    size_t OutputBytes() const {
+        return lseek(fileno(m_output), 0, SEEK_END);
+    }
+
+    /* NSSのキャッシュなどを温めてから、2回目の一覧だけを数える */
+    template <class Lister>
+    void ListTwice(Lister& lister) {
+        lister.ListFiles(m_dir);
+        ftruncate(fileno(m_output), 0);
+        lseek(fileno(m_output), 0, SEEK_SET);
+        CountSyscalls counting;
+        lister.ListFiles(m_dir);
+    }
+
+    fs::path m_dir;
+    int m_saved_stdout;
+    std::FILE *m_output;
+};
+
+TEST_F(SyscallBudget, LongListStatsEachEntryOnce) {
+    FilesListerInLongList lister(DisplayFlags(), TerminalSize{50, 200});
+    ListTwice(lister);
+    // 差し替えが効いていなければ0になるので、上限だけでなく下限も見る
+    EXPECT_EQ(g_syscalls.stat, kEntries);
+    EXPECT_EQ(g_syscalls.opendir, 1);
+}
+
+TEST_F(SyscallBudget, LongListWithWhereReusesStatus) {
+    DisplayFlags display_flags;
+    display_flags.where = std::make_shared<Predicate>("size == 0");
+    FilesListerInLongList lister(display_flags, TerminalSize{50, 200});
+    ListTwice(lister);
+    EXPECT_LE(g_syscalls.stat, kEntries);
+}
+
+TEST_F(SyscallBudget, LongListHeadStatsOnlyKeptEntries) {
+    DisplayFlags display_flags;
+    display_flags.limit = 10;
+    FilesListerInLongList lister(display_flags, TerminalSize{50, 200});
+    ListTwice(lister);
+    EXPECT_EQ(g_syscalls.stat, 10);
+    EXPECT_EQ(g_syscalls.opendir, 1);
+}
+
+TEST_F(SyscallBudget, ColumnsDoNotStat) {
+    FilesListerInColumns lister(DisplayFlags(), TerminalSize{50, 200});
+    ListTwice(lister);
+    EXPECT_EQ(g_syscalls.stat, 0);
+    EXPECT_EQ(g_syscalls.opendir, 1);
+}
+
+TEST_F(SyscallBudget, WritesOncePerBufferFill) {
+    FilesListerInLongList long_lister(DisplayFlags(), TerminalSize{50, 200});
+    ListTwice(long_lister);
+    ASSERT_GT(OutputBytes(), OutputBuffer::kCapacity);
+    EXPECT_GT(g_syscalls.stdout_write, 0);
+    EXPECT_LE(g_syscalls.stdout_write, OutputBytes() / OutputBuffer::kCapacity + 1);
+
+    FilesListerInJson json_lister((DisplayFlags()));
+    ListTwice(json_lister);
+    ASSERT_GT(OutputBytes(), OutputBuffer::kCapacity);
+    EXPECT_LE(g_syscalls.stdout_write, OutputBytes() / OutputBuffer::kCapacity + 1);
+}
@@ -1,9 +1,14 @@
 #include <cstdlib>
+#include <cstring>
 #include <filesystem>
 #include <gtest/gtest.h>
 #include <fstream>
 #include <iostream>
+#include <numeric>
+#include <set>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <unistd.h>
 #include <vector>
 #include "ls.cc"
@@ -11,6 +16,18 @@
 
 namespace fs = std::filesystem;
 
+/* ファイル名順に並べたエントリをパスとして返す */
+std::vector<fs::path>
+ListSortedFiles(const fs::path& target_path, bool ignore_hidden_file = false) {
+    DisplayFlags display_flags;
+    display_flags.ignore_hidden_file = ignore_hidden_file;
+    std::vector<fs::path> ret;
+    for (const auto& entry : ListSortedFiles(target_path, display_flags)) {
+        ret.push_back(target_path / entry.name);
+    }
+    return ret;
+}
+
 std::string MkTempDirAndCreateFiles(std::vector<std::string> files) {
     char filename[] = "XXXXXX";
     const char *temp_dir = mkdtemp(filename);
@@ -94,3 +111,914 @@ TEST(FitsStringToTargetWidth, DisplayWidthIsLargerThanTargetWidth) {
         ""
     );
 }
+
+TEST(LayoutInColumns, FillsColumnsFirst) {
+    setlocale(LC_CTYPE, "");
+    auto rows = LayoutInColumns({"a", "b", "c", "d", "e"}, 9);
+    ASSERT_EQ(rows.size(), 2);
+    EXPECT_EQ(rows[0], "a  c  e  ");
+    EXPECT_EQ(rows[1], "b  d  ");
+}
+
+TEST(LayoutInColumns, EmptyDirectory) {
+    EXPECT_TRUE(LayoutInColumns({}, 80).empty());
+}
+
+std::string FormatSize(uint64_t bytes, uint64_t default_unit, const SizeFormat& format) {
+    char buf[kSizeBufferLen];
+    return std::string(buf, FormatSize(bytes, default_unit, format, buf));
+}
+
+TEST(CountDigits, MatchesDecimalLength) {
+    for (uint64_t value : std::initializer_list<uint64_t>{0, 9, 10, 99, 1000, 1023, 999999999999, UINT64_MAX}) {
+        EXPECT_EQ(CountDigits(value), std::to_string(value).length()) << value;
+    }
+}
+
+TEST(FormatSize, RoundsUpLikeGnuLs) {
+    SizeFormat human = ParseBlockSize("human-readable");
+    EXPECT_EQ(FormatSize(908, 1, human), "908");
+    EXPECT_EQ(FormatSize(1500, 1, human), "1.5K");
+    EXPECT_EQ(FormatSize(10240, 1, human), "10K");
+    EXPECT_EQ(FormatSize(10241, 1, human), "11K");
+    EXPECT_EQ(FormatSize(1024 * 1024 - 1, 1, human), "1.0M");
+    EXPECT_EQ(FormatSize(4096, 1, ParseBlockSize("si")), "4.1k");
+    EXPECT_EQ(FormatSize(1500, 1, SizeFormat()), "1500");
+    EXPECT_EQ(FormatSize(1500, 1024, SizeFormat()), "2");
+    EXPECT_EQ(FormatSize(1500, 1, ParseBlockSize("K")), "2K");
+    EXPECT_EQ(FormatSize(1500, 1, ParseBlockSize("KB")), "2kB");
+    EXPECT_EQ(FormatSize(1500, 1, ParseBlockSize("4KiB")), "1");
+}
+
+TEST(ParseBlockSize, RejectsInvalidSizes) {
+    for (const char *spec : {"", "0", "X", "1KX", "KiBB", "100000E"}) {
+        EXPECT_THROW(ParseBlockSize(spec), cxxopts::OptionParseException) << spec;
+    }
+}
+
+TEST(WatchedDirectory, AppliesCreateAndDelete) {
+    auto temp_dir = MkTempDirAndCreateFiles({"aaa", ".hidden"});
+    WatchedDirectory directory(temp_dir, DisplayFlags(), false);
+    EXPECT_EQ(directory.Entries().size(), 1);
+    std::ofstream(fs::path(temp_dir) / "bbb");
+    std::ofstream(fs::path(temp_dir) / ".ccc");
+    fs::remove(fs::path(temp_dir) / "aaa");
+    EXPECT_TRUE(directory.ApplyPendingEvents());
+    ASSERT_EQ(directory.Entries().size(), 1);
+    EXPECT_EQ(directory.Entries().begin()->first, "bbb");
+    fs::rename(fs::path(temp_dir) / "bbb", fs::path(temp_dir) / "abc");
+    EXPECT_TRUE(directory.ApplyPendingEvents());
+    EXPECT_EQ(directory.Entries().begin()->first, "abc");
+    fs::remove_all(temp_dir);
+    EXPECT_FALSE(directory.ApplyPendingEvents());
+}
+
+TEST(WatchedDirectory, KeepsIgnoreAndGitignoreRules) {
+    auto temp_dir = MkTempDirAndCreateFiles({"a.c"});
+    std::ofstream(fs::path(temp_dir) / ".gitignore") << "build/\n";
+    DisplayFlags display_flags;
+    auto ignore_patterns = std::make_shared<PatternSet>();
+    ignore_patterns->Add("*.o", 0);
+    ignore_patterns->Compile();
+    display_flags.ignore_patterns = ignore_patterns;
+    display_flags.respect_gitignore = true;
+    WatchedDirectory directory(temp_dir, display_flags, false);
+    std::ofstream(fs::path(temp_dir) / "c.o");
+    fs::create_directory(fs::path(temp_dir) / "build");
+    std::ofstream(fs::path(temp_dir) / "d.c");
+    EXPECT_TRUE(directory.ApplyPendingEvents());
+    std::vector<std::string> names;
+    for (const auto& entry : directory.Entries()) {
+        names.push_back(entry.first);
+    }
+    EXPECT_EQ(names, (std::vector<std::string>{"a.c", "d.c"}));
+    fs::remove_all(temp_dir);
+}
+
+std::string ReadOutput(std::FILE *file) {
+    std::string ret;
+    std::rewind(file);
+    char buf[4096];
+    size_t n;
+    while ((n = std::fread(buf, 1, sizeof(buf), file)) > 0) {
+        ret.append(buf, n);
+    }
+    return ret;
+}
+
+TEST(AppendJsonString, EscapesSpecialCharacters) {
+    std::FILE *file = std::tmpfile();
+    {
+        OutputBuffer out(fileno(file));
+        std::string s = "long name with \"quote\" and back\\slash\tand\x01";
+        AppendJsonString(out, s.data(), s.size());
+    }
+    EXPECT_EQ(ReadOutput(file), "\"long name with \\\"quote\\\" and back\\\\slash\\tand\\u0001\"");
+    std::fclose(file);
+}
+
+TEST(AppendJsonString, ReplacesInvalidUtf8) {
+    std::FILE *file = std::tmpfile();
+    {
+        OutputBuffer out(fileno(file));
+        std::string s = "a\xff" "b\xe3\x81" "c\xc0\xaf" "あ";
+        AppendJsonString(out, s.data(), s.size());
+    }
+    EXPECT_EQ(ReadOutput(file), "\"a\xef\xbf\xbd" "b\xef\xbf\xbd\xef\xbf\xbd" "c\xef\xbf\xbd\xef\xbf\xbd" "あ\"");
+    std::fclose(file);
+}
+
+TEST(AppendJsonEntry, WritesMtimeBefore1970AsNegative) {
+    struct stat status{};
+    status.st_mode = S_IFREG | 0644;
+    status.st_mtim.tv_sec = -315619200;
+    std::FILE *file = std::tmpfile();
+    {
+        OutputBuffer out(fileno(file));
+        AppendJsonEntry(out, "old", status);
+    }
+    EXPECT_NE(ReadOutput(file).find(",\"mtime\":-315619200,"), std::string::npos);
+    std::fclose(file);
+}
+
+TEST(AppendJsonEntry, WritesOneLinePerEntry) {
+    auto temp_dir = MkTempDirAndCreateFiles({"マルチバイト"});
+    auto path = fs::path(temp_dir) / "マルチバイト";
+    struct stat status;
+    ASSERT_EQ(lstat(path.c_str(), &status), 0);
+    std::FILE *file = std::tmpfile();
+    {
+        OutputBuffer out(fileno(file));
+        AppendJsonEntry(out, path.filename().native(), status);
+    }
+    std::string line = ReadOutput(file);
+    EXPECT_EQ(line.rfind("{\"name\":\"マルチバイト\",\"type\":\"file\",\"mode\":420,", 0), 0);
+    EXPECT_NE(line.find(",\"size\":0,"), std::string::npos);
+    EXPECT_EQ(line.back(), '\n');
+    std::fclose(file);
+}
+
+TEST(ArrowFileWriter, WritesMagicAndFooter) {
+    auto temp_dir = MkTempDirAndCreateFiles({"aaa", "bbb"});
+    EntryTable table;
+    for (const auto& entry : ListSortedFiles(temp_dir)) {
+        table.Append(entry.filename().native(), LoadStatus(entry));
+    }
+    EXPECT_EQ(table.Size(), 2);
+    EXPECT_EQ(table.names, "aaabbb");
+    EXPECT_EQ(table.name_offsets, (std::vector<int32_t>{0, 3, 6}));
+    std::FILE *file = std::tmpfile();
+    {
+        OutputBuffer out(fileno(file));
+        ArrowFileWriter writer(out);
+        writer.WriteBatch(table);
+        writer.Finish();
+    }
+    std::string data = ReadOutput(file);
+    ASSERT_GT(data.size(), 16);
+    EXPECT_EQ(data.substr(0, 8), std::string("ARROW1\0\0", 8));
+    EXPECT_EQ(data.substr(data.size() - 6), "ARROW1");
+    int32_t footer_length;
+    std::memcpy(&footer_length, &data[data.size() - 10], sizeof(footer_length));
+    EXPECT_EQ(footer_length % 8, 0);
+    EXPECT_LT(footer_length, data.size());
+    std::fclose(file);
+}
+
+TEST(GlobMatcher, MatchesWildcards) {
+    EXPECT_TRUE(GlobMatcher("*.txt").Matches("memo.txt"));
+    EXPECT_FALSE(GlobMatcher("*.txt").Matches("memo.txt.bak"));
+    EXPECT_TRUE(GlobMatcher("a?c").Matches("aあc"));
+    EXPECT_TRUE(GlobMatcher("[a-c]*[!0-9]").Matches("build_x"));
+    EXPECT_FALSE(GlobMatcher("[a-c]*[!0-9]").Matches("build1"));
+}
+
+TEST(Predicate, EvaluatesNameConditionsWithoutStatus) {
+    Predicate where("name == '*.log' && size > 1K");
+    EXPECT_TRUE(where.NeedsStatus());
+    EXPECT_EQ(where.MatchesWithoutStatus("a.txt", fs::file_type::regular), false);
+    EXPECT_EQ(where.MatchesWithoutStatus("a.log", fs::file_type::regular), std::nullopt);
+    Predicate type_only("type == d || name == 'a*'");
+    EXPECT_FALSE(type_only.NeedsStatus());
+    EXPECT_EQ(type_only.MatchesWithoutStatus("bin", fs::file_type::directory), true);
+    EXPECT_EQ(type_only.MatchesWithoutStatus("bin", fs::file_type::regular), false);
+    EXPECT_THROW(Predicate("size >"), cxxopts::OptionParseException);
+    EXPECT_THROW(Predicate("name < x"), cxxopts::OptionParseException);
+    EXPECT_THROW(Predicate("size > 10000p"), cxxopts::OptionParseException);
+    EXPECT_THROW(Predicate("mtime > -100000000000w"), cxxopts::OptionParseException);
+    EXPECT_NO_THROW(Predicate("size > 8191p"));
+}
+
+TEST(ListSortedEntriesIn, FilterByWhere) {
+    auto temp_dir = MkTempDirAndCreateFiles({"aaa", "abb", "bbb"});
+    std::ofstream(fs::path(temp_dir) / "abb") << "12345";
+    DisplayFlags display_flags;
+    display_flags.where = std::make_shared<Predicate>("name == 'a*' && size >= 5");
+    std::vector<struct stat> statuses;
+    auto ret = ListSortedFiles(temp_dir, display_flags, &statuses);
+    ASSERT_EQ(ret.size(), 1);
+    EXPECT_EQ(ret[0].name, "abb");
+    ASSERT_EQ(statuses.size(), 1);
+    EXPECT_EQ(statuses[0].st_size, 5);
+}
+
+TEST(PatternSet, CombinesFastPathsAndDfa) {
+    PatternSet patterns;
+    patterns.Add("Makefile", 0);
+    patterns.Add("build*", 1);
+    patterns.Add("*.o", 2);
+    patterns.Add("*~", 3);
+    patterns.Add("test_?.[ch]", 4);
+    patterns.Compile();
+    EXPECT_EQ(patterns.Match("Makefile"), 0);
+    EXPECT_EQ(patterns.Match("build-debug"), 1);
+    EXPECT_EQ(patterns.Match("main.o"), 2);
+    EXPECT_EQ(patterns.Match("ls.cc~"), 3);
+    EXPECT_EQ(patterns.Match("test_あ.h"), 4);
+    EXPECT_EQ(patterns.Match("build.o"), 2);
+    EXPECT_EQ(patterns.Match("main.oo"), -1);
+    EXPECT_EQ(patterns.Match("test_ab.c"), -1);
+}
+
+TEST(GitignoreRules, LastMatchingRuleWins) {
+    auto temp_dir = MkTempDirAndCreateFiles({"a.log", "keep.log", "main.cc"});
+    fs::create_directory(fs::path(temp_dir) / ".git");
+    fs::create_directory(fs::path(temp_dir) / "build");
+    fs::create_directory(fs::path(temp_dir) / "src");
+    std::ofstream(fs::path(temp_dir) / ".gitignore") << "*.log\n!keep.log\nbuild/\n/src/*.o\n";
+    std::ofstream(fs::path(temp_dir) / "src" / "a.o");
+    std::ofstream(fs::path(temp_dir) / "src" / "b.c");
+    GitignoreRules rules(temp_dir);
+    EXPECT_TRUE(rules.IsIgnored("a.log", false));
+    EXPECT_FALSE(rules.IsIgnored("keep.log", false));
+    EXPECT_TRUE(rules.IsIgnored("build", true));
+    EXPECT_FALSE(rules.IsIgnored("build", false));
+    EXPECT_FALSE(rules.IsIgnored("main.cc", false));
+    GitignoreRules src_rules(fs::path(temp_dir) / "src");
+    EXPECT_TRUE(src_rules.IsIgnored("a.o", false));
+    EXPECT_FALSE(src_rules.IsIgnored("b.c", false));
+    // 入れ子の.gitignoreの**/a/bはどの深さのa/bにも一致する。閉じていない[の行は読み飛ばす
+    fs::create_directories(fs::path(temp_dir) / "src" / "x" / "a");
+    std::ofstream(fs::path(temp_dir) / "src" / ".gitignore") << "[abc\n**/a/b\n";
+    EXPECT_TRUE(GitignoreRules(fs::path(temp_dir) / "src" / "x" / "a").IsIgnored("b", false));
+    EXPECT_TRUE(GitignoreRules(fs::path(temp_dir) / "src" / "a").IsIgnored("b", false));
+    EXPECT_FALSE(GitignoreRules(fs::path(temp_dir) / "src" / "x").IsIgnored("b", false));
+    EXPECT_FALSE(GitignoreRules(fs::path(temp_dir) / "src" / "x" / "a").IsIgnored("c", false));
+    fs::remove_all(temp_dir);
+}
+
+TEST(Stats, CountsEntriesAndSyscalls) {
+    auto temp_dir = MkTempDirAndCreateFiles({"aaa", "bbb", "ccc"});
+    DisplayFlags display_flags;
+    display_flags.where = std::make_shared<Predicate>("size == 0 && name != 'c*'");
+    Stats stats;
+    g_stats = &stats;
+    auto ret = ListSortedFiles(temp_dir, display_flags);
+    g_stats = nullptr;
+    EXPECT_EQ(ret.size(), 2);
+    EXPECT_EQ(stats.Get(Stats::Counter::EntriesRead), 3);
+    EXPECT_EQ(stats.Get(Stats::Counter::EntriesListed), 2);
+    // 名前で除かれたcccはstatしない
+    EXPECT_EQ(stats.Get(Stats::Syscall::Lstat), 2);
+    EXPECT_EQ(stats.Get(Stats::Syscall::OpenDirectory), 1);
+}
+
+TEST(Tracer, MergesSpansFromEachThread) {
+    Tracer tracer;
+    g_tracer = &tracer;
+    {
+        PhaseTimer timer(Stats::Phase::Sort);
+    }
+    std::thread([] {
+        PhaseTimer timer(Stats::Phase::Stat);
+    }).join();
+    g_tracer = nullptr;
+    std::FILE *file = std::tmpfile();
+    {
+        OutputBuffer out(fileno(file));
+        tracer.Write(out);
+    }
+    std::string trace = ReadOutput(file);
+    std::fclose(file);
+    EXPECT_EQ(trace.rfind("{\"traceEvents\":[{\"name\":\"", 0), 0);
+    EXPECT_NE(trace.find("\"name\":\"sort\""), std::string::npos);
+    EXPECT_NE(trace.find("\"name\":\"stat\""), std::string::npos);
+    EXPECT_NE(trace.find("\"tid\":" + std::to_string(gettid()) + "}"), std::string::npos);
+    EXPECT_NE(trace.find("\"dropped_events\":0}}\n"), std::string::npos);
+}
+
+TEST(PerfCounters, DegradesWhenUnavailable) {
+    PerfCounters perf;
+    if (!perf.Available()) {
+        // 仮想マシンやperf_event_paranoidで禁止されている環境
+        EXPECT_FALSE(perf.Error().empty());
+        return;
+    }
+    g_perf = &perf;
+    {
+        PhaseTimer timer(Stats::Phase::Sort);
+        std::vector<int> v(1000);
+        std::iota(v.rbegin(), v.rend(), 0);
+        std::sort(v.begin(), v.end());
+    }
+    // 他のスレッドのフェーズにはこのスレッドのカウンタを使えないので数えない
+    std::thread([] { PhaseTimer timer(Stats::Phase::Layout); }).join();
+    g_perf = nullptr;
+    std::ostringstream os;
+    perf.Print(os);
+    EXPECT_NE(os.str().find("sort"), std::string::npos);
+    std::istringstream lines(os.str());
+    std::string phase, cycles;
+    while (lines >> phase >> cycles && phase != "layout") {
+        lines.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    }
+    EXPECT_TRUE(cycles == "0" || cycles == "n/a") << cycles;
+}
+
+/* ディレクトリを読み、書き出しだけを2回行ったときの2回目のoperator newの回数 */
+template <class Write>
+uint64_t CountWriteAllocations(const std::vector<std::string>& files, Write write) {
+    auto temp_dir = MkTempDirAndCreateFiles(files);
+    auto entries = ListSortedFiles(temp_dir, DisplayFlags());
+    std::vector<struct stat> statuses;
+    LoadStatuses(KernelDirectorySource(), temp_dir, entries, statuses);
+    OutputBuffer out(open("/dev/null", O_WRONLY | O_CLOEXEC));
+    write(out, entries, statuses);
+    uint64_t before = g_allocation_count;
+    write(out, entries, statuses);
+    uint64_t allocations = g_allocation_count - before;
+    fs::remove_all(temp_dir);
+    return allocations;
+}
+
+std::vector<std::string> ManyFileNames(size_t count) {
+    std::vector<std::string> files;
+    for (size_t i = 0; i < count; i++) {
+        files.push_back("a_file_name_longer_than_sso_" + std::to_string(i));
+    }
+    return files;
+}
+
+TEST(Allocations, LongListDoesNotAllocatePerEntry) {
+    auto write = [](OutputBuffer& out, const auto& entries, const auto& statuses) {
+        WriteLongList(out, entries, statuses);
+    };
+    EXPECT_EQ(CountWriteAllocations(ManyFileNames(100), write),
+              CountWriteAllocations(ManyFileNames(1000), write));
+}
+
+TEST(Allocations, ColumnsDoNotAllocatePerEntry) {
+    std::vector<size_t> widths;
+    auto write = [&](OutputBuffer& out, const auto& entries, const auto&) {
+        WriteColumns(out, entries, widths, 80);
+    };
+    EXPECT_EQ(CountWriteAllocations(ManyFileNames(100), write),
+              CountWriteAllocations(ManyFileNames(1000), write));
+}
+
+TEST(KernelDirectorySource, CountsEntriesWithoutAllocatingPerEntry) {
+    auto files = ManyFileNames(1000);
+    files.insert(files.end(), {".hidden", "..also_hidden", ".x"});
+    auto temp_dir = MkTempDirAndCreateFiles(files);
+    KernelDirectorySource source;
+    EXPECT_EQ(source.CountEntries(temp_dir, true), 1000);
+    EXPECT_EQ(source.CountEntries(temp_dir, false), 1003);
+    uint64_t before = g_allocation_count;
+    source.CountEntries(temp_dir, true);
+    EXPECT_LE(g_allocation_count - before, 2);
+    fs::remove_all(temp_dir);
+}
+
+struct stat MakeStatus(mode_t mode, off_t size) {
+    struct stat status{};
+    status.st_mode = mode;
+    status.st_size = size;
+    status.st_nlink = 1;
+    return status;
+}
+
+TEST(WriteLongList, WritesRowsLongerThanOutputBuffer) {
+    std::string name(70000, 'x');
+    std::vector<DirectoryEntry> entries{{name, fs::file_type::regular, 1}, {"y", fs::file_type::regular, 2}};
+    std::vector<struct stat> statuses{MakeStatus(S_IFREG | 0644, 5)};
+    std::FILE *file = std::tmpfile();
+    {
+        OutputBuffer out(fileno(file));
+        // 2行目はstatの無い行として書く
+        WriteLongList(out, entries, statuses, SizeFormat(), false, 1);
+    }
+    std::istringstream in(ReadOutput(file));
+    std::fclose(file);
+    std::vector<std::string> lines;
+    for (std::string line; std::getline(in, line);) {
+        lines.push_back(line);
+    }
+    ASSERT_EQ(lines.size(), 3);
+    EXPECT_EQ(lines[1].substr(lines[1].size() - name.size() - 1), " " + name);
+    EXPECT_EQ(lines[2].size(), lines[1].size());
+    EXPECT_EQ(lines[2].substr(0, 10), "-?????????");
+}
+
+TEST(MemoryDirectorySource, DrivesListingWithoutKernel) {
+    auto source = std::make_shared<MemoryDirectorySource>();
+    source->Add("/virtual", "small", MakeStatus(S_IFREG | 0644, 1));
+    source->Add("/virtual", "large", MakeStatus(S_IFREG | 0644, 1 << 20));
+    source->Add("/virtual", "dir", MakeStatus(S_IFDIR | 0755, 4096));
+    source->Add("/virtual", ".hidden", MakeStatus(S_IFREG | 0644, 1 << 20));
+    DisplayFlags display_flags;
+    display_flags.source = source;
+    display_flags.where = std::make_shared<Predicate>("type == f && size > 1k");
+    std::vector<struct stat> statuses;
+    auto ret = ListSortedFiles("/virtual", display_flags, &statuses);
+    ASSERT_EQ(ret.size(), 1);
+    EXPECT_EQ(ret[0].name, "large");
+    EXPECT_EQ(ret[0].type, fs::file_type::regular);
+    ASSERT_EQ(statuses.size(), 1);
+    EXPECT_EQ(statuses[0].st_size, 1 << 20);
+    EXPECT_THROW(ListSortedFiles("/missing", display_flags), fs::filesystem_error);
+}
+
+TEST(MemoryDirectorySource, InjectsLatencyPerCall) {
+    MemoryDirectorySource source;
+    source.Add("/virtual", "a", MakeStatus(S_IFREG | 0644, 0));
+    source.SetLatency(std::chrono::milliseconds(20), std::chrono::nanoseconds(0));
+    std::vector<DirectoryEntry> entries;
+    auto start = std::chrono::steady_clock::now();
+    source.Enumerate("/virtual", entries);
+    EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(20));
+    EXPECT_EQ(entries.size(), 1);
+}
+
+TEST(FilesListerInLongList, MarksEntriesNotFetchedByDeadline) {
+    auto source = std::make_shared<MemoryDirectorySource>();
+    for (size_t i = 0; i < 100; i++) {
+        source->Add("/slow", "entry" + std::to_string(i), MakeStatus(S_IFREG | 0644, i));
+    }
+    source->Add("/slow", "subdir", MakeStatus(S_IFDIR | 0755, 4096));
+    // statが1件も返らないので、期限までに列挙だけが終わる
+    source->HangStatusesAfter(0);
+    DisplayFlags display_flags;
+    display_flags.source = source;
+    display_flags.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(500);
+    FilesListerInLongList lister(display_flags, TerminalSize{50, 200});
+    testing::internal::CaptureStdout();
+    lister.ListFiles("/slow");
+    lister.Finish();
+    std::string output = testing::internal::GetCapturedStdout();
+    // 止まったstatを待たずに戻る
+    EXPECT_LT(std::chrono::steady_clock::now(), display_flags.deadline + std::chrono::seconds(10));
+    source->Resume();
+    EXPECT_EQ(lister.ExitStatus(), kExitTimedOut);
+    EXPECT_EQ(output.substr(0, output.find('\n', output.find('\n') + 1) + 1),
+              "total 0\n-????????? ? ? ? ?                        ? entry0 \n");
+    EXPECT_NE(output.find("d????????? ? ? ? ?                        ? subdir \n"), std::string::npos);
+}
+
+TEST(FilesListerInLongList, ListsInNameOrderWhenSortStatsMissDeadline) {
+    auto source = std::make_shared<MemoryDirectorySource>();
+    for (size_t i = 0; i < 100; i++) {
+        source->Add("/slow", "entry" + std::to_string(i), MakeStatus(S_IFREG | 0644, i));
+    }
+    // 最初の32件のstatだけが返り、-Sに要る残りのstatは期限に間に合わない
+    source->HangStatusesAfter(32);
+    DisplayFlags display_flags;
+    display_flags.source = source;
+    display_flags.sort_key = SortKey::Size;
+    display_flags.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(500);
+    FilesListerInLongList lister(display_flags, TerminalSize{50, 200});
+    testing::internal::CaptureStdout();
+    lister.ListFiles("/slow");
+    lister.Finish();
+    std::string output = testing::internal::GetCapturedStdout();
+    source->Resume();
+    EXPECT_EQ(lister.ExitStatus(), kExitTimedOut);
+    // 期限までにstatできた先頭の分は名前順で書き、残りは?で書く
+    size_t start = output.find('\n') + 1;
+    std::string first_row = output.substr(start, output.find('\n', start) + 1 - start);
+    EXPECT_EQ(first_row.rfind("-rw-r--r--", 0), 0) << output;
+    EXPECT_EQ(first_row.substr(first_row.size() - 9), " entry0 \n") << output;
+    EXPECT_NE(output.find("? entry99\n"), std::string::npos) << output;
+    size_t loaded_rows = 0;
+    for (size_t pos = 0; (pos = output.find("\n-rw-r--r--", pos)) != std::string::npos; pos++) {
+        loaded_rows++;
+    }
+    EXPECT_EQ(loaded_rows, 32) << output;
+}
+
+TEST(RateLimitedDirectorySource, SharesBudgetAcrossThreads) {
+    auto source = std::make_shared<MemoryDirectorySource>();
+    for (size_t i = 0; i < 25; i++) {
+        source->Add("/limited", "entry" + std::to_string(i), MakeStatus(S_IFREG | 0644, i));
+    }
+    // 容量は0.1秒分の50件なので、4スレッドで100件statすると少なくとも (100 - 50) / 500 = 0.1秒かかる
+    RateLimitedDirectorySource limited(source, 500, 0);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < 4; t++) {
+        threads.emplace_back([&] {
+            std::vector<DirectoryEntry> entries;
+            source->Enumerate("/limited", entries);
+            std::vector<struct stat> statuses;
+            LoadStatuses(limited, "/limited", entries, statuses);
+            EXPECT_EQ(statuses[24].st_size, 24);
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(100));
+}
+
+/* ustar形式のヘッダを1つ書く。中身は0で埋める */
+std::vector<std::string> Names(const std::vector<DirectoryEntry>& entries) {
+    std::vector<std::string> names;
+    for (const auto& entry : entries) {
+        names.push_back(entry.name);
+    }
+    return names;
+}
+
+void WriteTarMember(std::ofstream& out, const std::string& name, char type, size_t size, mode_t mode) {
+    char header[512] = {};
+    std::memcpy(header, name.data(), name.size());
+    std::snprintf(header + 100, 8, "%07o", static_cast<unsigned>(mode));
+    std::snprintf(header + 108, 8, "%07o", 1000u);
+    std::snprintf(header + 116, 8, "%07o", 1000u);
+    std::snprintf(header + 124, 12, "%011zo", size);
+    std::snprintf(header + 136, 12, "%011o", 1600000000u);
+    header[156] = type;
+    std::memcpy(header + 257, "ustar\0" "00", 8);
+    std::memset(header + 148, ' ', 8);
+    unsigned sum = 0;
+    for (unsigned char byte : header) {
+        sum += byte;
+    }
+    std::snprintf(header + 148, 8, "%06o", sum);
+    out.write(header, sizeof(header));
+    std::string padding((size + 511) / 512 * 512, '\0');
+    out.write(padding.data(), padding.size());
+}
+
+TEST(ArchiveDirectorySource, ListsTarMembersAsEntries) {
+    fs::path archive = fs::temp_directory_path() / "ls_test_archive.tar";
+    {
+        std::ofstream out(archive, std::ios::binary);
+        WriteTarMember(out, "dir/", '5', 0, 0755);
+        WriteTarMember(out, "dir/b.txt", '0', 1000, 0644);
+        WriteTarMember(out, "a.txt", '0', 3, 0600);
+        std::string end(1024, '\0');
+        out.write(end.data(), end.size());
+    }
+    auto ret = ListSortedFiles(archive, DisplayFlags());
+    std::vector<struct stat> statuses;
+    LoadStatuses(SourceOf(DisplayFlags()), archive, ret, statuses);
+    fs::remove(archive);
+    ASSERT_EQ(ret.size(), 3);
+    EXPECT_EQ(ret[0].name, "a.txt");
+    EXPECT_EQ(ret[1].name, "dir");
+    EXPECT_EQ(ret[1].type, fs::file_type::directory);
+    EXPECT_EQ(ret[2].name, "dir/b.txt");
+    ASSERT_EQ(statuses.size(), 3);
+    EXPECT_EQ(statuses[0].st_mode, S_IFREG | 0600);
+    EXPECT_EQ(statuses[2].st_size, 1000);
+    EXPECT_EQ(statuses[2].st_mtim.tv_sec, 1600000000);
+}
+
+TEST(ArchiveDirectorySource, StripsLeadingDotSlash) {
+    // tar cf t.tar -C dir . で作ったアーカイブと同じ名前の付け方
+    fs::path archive = fs::temp_directory_path() / "ls_test_dot_archive.tar";
+    {
+        std::ofstream out(archive, std::ios::binary);
+        WriteTarMember(out, "./", '5', 0, 0755);
+        WriteTarMember(out, "./a", '0', 3, 0644);
+        WriteTarMember(out, "./d/", '5', 0, 0755);
+        WriteTarMember(out, "./d/b", '0', 5, 0644);
+        WriteTarMember(out, "/abs", '0', 0, 0644);
+        std::string end(1024, '\0');
+        out.write(end.data(), end.size());
+    }
+    auto ret = ListSortedFiles(archive, DisplayFlags());
+    fs::remove(archive);
+    EXPECT_EQ(Names(ret), (std::vector<std::string>{"a", "abs", "d", "d/b"}));
+}
+
+TEST(ArchiveDirectorySource, PaxSizeOverridesUstarSize) {
+    fs::path archive = fs::temp_directory_path() / "ls_test_pax_archive.tar";
+    {
+        std::ofstream out(archive, std::ios::binary);
+        std::string records = "12 size=600\n";
+        WriteTarMember(out, "PaxHeaders/big", 'x', records.size(), 0644);
+        out.seekp(-512, std::ios::cur);
+        out.write(records.data(), records.size());
+        out.seekp(512 - records.size(), std::ios::cur);
+        // 8GiB以上のメンバーと同じく、ustarの欄は0でデータは600バイトある
+        WriteTarMember(out, "big", '0', 0, 0644);
+        std::string data(1024, 'x');
+        out.write(data.data(), data.size());
+        WriteTarMember(out, "next", '0', 0, 0644);
+        std::string end(1024, '\0');
+        out.write(end.data(), end.size());
+    }
+    auto ret = ListSortedFiles(archive, DisplayFlags());
+    std::vector<struct stat> statuses;
+    LoadStatuses(SourceOf(DisplayFlags()), archive, ret, statuses);
+    fs::remove(archive);
+    EXPECT_EQ(Names(ret), (std::vector<std::string>{"big", "next"}));
+    ASSERT_EQ(statuses.size(), 2);
+    EXPECT_EQ(statuses[0].st_size, 600);
+}
+
+TEST(ArchiveDirectorySource, SkipsNamesLongerThanNameMax) {
+    fs::path archive = fs::temp_directory_path() / "ls_test_long_name_archive.tar";
+    {
+        std::ofstream out(archive, std::ios::binary);
+        // ustarの名前の欄に収まらないので、paxのpathで名前を付ける
+        auto write_pax_member = [&](const std::string& path) {
+            std::string record = " path=" + path + "\n";
+            record = std::to_string(record.size() + 3) + record;
+            WriteTarMember(out, "PaxHeaders/long", 'x', record.size(), 0644);
+            out.seekp(-512, std::ios::cur);
+            out.write(record.data(), record.size());
+            out.seekp(512 - record.size(), std::ios::cur);
+            WriteTarMember(out, "long", '0', 0, 0644);
+        };
+        write_pax_member("d/" + std::string(NAME_MAX + 1, 'x'));
+        write_pax_member(std::string(NAME_MAX, 'y'));
+        std::string end(1024, '\0');
+        out.write(end.data(), end.size());
+    }
+    auto ret = ListSortedFiles(archive, DisplayFlags());
+    fs::remove(archive);
+    EXPECT_EQ(Names(ret), (std::vector<std::string>{std::string(NAME_MAX, 'y')}));
+}
+
+TEST(ArchiveDirectorySource, RejectsOtherFiles) {
+    fs::path file = fs::temp_directory_path() / "ls_test_not_archive";
+    std::ofstream(file) << "plain text";
+    EXPECT_EQ(ArchiveDirectorySource::Open(file), nullptr);
+    EXPECT_THROW(ListSortedFiles(file, DisplayFlags()), fs::filesystem_error);
+    fs::remove(file);
+}
+
+TEST(SortEntries, BySizeAndTimeWithNameTieBreak) {
+    auto source = std::make_shared<MemoryDirectorySource>();
+    auto add = [&](const char *name, off_t size, time_t mtime) {
+        struct stat status = MakeStatus(S_IFREG | 0644, size);
+        status.st_mtim.tv_sec = mtime;
+        source->Add("/virtual", name, status);
+    };
+    add("b", 10, 300);
+    add("a", 10, 100);
+    add("c", 20, -5);
+    DisplayFlags display_flags;
+    display_flags.source = source;
+    display_flags.sort_key = SortKey::Size;
+    std::vector<struct stat> statuses;
+    auto ret = ListSortedFiles("/virtual", display_flags, &statuses);
+    EXPECT_EQ(Names(ret), (std::vector<std::string>{"c", "a", "b"}));
+    ASSERT_EQ(statuses.size(), 3);
+    EXPECT_EQ(statuses[0].st_size, 20);
+    display_flags.sort_key = SortKey::Time;
+    EXPECT_EQ(Names(ListSortedFiles("/virtual", display_flags)), (std::vector<std::string>{"b", "a", "c"}));
+    display_flags.reverse = true;
+    EXPECT_EQ(Names(ListSortedFiles("/virtual", display_flags)), (std::vector<std::string>{"c", "a", "b"}));
+}
+
+TEST(SortEntries, ByExtensionAndVersion) {
+    std::vector<DirectoryEntry> entries;
+    for (const char *name : {"file10", "file2.txt", "file1.10", "file1.9", "a.c", "img01", "img1", "readme",
+                             "a_very_long_common_prefix2", "a_very_long_common_prefix10"}) {
+        entries.push_back(DirectoryEntry{name, fs::file_type::regular, 0});
+    }
+    std::vector<struct stat> statuses;
+    SortEntries(entries, statuses, SortKey::Version);
+    EXPECT_EQ(Names(entries), (std::vector<std::string>{
+        "a.c", "a_very_long_common_prefix2", "a_very_long_common_prefix10", "file1.9", "file1.10",
+        "file2.txt", "file10", "img01", "img1", "readme"}));
+    SortEntries(entries, statuses, SortKey::Extension);
+    EXPECT_EQ(Names(entries), (std::vector<std::string>{
+        "a_very_long_common_prefix10", "a_very_long_common_prefix2", "file10", "img01", "img1", "readme",
+        "file1.10", "file1.9", "a.c", "file2.txt"}));
+}
+
+TEST(SortEntries, HeadAndTailKeepOnlyLimitEntries) {
+    auto source = std::make_shared<MemoryDirectorySource>();
+    for (size_t i = 0; i < 10000; i++) {
+        source->Add("/virtual", "f" + std::to_string(i), MakeStatus(S_IFREG | 0644, i * 7919 % 10007));
+    }
+    DisplayFlags display_flags;
+    display_flags.source = source;
+    display_flags.sort_key = SortKey::Size;
+    display_flags.limit = 3;
+    std::vector<struct stat> statuses;
+    auto ret = ListSortedFiles("/virtual", display_flags, &statuses);
+    ASSERT_EQ(ret.size(), 3);
+    ASSERT_EQ(statuses.size(), 3);
+    EXPECT_EQ(statuses[0].st_size, 10006);
+    EXPECT_EQ(statuses[2].st_size, 10004);
+    display_flags.limit_from_end = true;
+    ret = ListSortedFiles("/virtual", display_flags, &statuses);
+    ASSERT_EQ(statuses.size(), 3);
+    EXPECT_EQ(statuses[0].st_size, 2);
+    EXPECT_EQ(statuses[2].st_size, 0);
+    display_flags.sort_key = SortKey::Name;
+    display_flags.reverse = true;
+    EXPECT_EQ(Names(ListSortedFiles("/virtual", display_flags)), (std::vector<std::string>{"f10", "f1", "f0"}));
+}
+
+std::shared_ptr<MemoryDirectorySource> MakeTree(size_t directories, size_t files_per_directory) {
+    auto source = std::make_shared<MemoryDirectorySource>();
+    source->Add("/tree", ".hidden", MakeStatus(S_IFDIR | 0755, 4096));
+    source->Add("/tree/.hidden", "huge", MakeStatus(S_IFREG | 0644, 1 << 30));
+    for (size_t d = 0; d < directories; d++) {
+        std::string dir = "/tree/d" + std::to_string(d);
+        source->Add("/tree", "d" + std::to_string(d), MakeStatus(S_IFDIR | 0755, 4096));
+        source->Add(dir, "sub", MakeStatus(S_IFDIR | 0755, 4096));
+        for (size_t f = 0; f < files_per_directory; f++) {
+            source->Add(dir, "f" + std::to_string(f), MakeStatus(S_IFREG | 0644, d * files_per_directory + f));
+        }
+        source->Add(dir + "/sub", "g", MakeStatus(S_IFREG | 0644, 1));
+    }
+    return source;
+}
+
+TEST(ParallelWalker, VisitsEachDirectoryOnce) {
+    DisplayFlags display_flags;
+    display_flags.source = MakeTree(50, 10);
+    ParallelWalker walker(display_flags, 4);
+    std::mutex mutex;
+    std::multiset<std::string> visited;
+    std::atomic<size_t> files{0};
+    walker.Walk("/tree", [&](size_t worker, const std::string& dir, std::vector<DirectoryEntry>& entries,
+                             std::vector<struct stat>& statuses) {
+        EXPECT_LT(worker, 4);
+        EXPECT_EQ(entries.size(), statuses.size());
+        files += std::count_if(statuses.begin(), statuses.end(), [](const auto& s) { return S_ISREG(s.st_mode); });
+        std::lock_guard<std::mutex> lock(mutex);
+        visited.insert(dir);
+    });
+    EXPECT_EQ(visited.size(), 101);
+    EXPECT_EQ(visited.count("/tree/d7/sub"), 1);
+    EXPECT_EQ(visited.count("/tree/.hidden"), 0);
+    EXPECT_EQ(files, 50 * 11);
+    EXPECT_THROW(walker.Walk("/missing", [](auto...) {}), fs::filesystem_error);
+}
+
+TEST(ParallelWalker, ResumesFromCheckpointedFrontier) {
+    DisplayFlags display_flags;
+    display_flags.source = MakeTree(50, 10);
+    std::mutex mutex;
+    std::vector<std::string> visited;
+    auto visit = [&](size_t, const std::string& dir, auto&, auto&) {
+        std::lock_guard<std::mutex> lock(mutex);
+        visited.push_back(dir);
+    };
+    // 10回目のcheckpointの時点で辿り終えていたディレクトリと、残りの境界を覚えておく
+    size_t checkpoints = 0;
+    size_t visited_before = 0;
+    WalkCheckpoint checkpoint{"/tree", 0, {}};
+    ParallelWalker walker(display_flags, 2);
+    walker.SetCheckpoint(std::chrono::nanoseconds(0), [&](const std::vector<std::string>& pending) {
+        if (++checkpoints == 10) {
+            std::lock_guard<std::mutex> lock(mutex);
+            visited_before = visited.size();
+            checkpoint.pending = pending;
+        }
+    });
+    walker.Walk("/tree", visit);
+    ASSERT_EQ(visited.size(), 101);
+    ASSERT_FALSE(checkpoint.pending.empty());
+
+    // 改行を含むパスもそのまま読み戻せる
+    checkpoint.pending.push_back("/tree/no\nsuch");
+    char path[] = "ls_test_checkpoint.XXXXXX";
+    close(mkstemp(path));
+    WriteCheckpointFile(path, checkpoint);
+    auto restored = ReadCheckpointFile(path);
+    fs::remove(path);
+    EXPECT_EQ(restored.root, "/tree");
+    EXPECT_EQ(restored.pending, checkpoint.pending);
+    restored.pending.pop_back();
+
+    visited.resize(visited_before);
+    ParallelWalker resumed(display_flags, 2);
+    testing::internal::CaptureStderr();
+    resumed.Walk("/tree", visit, &restored.pending);
+    testing::internal::GetCapturedStderr();
+    std::multiset<std::string> all(visited.begin(), visited.end());
+    EXPECT_EQ(all.size(), 101);
+    EXPECT_EQ(std::set<std::string>(visited.begin(), visited.end()).size(), 101);
+}
+
+TEST(FilesListerInTreeTop, MergesLargestFilesFromEachWorker) {
+    DisplayFlags display_flags;
+    display_flags.source = MakeTree(50, 200);
+    display_flags.sort_key = SortKey::Size;
+    display_flags.limit = 3;
+    FilesListerInTreeTop lister(display_flags, false, 4);
+    testing::internal::CaptureStdout();
+    lister.ListFiles("/tree");
+    lister.Finish();
+    std::string output = testing::internal::GetCapturedStdout();
+    EXPECT_EQ(output, "/tree/d49/f199  \n/tree/d49/f198  \n/tree/d49/f197  \n");
+}
+
+TEST(FilesListerInTreeJson, WritesSameOrderForAnyThreadCount) {
+    DisplayFlags display_flags;
+    display_flags.source = MakeTree(50, 10);
+    auto list = [&](size_t threads) {
+        FilesListerInTreeJson lister(display_flags, threads, false, "", std::chrono::seconds(60), false);
+        testing::internal::CaptureStdout();
+        lister.ListFiles("/tree");
+        lister.Finish();
+        return testing::internal::GetCapturedStdout();
+    };
+    std::string expected = list(1);
+    EXPECT_EQ(std::count(expected.begin(), expected.end(), '\n'), 50 * 13);
+    for (int i = 0; i < 5; i++) {
+        EXPECT_EQ(list(4), expected);
+    }
+}
+
+TEST(FilesListerInSummary, MergesGroupsFromEachWorker) {
+    DisplayFlags display_flags;
+    display_flags.source = MakeTree(3, 4);
+    FilesListerInSummary lister(display_flags, SummaryKey::Type, true, 2);
+    testing::internal::CaptureStdout();
+    lister.ListFiles("/tree");
+    lister.Finish();
+    std::string output = testing::internal::GetCapturedStdout();
+    // サイズが並んだ最大のエントリは名前の小さい方
+    EXPECT_EQ(output, "type      count  size largest\n"
+                      "directory     6 24576 /tree/d0\n"
+                      "file         15    69 /tree/d2/f3\n");
+    EXPECT_THROW(ParseSummaryKey("size"), cxxopts::OptionParseException);
+}
+
+TEST(FilesListerInSummary, BreaksTiesByPathWithinWorker) {
+    auto source = std::make_shared<MemoryDirectorySource>();
+    source->Add("/m", "b", MakeStatus(S_IFREG | 0644, 5));
+    source->Add("/m", "a", MakeStatus(S_IFREG | 0644, 5));
+    source->Add("/m", "a0", MakeStatus(S_IFREG | 0644, 5));
+    DisplayFlags display_flags;
+    display_flags.source = source;
+    FilesListerInSummary lister(display_flags, SummaryKey::Type, true, 1);
+    testing::internal::CaptureStdout();
+    lister.ListFiles("/m");
+    lister.Finish();
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), "type count size largest\n"
+                                                      "file     3   15 /m/a\n");
+}
+
+TEST(TreeEstimator, EstimatesAreUnbiased) {
+    DisplayFlags display_flags;
+    display_flags.source = MakeTree(50, 10);
+    TreeEstimator estimator(display_flags, false, 1);
+    auto result = estimator.Run("/tree", std::chrono::seconds(10), 10000);
+    EXPECT_EQ(result.probes, 10000);
+    EXPECT_EQ(result.directories_read, 101);
+    // 全てのディレクトリが同じ形なので、件数はどの探索でも正確に当たる
+    EXPECT_DOUBLE_EQ(result.files.mean, 50 * 11);
+    EXPECT_DOUBLE_EQ(result.files.half_width, 0);
+    EXPECT_DOUBLE_EQ(result.directories.mean, 101);
+    // バイト数はディレクトリごとに違うので、区間の中に真の値 (0から499の和と50) があるかを見る
+    EXPECT_GT(result.bytes.half_width, 0);
+    EXPECT_NEAR(result.bytes.mean, 499 * 500 / 2 + 50, 3 * result.bytes.half_width);
+    EXPECT_THROW(estimator.Run("/missing", std::chrono::seconds(1)), std::system_error);
+}
+
+TEST(TreeEstimator, WhereCountsFilesWithoutPruningDirectories) {
+    DisplayFlags display_flags;
+    display_flags.source = MakeTree(50, 10);
+    display_flags.where = std::make_shared<Predicate>("name == 'g'");
+    TreeEstimator estimator(display_flags, false, 1);
+    auto result = estimator.Run("/tree", std::chrono::seconds(10), 1000);
+    // d0などは条件に合わないが、その下のsub/gは数える
+    EXPECT_DOUBLE_EQ(result.files.mean, 50);
+    EXPECT_DOUBLE_EQ(result.directories.mean, 101);
+}
+
+TEST(FilesListerInDiskUsage, CountsHardLinksOnce) {
+    auto source = std::make_shared<MemoryDirectorySource>();
+    auto with_blocks = [](struct stat status, blkcnt_t blocks, ino_t ino) {
+        status.st_blocks = blocks;
+        status.st_ino = ino;
+        return status;
+    };
+    struct stat linked = with_blocks(MakeStatus(S_IFREG | 0644, 8192), 16, 5);
+    linked.st_nlink = 2;
+    source->Add("/du", ".hidden", with_blocks(MakeStatus(S_IFREG | 0644, 10), 4, 1));
+    source->Add("/du", "a", with_blocks(MakeStatus(S_IFDIR | 0755, 4096), 8, 2));
+    source->Add("/du", "b", with_blocks(MakeStatus(S_IFDIR | 0755, 4096), 8, 3));
+    source->Add("/du/a", "f", linked);
+    source->Add("/du/b", "g", linked);
+    DisplayFlags display_flags;
+    display_flags.source = source;
+    FilesListerInDiskUsage lister(display_flags, 4, false);
+    testing::internal::CaptureStdout();
+    lister.ListFiles("/du");
+    lister.Finish();
+    std::string output = testing::internal::GetCapturedStdout();
+    // どちらのリンクを先に数えるかは辿る順による
+    EXPECT_TRUE(output == "12\t/du/a\n4\t/du/b\n18\t/du\n" || output == "4\t/du/a\n12\t/du/b\n18\t/du\n") << output;
+}
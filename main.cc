@@ -17,9 +17,47 @@ int main(int argc, char *argv[]) {
     options.add_options()
         ("l", "use a long listing format")
         ("a,all", "do not ignore entries starting with .")
+        ("h,human-readable", "with -l and -s, print sizes like 1K 234M 2G etc.")
+        ("si", "likewise, but use powers of 1000 not 1024")
+        ("block-size", "with -l and -s, scale sizes by SIZE when printing them; e.g., '--block-size=M'", cxxopts::value<std::string>(), "SIZE")
+        ("s,size", "print the allocated size of each file, in blocks")
+        ("S", "sort by file size, largest first")
+        ("t", "sort by time, newest first")
+        ("X", "sort alphabetically by entry extension")
+        ("v", "natural sort of (version) numbers within text")
+        ("r,reverse", "reverse order while sorting")
+        ("head", "list only the first N entries in the sort order, without sorting the rest", cxxopts::value<size_t>(), "N")
+        ("tail", "list only the last N entries in the sort order, without sorting the rest", cxxopts::value<size_t>(), "N")
+        ("R,recursive", "walk subdirectories recursively (with --top, --summarize-by or --format=json)")
+        ("top", "with -R, list the first N files of the whole tree in the sort order, e.g. '-R --top 100 -S'", cxxopts::value<size_t>(), "N")
+        ("estimate", "estimate the number of files, directories and bytes in the tree by random sampling, with 95% confidence intervals")
+        ("time-budget", "seconds to spend sampling with --estimate", cxxopts::value<double>()->default_value("1"), "SECONDS")
+        ("max-iops", "issue at most N directory reads and stats per second across all threads (0: no limit)", cxxopts::value<double>()->default_value("0"), "N")
+        ("max-dirs-per-sec", "read at most N directories per second across all threads (0: no limit)", cxxopts::value<double>()->default_value("0"), "N")
+        ("low-priority", "run with the idle I/O scheduling class and nice 19")
+        ("timeout", "stop waiting for the directory and stat after DURATION (e.g. 500ms, 2s, 1m), mark entries not fetched with '?' and exit with status 3", cxxopts::value<std::string>(), "DURATION")
+        ("count", "print only the number of entries, without sorting or stat")
+        ("checkpoint", "with -R --format=json, periodically record the directories left to walk in FILE", cxxopts::value<std::string>(), "FILE")
+        ("checkpoint-interval", "seconds between checkpoints", cxxopts::value<double>()->default_value("60"), "SECONDS")
+        ("resume", "continue an interrupted -R --format=json from the checkpoint in FILE, appending to the same output", cxxopts::value<std::string>(), "FILE")
+        ("summarize-by", "print the count, total size and largest entry per owner, group, ext or type (with -R, of the whole tree)", cxxopts::value<std::string>(), "KEY")
+        ("du", "print the disk usage of each directory in the tree, counting hard links once")
+        ("x,one-file-system", "with -R, --du or --estimate, skip directories on other file systems")
+        ("threads", "number of threads walking directories with -R or --du (0: one per CPU)", cxxopts::value<size_t>()->default_value("0"), "N")
+        ("where", "list only entries matching EXPR, e.g. 'size > 1G && mtime < -7d && type == f'", cxxopts::value<std::string>())
+        ("format", "output format: long, verbose, vertical, json (one object per line) or arrow (Arrow IPC file)", cxxopts::value<std::string>())
+        ("batch-size", "rows per record batch with --format=arrow", cxxopts::value<size_t>()->default_value("65536"))
+        ("ignore", "do not list entries matching shell PATTERN", cxxopts::value<std::vector<std::string>>(), "PATTERN")
+        ("hide", "do not list entries matching shell PATTERN (overridden by -a)", cxxopts::value<std::vector<std::string>>(), "PATTERN")
+        ("respect-gitignore", "do not list entries ignored by .gitignore")
+        ("watch", "keep listing DIR and update it as entries change")
+        ("stats", "print time per phase, syscall counts and memory usage to stderr")
+        ("perf-counters", "print cycles, instructions, cache and branch misses per phase of the main thread to stderr")
+        ("trace", "write per-thread spans of each phase to FILE in Chrome trace event format", cxxopts::value<std::string>(), "FILE")
         ("help", "display this help and exit")
         ("version", "show version information")
     ;
+    int status = EXIT_SUCCESS;
     try {
         auto result = options.parse(argc, argv);
         options.custom_help("[OPTION]... [FILE]...");
@@ -33,12 +71,18 @@ int main(int argc, char *argv[]) {
         }
         auto args = result.unmatched();
         Ls ls(args, result);
-        ls.Run();
+        status = ls.Run();
     } catch(cxxopts::OptionException e) {
         std::cerr << e.what() << std::endl;
-        std::exit(EXIT_FAILURE);
+        status = EXIT_FAILURE;
     } catch (std::system_error e) {
         std::cerr << e.what() << std::endl;
-        std::exit(EXIT_FAILURE);
+        status = EXIT_FAILURE;
+    }
+    if (status != EXIT_SUCCESS) {
+        // --timeoutで止まったままのスレッドが残っていても、静的オブジェクトを壊さずに終わる。
+        // 後の対象で例外が投げられた場合も同じ
+        std::fflush(nullptr);
+        std::_Exit(status);
     }
 }